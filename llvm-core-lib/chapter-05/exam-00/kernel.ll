@@ -0,0 +1,106 @@
+; Benchmark for passtune: unoptimized IR, as clang -O0 would emit it for
+;
+;   static int data[4096];
+;   static int weight(int x) { return x * x + 3; }
+;   long kernel(int reps) {
+;     long acc = 0;
+;     for (int i = 0; i < 4096; i++)
+;       data[i] = i * 7 % 13;
+;     for (int r = 0; r < reps; r++)
+;       for (int i = 0; i < 4096; i++)
+;         acc += weight(data[i]) ^ r;
+;     return acc;
+;   }
+source_filename = "kernel.ll"
+target datalayout = "e-m:e-p270:32:32-p271:32:32-p272:64:64-i64:64-f80:128-n8:16:32:64-S128"
+target triple = "x86_64-pc-linux-gnu"
+
+@data = internal global [4096 x i32] zeroinitializer, align 16
+
+define internal i32 @weight(i32 %x) {
+entry:
+  %x.addr = alloca i32, align 4
+  store i32 %x, i32* %x.addr, align 4
+  %0 = load i32, i32* %x.addr, align 4
+  %1 = load i32, i32* %x.addr, align 4
+  %mul = mul nsw i32 %0, %1
+  %add = add nsw i32 %mul, 3
+  ret i32 %add
+}
+
+define i64 @kernel(i32 %reps) {
+entry:
+  %reps.addr = alloca i32, align 4
+  %acc = alloca i64, align 8
+  %i = alloca i32, align 4
+  %r = alloca i32, align 4
+  %j = alloca i32, align 4
+  store i32 %reps, i32* %reps.addr, align 4
+  store i64 0, i64* %acc, align 8
+  store i32 0, i32* %i, align 4
+  br label %fill.cond
+
+fill.cond:
+  %0 = load i32, i32* %i, align 4
+  %cmp = icmp slt i32 %0, 4096
+  br i1 %cmp, label %fill.body, label %fill.end
+
+fill.body:
+  %1 = load i32, i32* %i, align 4
+  %mul = mul nsw i32 %1, 7
+  %rem = srem i32 %mul, 13
+  %2 = load i32, i32* %i, align 4
+  %idx = sext i32 %2 to i64
+  %arrayidx = getelementptr inbounds [4096 x i32], [4096 x i32]* @data, i64 0, i64 %idx
+  store i32 %rem, i32* %arrayidx, align 4
+  %3 = load i32, i32* %i, align 4
+  %inc = add nsw i32 %3, 1
+  store i32 %inc, i32* %i, align 4
+  br label %fill.cond
+
+fill.end:
+  store i32 0, i32* %r, align 4
+  br label %outer.cond
+
+outer.cond:
+  %4 = load i32, i32* %r, align 4
+  %5 = load i32, i32* %reps.addr, align 4
+  %cmp1 = icmp slt i32 %4, %5
+  br i1 %cmp1, label %outer.body, label %outer.end
+
+outer.body:
+  store i32 0, i32* %j, align 4
+  br label %inner.cond
+
+inner.cond:
+  %6 = load i32, i32* %j, align 4
+  %cmp2 = icmp slt i32 %6, 4096
+  br i1 %cmp2, label %inner.body, label %inner.end
+
+inner.body:
+  %7 = load i32, i32* %j, align 4
+  %idx2 = sext i32 %7 to i64
+  %arrayidx2 = getelementptr inbounds [4096 x i32], [4096 x i32]* @data, i64 0, i64 %idx2
+  %8 = load i32, i32* %arrayidx2, align 4
+  %call = call i32 @weight(i32 %8)
+  %9 = load i32, i32* %r, align 4
+  %xor = xor i32 %call, %9
+  %conv = sext i32 %xor to i64
+  %10 = load i64, i64* %acc, align 8
+  %add = add nsw i64 %10, %conv
+  store i64 %add, i64* %acc, align 8
+  %11 = load i32, i32* %j, align 4
+  %inc2 = add nsw i32 %11, 1
+  store i32 %inc2, i32* %j, align 4
+  br label %inner.cond
+
+inner.end:
+  %12 = load i32, i32* %r, align 4
+  %inc3 = add nsw i32 %12, 1
+  store i32 %inc3, i32* %r, align 4
+  br label %outer.cond
+
+outer.end:
+  %13 = load i64, i64* %acc, align 8
+  ret i64 %13
+}
@@ -0,0 +1,296 @@
+// In-process pass pipeline benchmark.
+//
+// Builds synthetic modules in the style of makeLLVMModule() in exam0.cpp
+// (alloca/store/load chains feeding an add), scaled up with loops and
+// call chains, then runs a pass pipeline on them for several trials and
+// reports per-pass wall time, instruction count deltas and peak memory.
+//
+//   ../build/passbench -functions=1000 -chains=8 -loops=2 -depth=4
+//                      -passes='mem2reg,instcombine' -trials=5
+
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/Analysis/CGSCCPassManager.h>
+#include <llvm/Analysis/LazyCallGraph.h>
+#include <llvm/Analysis/LoopAnalysisManager.h>
+#include <llvm/Analysis/LoopInfo.h>
+#include <llvm/IR/BasicBlock.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IR/PassInstrumentation.h>
+#include <llvm/IR/PassManager.h>
+#include <llvm/IR/Verifier.h>
+#include <llvm/Passes/PassBuilder.h>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/Format.h>
+#include <llvm/Support/raw_ostream.h>
+#include <chrono>
+#include <sys/resource.h>
+#include <vector>
+
+using namespace llvm;
+
+static cl::opt<unsigned> NumFunctions("functions", cl::init(100),
+    cl::desc("number of generated functions"));
+static cl::opt<unsigned> NumChains("chains", cl::init(4),
+    cl::desc("alloca/store/load chains per function"));
+static cl::opt<unsigned> NumLoops("loops", cl::init(1),
+    cl::desc("loops per function"));
+static cl::opt<unsigned> CallDepth("depth", cl::init(4),
+    cl::desc("length of the call chains between functions"));
+static cl::opt<unsigned> NumTrials("trials", cl::init(3),
+    cl::desc("number of times the pipeline is run"));
+static cl::opt<std::string> Pipeline("passes", cl::init("mem2reg"),
+    cl::desc("pass pipeline, in the syntax of opt -passes="));
+
+static LLVMContext context;
+
+// Build a function "f<Idx>(a, b)" made of NumChains copies of the sum
+// pattern, NumLoops counted loops accumulating into memory, and a call to
+// the next function of its call chain.
+static Function *makeStressFunction(Module *mod, unsigned Idx,
+                                    Function *Callee) {
+  Type *Int32Ty = IntegerType::get(context, 32);
+  FunctionType *FuncTy = FunctionType::get(Int32Ty, {Int32Ty, Int32Ty},
+                                           false);
+  Function *F = Function::Create(FuncTy, GlobalValue::ExternalLinkage,
+                                 "f" + Twine(Idx), mod);
+  Function::arg_iterator args = F->arg_begin();
+  Value *int32_a = args++;
+  Value *int32_b = args++;
+  int32_a->setName("a");
+  int32_b->setName("b");
+
+  BasicBlock *labelEntry = BasicBlock::Create(context, "entry", F);
+  IRBuilder<> Builder(labelEntry);
+
+  AllocaInst *ptrAcc = Builder.CreateAlloca(Int32Ty, nullptr, "acc.addr");
+  Builder.CreateStore(Builder.getInt32(0), ptrAcc);
+
+  // the body of sum(), repeated
+  for (unsigned c = 0; c < NumChains; c++) {
+    AllocaInst *ptrA = Builder.CreateAlloca(Int32Ty, nullptr, "a.addr");
+    AllocaInst *ptrB = Builder.CreateAlloca(Int32Ty, nullptr, "b.addr");
+    Builder.CreateStore(int32_a, ptrA);
+    Builder.CreateStore(int32_b, ptrB);
+    Value *ld0 = Builder.CreateLoad(Int32Ty, ptrA);
+    Value *ld1 = Builder.CreateLoad(Int32Ty, ptrB);
+    Value *add = Builder.CreateAdd(ld0, ld1, "add");
+    Value *acc = Builder.CreateLoad(Int32Ty, ptrAcc);
+    Builder.CreateStore(Builder.CreateAdd(acc, add), ptrAcc);
+  }
+
+  // for (i = 0; i < b; i++) acc += a * i;
+  for (unsigned l = 0; l < NumLoops; l++) {
+    AllocaInst *ptrI = Builder.CreateAlloca(Int32Ty, nullptr, "i.addr");
+    Builder.CreateStore(Builder.getInt32(0), ptrI);
+    BasicBlock *labelCond = BasicBlock::Create(context, "for.cond", F);
+    BasicBlock *labelBody = BasicBlock::Create(context, "for.body", F);
+    BasicBlock *labelEnd = BasicBlock::Create(context, "for.end", F);
+    Builder.CreateBr(labelCond);
+
+    Builder.SetInsertPoint(labelCond);
+    Value *i = Builder.CreateLoad(Int32Ty, ptrI);
+    Builder.CreateCondBr(Builder.CreateICmpSLT(i, int32_b), labelBody,
+                         labelEnd);
+
+    Builder.SetInsertPoint(labelBody);
+    i = Builder.CreateLoad(Int32Ty, ptrI);
+    Value *acc = Builder.CreateLoad(Int32Ty, ptrAcc);
+    Value *mul = Builder.CreateMul(int32_a, i);
+    Builder.CreateStore(Builder.CreateAdd(acc, mul), ptrAcc);
+    Builder.CreateStore(Builder.CreateAdd(i, Builder.getInt32(1)), ptrI);
+    Builder.CreateBr(labelCond);
+
+    Builder.SetInsertPoint(labelEnd);
+  }
+
+  Value *ret = Builder.CreateLoad(Int32Ty, ptrAcc);
+  if (Callee)
+    ret = Builder.CreateAdd(ret, Builder.CreateCall(Callee, {ret, int32_b}));
+  Builder.CreateRet(ret);
+  return F;
+}
+
+static std::unique_ptr<Module> makeStressModule() {
+  auto mod = std::make_unique<Module>("stress.ll", context);
+  mod->setDataLayout("e-p:64:64:64-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:64:64-f32:32:32-f64:64:64-v64:64:64-v128:128:128-a0:0:64-s0:64:64-f80:128:128-n8:16:32:64-S128");
+  mod->setTargetTriple("x86_64-pc-linux-gnu");
+
+  // build backwards so every function can call the next one of its chain
+  Function *Next = nullptr;
+  for (unsigned idx = NumFunctions; idx-- > 0;) {
+    Function *Callee = (idx + 1) % CallDepth ? Next : nullptr;
+    Next = makeStressFunction(mod.get(), idx, Callee);
+  }
+  return mod;
+}
+
+static long getPeakRSSKB() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+static size_t countInstructions(const Function &F) {
+  return F.getInstructionCount();
+}
+
+static size_t countInstructions(const Module &M) {
+  return M.getInstructionCount();
+}
+
+// Instruction count of the IR unit a pass runs on.
+static size_t countInstructions(Any IR) {
+  if (any_isa<const Module *>(IR))
+    return countInstructions(*any_cast<const Module *>(IR));
+  if (any_isa<const Function *>(IR))
+    return countInstructions(*any_cast<const Function *>(IR));
+  if (any_isa<const LazyCallGraph::SCC *>(IR)) {
+    size_t count = 0;
+    for (const LazyCallGraph::Node &N : *any_cast<const LazyCallGraph::SCC *>(IR))
+      count += countInstructions(N.getFunction());
+    return count;
+  }
+  if (any_isa<const Loop *>(IR))
+    return countInstructions(
+        *any_cast<const Loop *>(IR)->getHeader()->getParent());
+  return 0;
+}
+
+struct PassStats {
+  unsigned Runs = 0;
+  double Seconds = 0;
+  long InstDelta = 0;
+  long PeakKB = 0;
+};
+
+// Collects PassStats through the pass instrumentation callbacks. Only
+// leaf passes are recorded: adaptors, nested pass managers and wrappers
+// such as DevirtSCCRepeatedPass or ModuleInlinerWrapperPass run other
+// passes, and their time belongs to the passes they run. Every pass gets
+// a frame on the stack, and a frame that saw a nested pass start is a
+// container.
+class PassTimer {
+  struct Frame {
+    std::chrono::steady_clock::time_point Start;
+    size_t Insts;
+    long PeakKB;
+    bool Nested;
+  };
+  std::vector<Frame> Stack;
+
+public:
+  StringMap<PassStats> Stats;
+  std::vector<std::string> Order;
+
+  // a pass manager or adaptor is a container even when it has nothing to
+  // run on this unit
+  static bool isContainer(StringRef PassID) {
+    return PassID.contains("PassManager") || PassID.contains("PassAdaptor");
+  }
+
+  void registerCallbacks(PassInstrumentationCallbacks &PIC) {
+    PIC.registerBeforeNonSkippedPassCallback([this](StringRef P, Any IR) {
+      if (P.startswith("Verifier"))
+        return;
+      if (!Stack.empty())
+        Stack.back().Nested = true;
+      Stack.push_back({std::chrono::steady_clock::now(),
+                       countInstructions(IR), getPeakRSSKB(), false});
+    });
+    PIC.registerAfterPassCallback(
+        [this](StringRef P, Any IR, const PreservedAnalyses &) {
+          if (!P.startswith("Verifier"))
+            record(P, countInstructions(IR));
+        });
+    PIC.registerAfterPassInvalidatedCallback(
+        [this](StringRef P, const PreservedAnalyses &) {
+          // the unit is gone, count everything it had as removed
+          if (!P.startswith("Verifier"))
+            record(P, 0);
+        });
+  }
+
+  void record(StringRef PassID, size_t InstsAfter) {
+    Frame F = Stack.back();
+    Stack.pop_back();
+    if (F.Nested || isContainer(PassID))
+      return;
+    std::chrono::duration<double> Elapsed =
+        std::chrono::steady_clock::now() - F.Start;
+    auto It = Stats.find(PassID);
+    if (It == Stats.end()) {
+      Order.push_back(PassID.str());
+      It = Stats.insert({PassID, PassStats()}).first;
+    }
+    PassStats &S = It->second;
+    S.Runs++;
+    S.Seconds += Elapsed.count();
+    S.InstDelta += (long)InstsAfter - (long)F.Insts;
+    S.PeakKB += getPeakRSSKB() - F.PeakKB;
+  }
+};
+
+int main(int argc, char **argv) {
+  cl::ParseCommandLineOptions(argc, argv, "in-process pass benchmark\n");
+  if (CallDepth == 0)
+    CallDepth = 1;
+  if (NumTrials == 0)
+    NumTrials = 1;
+
+  PassTimer Timer;
+  double TotalSeconds = 0;
+  size_t InstsBefore = 0, InstsAfter = 0;
+
+  for (unsigned trial = 0; trial < NumTrials; trial++) {
+    std::unique_ptr<Module> mod = makeStressModule();
+    if (verifyModule(*mod, &errs()))
+      return 1;
+    InstsBefore = mod->getInstructionCount();
+
+    PassInstrumentationCallbacks PIC;
+    Timer.registerCallbacks(PIC);
+    PassBuilder PB(nullptr, PipelineTuningOptions(), None, &PIC);
+    LoopAnalysisManager LAM;
+    FunctionAnalysisManager FAM;
+    CGSCCAnalysisManager CGAM;
+    ModuleAnalysisManager MAM;
+    PB.registerModuleAnalyses(MAM);
+    PB.registerCGSCCAnalyses(CGAM);
+    PB.registerFunctionAnalyses(FAM);
+    PB.registerLoopAnalyses(LAM);
+    PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+    ModulePassManager MPM;
+    if (Error Err = PB.parsePassPipeline(MPM, Pipeline)) {
+      errs() << argv[0] << ": " << toString(std::move(Err)) << "\n";
+      return 1;
+    }
+
+    auto Start = std::chrono::steady_clock::now();
+    MPM.run(*mod, MAM);
+    std::chrono::duration<double> Elapsed =
+        std::chrono::steady_clock::now() - Start;
+    TotalSeconds += Elapsed.count();
+    InstsAfter = mod->getInstructionCount();
+  }
+
+  outs() << "module: " << NumFunctions << " functions, " << InstsBefore
+         << " instructions -> " << InstsAfter << "\n";
+  outs() << "pipeline: " << Pipeline << ", " << NumTrials << " trials\n\n";
+  outs() << "pass                                         runs     ms/trial"
+            "   inst delta     peak KB+\n";
+  for (const std::string &Name : Timer.Order) {
+    const PassStats &S = Timer.Stats[Name];
+    outs() << format("%-40s %8u %12.3f %12ld %12ld\n", Name.c_str(),
+                     S.Runs / NumTrials, S.Seconds * 1000 / NumTrials,
+                     S.InstDelta / (long)NumTrials,
+                     S.PeakKB / (long)NumTrials);
+  }
+  outs() << format("\ntotal %48.3f\n", TotalSeconds * 1000 / NumTrials);
+  outs() << "peak RSS: " << getPeakRSSKB() << " KB\n";
+  return 0;
+}
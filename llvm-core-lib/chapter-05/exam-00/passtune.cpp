@@ -0,0 +1,523 @@
+// In-process pass pipeline autotuner.
+//
+// Where sum-cmd tries one fixed pipeline, this searches pass pipelines for
+// a given module and benchmark entry point: every candidate is run on a
+// fresh copy of the module, JIT compiled and timed, and the fastest one is
+// reported together with its speedup over default<O2> and default<O3>.
+//
+// A candidate is an optional default<On> prefix, a sequence of passes from
+// the pool below and the -inline-threshold / -unroll-threshold of LLVM.
+// The candidates come from random search or from a small genetic
+// algorithm (tournament selection, one point crossover, one mutation per
+// child). A candidate whose entry point returns something else than the
+// unoptimized module is dropped. The speedup is reported after the best
+// candidate, -O2 and -O3 are timed again, in turns and with -final-reps
+// runs each, since one short measurement of the search is noisy.
+//
+//   ../build/passtune kernel.bc -entry=kernel -args=2000 -budget=60
+//                     -search=genetic
+
+#include <llvm/ADT/StringMap.h>
+#include <llvm/ExecutionEngine/Orc/ExecutionUtils.h>
+#include <llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h>
+#include <llvm/ExecutionEngine/Orc/LLJIT.h>
+#include <llvm/ExecutionEngine/Orc/ThreadSafeModule.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IR/PassManager.h>
+#include <llvm/IR/Verifier.h>
+#include <llvm/IRReader/IRReader.h>
+#include <llvm/Passes/PassBuilder.h>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/Format.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/SourceMgr.h>
+#include <llvm/Support/TargetSelect.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Target/TargetMachine.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <random>
+#include <vector>
+
+using namespace llvm;
+
+static cl::opt<std::string> InputFile(cl::Positional, cl::Required,
+    cl::desc("<bitcode or IR file>"));
+static cl::opt<std::string> EntryName("entry", cl::Required,
+    cl::desc("function to benchmark"));
+static cl::list<std::string> EntryArgs("args", cl::CommaSeparated,
+    cl::desc("integer or floating point arguments of the entry point"));
+static cl::opt<unsigned> NumReps("reps", cl::init(5),
+    cl::desc("timed runs per candidate, the fastest one counts"));
+static cl::opt<unsigned> FinalReps("final-reps", cl::init(50),
+    cl::desc("timed runs of the best candidate, -O2 and -O3 in each of "
+             "the final rounds"));
+static cl::opt<unsigned> Budget("budget", cl::init(40),
+    cl::desc("number of candidates to measure"));
+static cl::opt<unsigned> PopulationSize("population", cl::init(8),
+    cl::desc("population of the genetic search"));
+static cl::opt<unsigned> MaxPasses("max-passes", cl::init(16),
+    cl::desc("longest pass sequence of a random candidate"));
+static cl::opt<unsigned> Seed("seed", cl::init(1),
+    cl::desc("seed of the search"));
+
+enum SearchKind { RandomSearch, GeneticSearch };
+static cl::opt<SearchKind> Search("search", cl::init(GeneticSearch),
+    cl::desc("search strategy"),
+    cl::values(clEnumValN(RandomSearch, "random", "independent candidates"),
+               clEnumValN(GeneticSearch, "genetic", "genetic algorithm")));
+
+// The passes a candidate is made of, in the syntax of opt -passes=. The
+// module level ones are marked, the others are grouped into function(...).
+static const struct {
+  const char *Name;
+  bool Module;
+} PassPool[] = {
+    {"mem2reg", false},          {"sroa", false},
+    {"early-cse<memssa>", false}, {"instcombine", false},
+    {"instsimplify", false},     {"simplifycfg", false},
+    {"reassociate", false},      {"gvn", false},
+    {"sccp", false},             {"dse", false},
+    {"adce", false},             {"jump-threading", false},
+    {"correlated-propagation", false},
+    {"loop-mssa(licm)", false},  {"loop(loop-rotate)", false},
+    {"loop(indvars)", false},    {"loop(loop-idiom)", false},
+    {"loop(loop-deletion)", false}, {"loop-unroll<O3>", false},
+    {"loop-vectorize", false},   {"slp-vectorizer", false},
+    {"tailcallelim", false},     {"cgscc(inline)", true},
+    {"ipsccp", true},            {"globalopt", true},
+    {"deadargelim", true},       {"globaldce", true},
+};
+static const unsigned PoolSize = sizeof(PassPool) / sizeof(PassPool[0]);
+
+// thresholds of LLVM itself at -O2 and -O3
+static const int InlineDefault[] = {225, 250};
+static const int UnrollDefault[] = {150, 300};
+
+struct Candidate {
+  unsigned Level = 0; // default<O<Level>> prefix, 0 for none
+  std::vector<unsigned> Passes;
+  int InlineThreshold = 225;
+  int UnrollThreshold = 150;
+  double Time = 0;
+};
+
+static std::string getPipeline(const Candidate &C) {
+  std::string Text;
+  if (C.Level)
+    Text = "default<O" + std::to_string(C.Level) + ">";
+  bool InFunction = false;
+  for (unsigned P : C.Passes) {
+    if (PassPool[P].Module && InFunction) {
+      Text += ")";
+      InFunction = false;
+    }
+    if (!Text.empty())
+      Text += ",";
+    if (!PassPool[P].Module && !InFunction) {
+      Text += "function(";
+      InFunction = true;
+    }
+    Text += PassPool[P].Name;
+  }
+  if (InFunction)
+    Text += ")";
+  return Text.empty() ? "no-op-module" : Text;
+}
+
+static std::string getKey(const Candidate &C) {
+  return getPipeline(C) + " " + std::to_string(C.InlineThreshold) + " " +
+         std::to_string(C.UnrollThreshold);
+}
+
+// Set one of the cl::opt options of LLVM, as -Name=Value does for opt.
+// The first setting goes through addOccurrence, so the option counts as
+// given from then on.
+template <typename T> static void setLLVMOption(StringRef Name, T Value) {
+  auto *Opt = static_cast<cl::opt<T> *>(cl::getRegisteredOptions().lookup(Name));
+  if (!Opt)
+    return;
+  if (Opt->getNumOccurrences() == 0)
+    Opt->addOccurrence(0, Name, std::to_string(Value));
+  else
+    Opt->setValue(Value);
+}
+
+class Tuner {
+  std::unique_ptr<MemoryBuffer> Input;
+  orc::JITTargetMachineBuilder JTMB;
+  std::unique_ptr<TargetMachine> TM;
+  StringMap<double> Measured;
+  bool HaveReference = false;
+  int64_t Reference = 0;
+
+  std::unique_ptr<Module> loadModule(LLVMContext &Context) {
+    SMDiagnostic Diag;
+    std::unique_ptr<Module> M =
+        parseIR(Input->getMemBufferRef(), Diag, Context);
+    if (!M) {
+      Diag.print("passtune", errs());
+      exit(1);
+    }
+    M->setDataLayout(TM->createDataLayout());
+    M->setTargetTriple(TM->getTargetTriple().str());
+    // the entry point has to survive globaldce and internalizing passes
+    if (Function *F = M->getFunction(EntryName))
+      F->setLinkage(GlobalValue::ExternalLinkage);
+    return M;
+  }
+
+  bool optimize(Module &M, const std::string &Pipeline) {
+    PipelineTuningOptions PTO;
+    PassBuilder PB(TM.get(), PTO);
+    LoopAnalysisManager LAM;
+    FunctionAnalysisManager FAM;
+    CGSCCAnalysisManager CGAM;
+    ModuleAnalysisManager MAM;
+    PB.registerModuleAnalyses(MAM);
+    PB.registerCGSCCAnalyses(CGAM);
+    PB.registerFunctionAnalyses(FAM);
+    PB.registerLoopAnalyses(LAM);
+    PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+    ModulePassManager MPM;
+    if (Error Err = PB.parsePassPipeline(MPM, Pipeline)) {
+      errs() << "passtune: " << toString(std::move(Err)) << "\n";
+      return false;
+    }
+    MPM.run(M, MAM);
+    return !verifyModule(M, &errs());
+  }
+
+  // Add "__passtune_main() -> i64", which calls the entry point with
+  // -args and returns the result widened to i64. It is added after the
+  // pipeline ran, so the constant arguments are not propagated into the
+  // benchmark.
+  static Function *addMain(Module &M) {
+    Function *Entry = M.getFunction(EntryName);
+    if (!Entry || Entry->isDeclaration()) {
+      errs() << "passtune: no function " << EntryName << "\n";
+      exit(1);
+    }
+    LLVMContext &Context = M.getContext();
+    FunctionType *FTy = Entry->getFunctionType();
+    if (FTy->getNumParams() != EntryArgs.size() || FTy->isVarArg()) {
+      errs() << "passtune: " << EntryName << " takes " << FTy->getNumParams()
+             << " arguments, -args has " << EntryArgs.size() << "\n";
+      exit(1);
+    }
+
+    Type *Int64Ty = Type::getInt64Ty(Context);
+    Function *Main =
+        Function::Create(FunctionType::get(Int64Ty, false),
+                         GlobalValue::ExternalLinkage, "__passtune_main", M);
+    IRBuilder<> Builder(BasicBlock::Create(Context, "entry", Main));
+    std::vector<Value *> Args;
+    for (unsigned idx = 0; idx < EntryArgs.size(); idx++) {
+      Type *Ty = FTy->getParamType(idx);
+      StringRef Text = EntryArgs[idx];
+      APInt Int;
+      if (Ty->isIntegerTy() && !Text.getAsInteger(0, Int))
+        Args.push_back(ConstantInt::get(Ty, Int.sextOrTrunc(
+                                                Ty->getIntegerBitWidth())));
+      else if (Ty->isFloatingPointTy())
+        Args.push_back(ConstantFP::get(Ty, Text));
+      else {
+        errs() << "passtune: cannot pass " << Text << " as argument "
+               << idx + 1 << "\n";
+        exit(1);
+      }
+    }
+    Value *Ret = Builder.CreateCall(Entry, Args);
+    Type *RetTy = FTy->getReturnType();
+    if (RetTy->isVoidTy())
+      Ret = Builder.getInt64(0);
+    else if (RetTy->isIntegerTy())
+      Ret = Builder.CreateSExtOrTrunc(Ret, Int64Ty);
+    else if (RetTy->isFloatingPointTy())
+      Ret = Builder.CreateBitCast(
+          Builder.CreateFPCast(Ret, Builder.getDoubleTy()), Int64Ty);
+    else {
+      errs() << "passtune: cannot compare the result of " << EntryName
+             << "\n";
+      exit(1);
+    }
+    Builder.CreateRet(Ret);
+    return Main;
+  }
+
+public:
+  Tuner(std::unique_ptr<MemoryBuffer> Input, orc::JITTargetMachineBuilder B)
+      : Input(std::move(Input)), JTMB(std::move(B)) {
+    JTMB.setCodeGenOptLevel(CodeGenOpt::Aggressive);
+    TM = cantFail(JTMB.createTargetMachine());
+  }
+
+  // Fastest time of one call of the entry point in seconds, or a negative
+  // value if the pipeline failed or changed the result.
+  double measure(const std::string &Pipeline, int InlineThreshold,
+                 int UnrollThreshold, unsigned Reps) {
+    auto Context = std::make_unique<LLVMContext>();
+    std::unique_ptr<Module> M = loadModule(*Context);
+    if (InlineThreshold >= 0)
+      setLLVMOption<int>("inline-threshold", InlineThreshold);
+    if (UnrollThreshold >= 0)
+      setLLVMOption<unsigned>("unroll-threshold", UnrollThreshold);
+    if (!optimize(*M, Pipeline))
+      return -1;
+    addMain(*M);
+
+    auto J = orc::LLJITBuilder().setJITTargetMachineBuilder(JTMB).create();
+    if (!J) {
+      errs() << "passtune: " << toString(J.takeError()) << "\n";
+      exit(1);
+    }
+    (*J)->getMainJITDylib().addGenerator(
+        cantFail(orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(
+            (*J)->getDataLayout().getGlobalPrefix())));
+    cantFail((*J)->addIRModule(
+        orc::ThreadSafeModule(std::move(M), std::move(Context))));
+    auto Sym = (*J)->lookup("__passtune_main");
+    if (!Sym) {
+      errs() << "passtune: " << toString(Sym.takeError()) << "\n";
+      return -1;
+    }
+    auto *Main = (int64_t(*)())Sym->getAddress();
+
+    // the first call also pays for page faults and cold caches
+    int64_t Result = Main();
+    if (!HaveReference) {
+      Reference = Result;
+      HaveReference = true;
+    } else if (Result != Reference) {
+      errs() << "passtune: wrong result " << Result << " with " << Pipeline
+             << "\n";
+      return -1;
+    }
+    double Best = 0;
+    for (unsigned rep = 0; rep < Reps; rep++) {
+      auto Start = std::chrono::steady_clock::now();
+      Main();
+      std::chrono::duration<double> Elapsed =
+          std::chrono::steady_clock::now() - Start;
+      if (rep == 0 || Elapsed.count() < Best)
+        Best = Elapsed.count();
+    }
+    return Best;
+  }
+
+  // measure() for a candidate, each distinct one only once. Failed
+  // candidates get an infinite time.
+  double measure(Candidate &C) {
+    std::string Key = getKey(C);
+    auto It = Measured.find(Key);
+    if (It == Measured.end()) {
+      double Time = measure(getPipeline(C), C.InlineThreshold,
+                            C.UnrollThreshold, NumReps);
+      if (Time < 0)
+        Time = HUGE_VAL;
+      It = Measured.insert({Key, Time}).first;
+      outs() << format("[%3u] %10.3f ms  ", (unsigned)Measured.size(),
+                       Time * 1000)
+             << getPipeline(C) << "  inline=" << C.InlineThreshold
+             << " unroll=" << C.UnrollThreshold << "\n";
+    }
+    C.Time = It->second;
+    return C.Time;
+  }
+
+  // Time a candidate again, with Reps runs, whether it was measured or not.
+  double remeasure(const Candidate &C, unsigned Reps) {
+    double Time =
+        measure(getPipeline(C), C.InlineThreshold, C.UnrollThreshold, Reps);
+    return Time < 0 ? HUGE_VAL : Time;
+  }
+
+  unsigned numMeasured() const { return Measured.size(); }
+};
+
+static std::mt19937 Rng;
+
+static unsigned randomBelow(unsigned N) {
+  return std::uniform_int_distribution<unsigned>(0, N - 1)(Rng);
+}
+
+static Candidate randomCandidate() {
+  Candidate C;
+  C.Level = randomBelow(4);
+  unsigned Length = randomBelow(std::max(MaxPasses.getValue(), 1u) + 1);
+  // a pipeline without mem2reg or sroa rarely gets anywhere
+  if (C.Level == 0)
+    C.Passes.push_back(randomBelow(2));
+  for (unsigned idx = 0; idx < Length; idx++)
+    C.Passes.push_back(randomBelow(PoolSize));
+  C.InlineThreshold = randomBelow(1001);
+  C.UnrollThreshold = randomBelow(1201);
+  return C;
+}
+
+static void mutate(Candidate &C) {
+  switch (randomBelow(6)) {
+  case 0:
+    C.Passes.insert(C.Passes.begin() + randomBelow(C.Passes.size() + 1),
+                    randomBelow(PoolSize));
+    break;
+  case 1:
+    if (!C.Passes.empty())
+      C.Passes.erase(C.Passes.begin() + randomBelow(C.Passes.size()));
+    break;
+  case 2:
+    if (!C.Passes.empty())
+      C.Passes[randomBelow(C.Passes.size())] = randomBelow(PoolSize);
+    break;
+  case 3:
+    C.Level = randomBelow(4);
+    break;
+  case 4:
+    C.InlineThreshold =
+        std::max(0, C.InlineThreshold + (int)randomBelow(401) - 200);
+    break;
+  default:
+    C.UnrollThreshold =
+        std::max(0, C.UnrollThreshold + (int)randomBelow(601) - 300);
+    break;
+  }
+}
+
+static Candidate crossover(const Candidate &A, const Candidate &B) {
+  Candidate C;
+  C.Level = randomBelow(2) ? A.Level : B.Level;
+  unsigned CutA = randomBelow(A.Passes.size() + 1);
+  unsigned CutB = randomBelow(B.Passes.size() + 1);
+  C.Passes.assign(A.Passes.begin(), A.Passes.begin() + CutA);
+  C.Passes.insert(C.Passes.end(), B.Passes.begin() + CutB, B.Passes.end());
+  C.InlineThreshold = randomBelow(2) ? A.InlineThreshold : B.InlineThreshold;
+  C.UnrollThreshold = randomBelow(2) ? A.UnrollThreshold : B.UnrollThreshold;
+  return C;
+}
+
+static const Candidate &tournament(const std::vector<Candidate> &Pop) {
+  const Candidate &A = Pop[randomBelow(Pop.size())];
+  const Candidate &B = Pop[randomBelow(Pop.size())];
+  return A.Time <= B.Time ? A : B;
+}
+
+static bool faster(const Candidate &A, const Candidate &B) {
+  return A.Time < B.Time;
+}
+
+// The -O2 and -O3 pipelines as candidates, so the search starts from them.
+static Candidate levelCandidate(unsigned Level) {
+  Candidate C;
+  C.Level = Level;
+  C.InlineThreshold = InlineDefault[Level - 2];
+  C.UnrollThreshold = UnrollDefault[Level - 2];
+  return C;
+}
+
+static Candidate runSearch(Tuner &T) {
+  Candidate Best = levelCandidate(2);
+  T.measure(Best);
+  Candidate O3 = levelCandidate(3);
+  if (T.measure(O3) < Best.Time)
+    Best = O3;
+
+  if (Search == RandomSearch) {
+    // give up after many repeats, the space may be smaller than the budget
+    for (unsigned tries = 0; T.numMeasured() < Budget && tries < Budget * 10;
+         tries++) {
+      Candidate C = randomCandidate();
+      if (T.measure(C) < Best.Time)
+        Best = C;
+    }
+    return Best;
+  }
+
+  unsigned Size = std::max(PopulationSize.getValue(), 2u);
+  std::vector<Candidate> Pop = {Best, O3};
+  while (Pop.size() < Size && T.numMeasured() < Budget) {
+    Pop.push_back(randomCandidate());
+    T.measure(Pop.back());
+  }
+  for (unsigned tries = 0; T.numMeasured() < Budget && tries < Budget * 10;) {
+    std::sort(Pop.begin(), Pop.end(), faster);
+    // the two best survive as they are
+    std::vector<Candidate> Next(Pop.begin(), Pop.begin() + 2);
+    while (Next.size() < Pop.size() && T.numMeasured() < Budget &&
+           tries++ < Budget * 10) {
+      Candidate C = crossover(tournament(Pop), tournament(Pop));
+      mutate(C);
+      T.measure(C);
+      Next.push_back(C);
+    }
+    Pop = std::move(Next);
+  }
+  for (const Candidate &C : Pop)
+    if (C.Time < Best.Time)
+      Best = C;
+  return Best;
+}
+
+int main(int argc, char **argv) {
+  cl::ParseCommandLineOptions(argc, argv, "pass pipeline autotuner\n");
+  InitializeNativeTarget();
+  InitializeNativeTargetAsmPrinter();
+  Rng.seed(Seed);
+  if (NumReps == 0)
+    NumReps = 1;
+  if (FinalReps == 0)
+    FinalReps = 1;
+
+  ErrorOr<std::unique_ptr<MemoryBuffer>> Buf = MemoryBuffer::getFile(InputFile);
+  if (!Buf) {
+    errs() << argv[0] << ": " << InputFile << ": "
+           << Buf.getError().message() << "\n";
+    return 1;
+  }
+  auto JTMB = orc::JITTargetMachineBuilder::detectHost();
+  if (!JTMB) {
+    errs() << argv[0] << ": " << toString(JTMB.takeError()) << "\n";
+    return 1;
+  }
+  Tuner T(std::move(*Buf), std::move(*JTMB));
+
+  // the unoptimized module gives the reference result; the thresholds
+  // stay untouched until the O2 and O3 baselines are measured
+  double O0 = T.measure("no-op-module", -1, -1, NumReps);
+  if (O0 < 0)
+    return 1;
+  outs() << format("unoptimized: %.3f ms\n", O0 * 1000);
+  double O2 = T.measure("default<O2>", -1, -1, NumReps);
+  double O3 = T.measure("default<O3>", -1, -1, NumReps);
+  outs() << format("default<O2>: %.3f ms\ndefault<O3>: %.3f ms\n\n",
+                   O2 * 1000, O3 * 1000);
+
+  Candidate Best = runSearch(T);
+  outs() << "\nbest of " << T.numMeasured() << " candidates: "
+         << format("%.3f ms\n", Best.Time * 1000);
+
+  // the rounds take turns, so a slow phase of the machine hits all three
+  const unsigned Rounds = 3;
+  Candidate O2C = levelCandidate(2), O3C = levelCandidate(3);
+  double BestTime = HUGE_VAL;
+  O2 = O3 = HUGE_VAL;
+  for (unsigned round = 0; round < Rounds; round++) {
+    BestTime = std::min(BestTime, T.remeasure(Best, FinalReps));
+    O2 = std::min(O2, T.remeasure(O2C, FinalReps));
+    O3 = std::min(O3, T.remeasure(O3C, FinalReps));
+  }
+  outs() << format("timed again, %u x %u runs: %.3f ms, -O2 %.3f ms, "
+                   "-O3 %.3f ms\n", Rounds, FinalReps.getValue(),
+                   BestTime * 1000, O2 * 1000, O3 * 1000)
+         << format("  %.2fx over -O2, %.2fx over -O3\n", O2 / BestTime,
+                   O3 / BestTime);
+  if (BestTime >= std::min(O2, O3))
+    outs() << "  no candidate beats " << (O2 <= O3 ? "-O2" : "-O3") << "\n";
+  outs() << "  opt -passes='" << getPipeline(Best) << "' -inline-threshold="
+         << Best.InlineThreshold << " -unroll-threshold="
+         << Best.UnrollThreshold << "\n";
+  return 0;
+}
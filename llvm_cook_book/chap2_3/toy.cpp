@@ -1,18 +1,52 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <ctype.h>
 #include <iostream>
 #include <string>
 #include <vector>
 #include <map>
+#include <set>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unistd.h>
 
 #include <llvm-c/Core.h>
+#include <llvm/ADT/StringMap.h>
 #include <llvm/ExecutionEngine/ExecutionEngine.h>
+#include <llvm/ExecutionEngine/JITEventListener.h>
+#include <llvm/ExecutionEngine/MCJIT.h>
+#include <llvm/IR/DIBuilder.h>
+#include <llvm/IR/DiagnosticHandler.h>
+#include <llvm/IR/DiagnosticInfo.h>
+#include <llvm/IR/LLVMRemarkStreamer.h>
 #include <llvm/IR/Module.h>
 #include <llvm/IR/Verifier.h>
 #include <llvm/IR/IRBuilder.h>
 #include <llvm/IR/LLVMContext.h>
 #include <llvm/IR/DerivedTypes.h>
+#include <llvm/IR/LegacyPassManager.h>
+#include <llvm/MC/TargetRegistry.h>
+#include <llvm/Object/SymbolSize.h>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/DynamicLibrary.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Host.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/Program.h>
+#include <llvm/Support/TargetSelect.h>
+#include <llvm/Support/ThreadPool.h>
+#include <llvm/Support/ToolOutputFile.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Target/TargetMachine.h>
+#include <llvm/Target/TargetOptions.h>
+#include <llvm/Transforms/IPO.h>
+#include <llvm/Transforms/IPO/PassManagerBuilder.h>
 
 using namespace llvm;
 
@@ -20,9 +54,334 @@ using namespace llvm;
 static LLVMContext context;
 static Module *Module_ob;
 static IRBuilder<> Builder(context);
-static std::map<std::string, Value*> Named_Values;
 static ExecutionEngine *TheEngine;
 
+// Identifiers are interned by the lexer and carried as 32-bit symbols.
+typedef uint32_t Symbol;
+static StringMap<Symbol> Symbol_Ids;
+static std::vector<StringRef> Symbol_Names;
+
+static Symbol intern(StringRef name) {
+  auto it = Symbol_Ids.insert(std::make_pair(name, Symbol_Names.size()));
+  if (it.second)
+    Symbol_Names.push_back(it.first->getKey());
+  return it.first->getValue();
+}
+
+static const std::string symbol_name(Symbol sym) {
+  return Symbol_Names[sym].str();
+}
+
+// Same table as llvm_tutorial/include/symbol.h, in this file's naming.
+template <typename T> class ScopedSymbolTable {
+  struct Entry {
+    T Val;
+    bool Bound;
+  };
+  struct Shadowed {
+    Symbol Sym;
+    Entry Old;
+  };
+  std::vector<Entry> Entries;
+  std::vector<Shadowed> Undo_Log;
+  std::vector<size_t> Scope_Marks;
+
+public:
+  void push_scope() { Scope_Marks.push_back(Undo_Log.size()); }
+
+  void pop_scope() {
+    size_t Mark = Scope_Marks.back();
+    Scope_Marks.pop_back();
+    while (Undo_Log.size() > Mark) {
+      Entries[Undo_Log.back().Sym] = Undo_Log.back().Old;
+      Undo_Log.pop_back();
+    }
+  }
+
+  void bind(Symbol Sym, const T &Val) {
+    if (Sym >= Entries.size())
+      Entries.resize(Sym + 1, Entry{T(), false});
+    Undo_Log.push_back({Sym, Entries[Sym]});
+    Entries[Sym] = Entry{Val, true};
+  }
+
+  const T *lookup(Symbol Sym) const {
+    if (Sym >= Entries.size() || !Entries[Sym].Bound)
+      return 0;
+    return &Entries[Sym].Val;
+  }
+};
+
+// Name resolution (BaseAST::resolve) binds every variable to a slot of
+// Local_Slots and every callee to its Function, so code_gen does no name
+// lookups.
+static ScopedSymbolTable<unsigned> Scopes;
+static unsigned Num_Slots;
+static std::vector<Value *> Local_Slots;
+static std::vector<Function *> Function_Table;
+
+static Function *lookup_function(Symbol sym) {
+  return sym < Function_Table.size() ? Function_Table[sym] : 0;
+}
+
+static void bind_function(Symbol sym, Function *F) {
+  if (sym >= Function_Table.size())
+    Function_Table.resize(sym + 1, 0);
+  Function_Table[sym] = F;
+}
+
+// functions found pure while generating them; memoized with -memo
+static bool Memo_Mode = false;
+static unsigned Memo_Size = 1024;
+static std::set<Symbol> Pure_Functions;
+
+// ahead-of-time compilation, enabled by -c or -o
+static bool AOT_Mode = false;
+static bool Emit_Object_Only = false;
+static std::string Output_File;
+static unsigned Opt_Level = 0;
+static std::string CPU_Name;
+
+// top level expressions, wrapped into __toplevel_N functions, and
+// whether each one only calls pure functions
+static std::vector<Function *> Top_Level_Funcs;
+static std::vector<bool> Top_Level_Pure;
+
+// evaluation of the top level expressions by the JIT, enabled by -run;
+// -j=N runs the pure ones, and the chunks of a parallel for, on N threads
+static bool Run_Mode = false;
+static unsigned Num_Jobs = 1;
+
+// line tables, enabled by -g, so gdb and perf can map the generated code
+// back to the source; Dbg_Scope is the subprogram of the function being
+// generated
+static bool Debug_Info = false;
+static DIBuilder *DBuilder;
+static DIFile *Dbg_File;
+static DIScope *Dbg_Scope;
+
+// profiling of the JIT code with perf, enabled by -perf
+static bool Perf_Mode = false;
+
+// optimization remarks of the -c/-o pipeline: -remarks=file saves all of
+// them, -remarks-summary counts the missed ones per function and pass, by
+// message, with the analysis remarks of the pass that tell why
+static std::string Remarks_File;
+static std::string Remarks_Format = "yaml";
+static bool Remarks_Summary = false;
+struct Pass_Remarks {
+  std::map<std::string, unsigned> Missed, Analysis;
+};
+static std::map<std::string, std::map<std::string, Pass_Remarks>> 
+    Missed_Remarks;
+
+// lazy code generation, enabled by -lazy: definitions wait here, indexed
+// by name, until a top level expression reaches them
+static bool Lazy_Mode = false;
+class FunctionDefnAST;
+static std::vector<FunctionDefnAST *> Pending_Defns;
+
+// lowering of if/then/else without branches: when the select_cost of both
+// arms adds up to at most Select_Cost (-select-cost=N, 0 keeps the
+// branches), both are evaluated and one is picked with a select; a ladder
+// of at least Table_Min_Arms "x < number" tests of one variable, with
+// numbers as results, becomes a lookup in a table of Table_Limit entries
+// at most
+static unsigned Select_Cost = 16;
+static const unsigned Table_Min_Arms = 3;
+static const unsigned Table_Limit = 256;
+// select_cost of a node that can not be evaluated on a path that did not
+// ask for it
+static const unsigned Spec_Never = ~0u;
+class ExprIfAST;
+
+static unsigned add_cost(unsigned A, unsigned B) {
+  return A == Spec_Never || B == Spec_Never ? Spec_Never : A + B;
+}
+
+// memory report, enabled by -mem-profile and -mem-json=file
+static bool Mem_Report = false;
+static std::string Mem_Json_File;
+
+#ifdef MEM_PROFILE
+// Memory accounting per compilation phase, built with -DMEM_PROFILE.
+// The global operator new puts a header in front of every block with its
+// size, phase and site, so operator delete gives the bytes back to the
+// phase that allocated them. Memory LLVM takes from malloc directly, like
+// the buffers of SmallVector, is not seen.
+enum Mem_Phase {
+  MEM_OTHER = 0,
+  MEM_LEX,
+  MEM_PARSE,
+  MEM_AST,
+  MEM_IR,
+  MEM_OPT,
+  MEM_CODEGEN,
+  MEM_JIT,
+  MEM_NUM_PHASES
+};
+
+static const char *Mem_Phase_Names[MEM_NUM_PHASES] = {
+  "other", "lex", "parse", "ast", "ir", "optimize", "codegen", "jit"
+};
+
+struct Mem_Stats {
+  size_t Current;
+  size_t Peak;
+  size_t Allocs;
+  size_t Bytes;
+};
+
+// a site is the function a phase was entered from
+struct Mem_Site {
+  const char *Name;
+  unsigned Phase;
+  size_t Allocs;
+  size_t Bytes;
+};
+
+struct Mem_Header {
+  size_t Size;
+  uint32_t Phase;
+  uint32_t Site;
+};
+
+static const unsigned MEM_MAX_SITES = 64;
+static Mem_Stats Mem_Phases[MEM_NUM_PHASES];
+static Mem_Site Mem_Sites[MEM_MAX_SITES] = {{"startup", MEM_OTHER, 0, 0}};
+static unsigned Mem_Num_Sites = 1;
+static size_t Mem_Current, Mem_Peak;
+static unsigned Mem_Cur_Phase = MEM_OTHER;
+static unsigned Mem_Cur_Site = 0;
+
+// Sites are string literals, compared by address. When the table is full
+// the rest is counted as startup.
+static unsigned mem_site(unsigned phase, const char *name) {
+  for (unsigned idx = 0; idx < Mem_Num_Sites; idx++)
+    if (Mem_Sites[idx].Name == name && Mem_Sites[idx].Phase == phase)
+      return idx;
+  if (Mem_Num_Sites == MEM_MAX_SITES)
+    return 0;
+  Mem_Sites[Mem_Num_Sites].Name = name;
+  Mem_Sites[Mem_Num_Sites].Phase = phase;
+  return Mem_Num_Sites++;
+}
+
+void *operator new(size_t size) {
+  Mem_Header *H = (Mem_Header *)malloc(sizeof(Mem_Header) + size);
+  if (H == 0) {
+    fputs("Error: out of memory!\n", stderr);
+    abort();
+  }
+  H->Size = size;
+  H->Phase = Mem_Cur_Phase;
+  H->Site = Mem_Cur_Site;
+
+  Mem_Stats &S = Mem_Phases[Mem_Cur_Phase];
+  S.Current += size;
+  S.Allocs++;
+  S.Bytes += size;
+  if (S.Current > S.Peak)
+    S.Peak = S.Current;
+  Mem_Sites[Mem_Cur_Site].Allocs++;
+  Mem_Sites[Mem_Cur_Site].Bytes += size;
+  Mem_Current += size;
+  if (Mem_Current > Mem_Peak)
+    Mem_Peak = Mem_Current;
+  return H + 1;
+}
+
+void operator delete(void *ptr) noexcept {
+  if (ptr == 0)
+    return;
+  Mem_Header *H = (Mem_Header *)ptr - 1;
+  Mem_Phases[H->Phase].Current -= H->Size;
+  Mem_Current -= H->Size;
+  free(H);
+}
+
+void *operator new[](size_t size) { return operator new(size); }
+void operator delete[](void *ptr) noexcept { operator delete(ptr); }
+void operator delete(void *ptr, size_t) noexcept { operator delete(ptr); }
+void operator delete[](void *ptr, size_t) noexcept { operator delete(ptr); }
+
+// Allocations made while a Mem_Scope is alive are charged to its phase.
+class Mem_Scope {
+  unsigned Saved_Phase;
+  unsigned Saved_Site;
+public:
+  Mem_Scope(unsigned phase, const char *site)
+      : Saved_Phase(Mem_Cur_Phase), Saved_Site(Mem_Cur_Site) {
+    Mem_Cur_Phase = phase;
+    Mem_Cur_Site = mem_site(phase, site);
+  }
+  ~Mem_Scope() {
+    Mem_Cur_Phase = Saved_Phase;
+    Mem_Cur_Site = Saved_Site;
+  }
+};
+#define MEM_SCOPE(phase, site) Mem_Scope mem_scope_(phase, site)
+
+// indices of the sites of a phase, most bytes first
+static unsigned mem_phase_sites(unsigned phase, unsigned *sites) {
+  unsigned num = 0;
+  for (unsigned idx = 0; idx < Mem_Num_Sites; idx++)
+    if (Mem_Sites[idx].Phase == phase && Mem_Sites[idx].Allocs)
+      sites[num++] = idx;
+  std::sort(sites, sites + num, [](unsigned a, unsigned b) {
+    return Mem_Sites[a].Bytes > Mem_Sites[b].Bytes;
+  });
+  return num;
+}
+
+static void mem_report() {
+  unsigned sites[MEM_MAX_SITES];
+
+  printf("================================\n");
+  printf("%-10s %12s %12s %10s %14s\n", "phase", "current", "peak", 
+         "allocs", "total bytes");
+  for (unsigned phase = 0; phase < MEM_NUM_PHASES; phase++) {
+    Mem_Stats &S = Mem_Phases[phase];
+    printf("%-10s %12zu %12zu %10zu %14zu\n", Mem_Phase_Names[phase], 
+           S.Current, S.Peak, S.Allocs, S.Bytes);
+    // the three largest contributors
+    unsigned num = mem_phase_sites(phase, sites);
+    for (unsigned idx = 0; idx < num && idx < 3; idx++)
+      printf("    %-32s %14zu bytes in %zu allocs\n", Mem_Sites[sites[idx]].Name, 
+             Mem_Sites[sites[idx]].Bytes, Mem_Sites[sites[idx]].Allocs);
+  }
+  printf("%-10s %12zu %12zu\n", "total", Mem_Current, Mem_Peak);
+}
+
+static void mem_report_json(const char *file_name) {
+  unsigned sites[MEM_MAX_SITES];
+  FILE *out = fopen(file_name, "w");
+  if (out == NULL) {
+    printf("Error: unable to open %s.\n", file_name);
+    exit(0);
+  }
+
+  fprintf(out, "{\n  \"phases\": [\n");
+  for (unsigned phase = 0; phase < MEM_NUM_PHASES; phase++) {
+    Mem_Stats &S = Mem_Phases[phase];
+    fprintf(out, "    {\"phase\": \"%s\", \"current\": %zu, \"peak\": %zu, "
+            "\"allocs\": %zu, \"bytes\": %zu, \"sites\": [", 
+            Mem_Phase_Names[phase], S.Current, S.Peak, S.Allocs, S.Bytes);
+    unsigned num = mem_phase_sites(phase, sites);
+    for (unsigned idx = 0; idx < num; idx++)
+      fprintf(out, "%s{\"site\": \"%s\", \"allocs\": %zu, \"bytes\": %zu}", 
+              idx ? ", " : "", Mem_Sites[sites[idx]].Name, 
+              Mem_Sites[sites[idx]].Allocs, Mem_Sites[sites[idx]].Bytes);
+    fprintf(out, "]}%s\n", phase + 1 < MEM_NUM_PHASES ? "," : "");
+  }
+  fprintf(out, "  ],\n  \"current\": %zu,\n  \"peak\": %zu\n}\n", 
+          Mem_Current, Mem_Peak);
+  fclose(out);
+}
+#else
+#define MEM_SCOPE(phase, site)
+#endif
+
 enum Token_Type {
   EOF_TOKEN = 0,
   NUMERIC_TOKEN,
@@ -38,7 +397,9 @@ enum Token_Type {
   FOR_TOKEN,
   IN_TOKEN,
   UNARY_TOKEN,
-  BINARY_TOKEN
+  BINARY_TOKEN,
+  PARALLEL_TOKEN,
+  REDUCE_TOKEN
 };
 
 void check_cond(bool cond, std::string message) {
@@ -49,19 +410,85 @@ void check_cond(bool cond, std::string message) {
   return;
 }
 
+// line and column in the source file
+struct Source_Loc {
+  unsigned Line, Col;
+};
+// position of the current token
+static Source_Loc Token_Loc = {1, 0};
+
 class BaseAST
 {
 public:
-  BaseAST(){}; 
+  // where the node starts, set by the parsers of the nodes that emit a
+  // debug location
+  Source_Loc Loc;
+
+  BaseAST(): Loc(Token_Loc) {}; 
   virtual ~BaseAST(){};
 
   virtual Value *code_gen() = 0;
+  // bind the names used by the node, false if one is undefined
+  virtual bool resolve() = 0;
+  // true if evaluating the node only calls pure functions
+  virtual bool is_pure() const = 0;
+  // append the functions the node calls
+  virtual void collect_calls(std::vector<Symbol> &Callees) const {}
+  // instructions to evaluate the node, Spec_Never if it calls a function,
+  // loops or may trap
+  virtual unsigned select_cost() const { return Spec_Never; }
+  // the parts of a number, a variable, an "x < number" test and an if,
+  // looked at by the lowering of if ladders
+  virtual bool get_number(int &Val) const { return false; }
+  virtual bool get_slot(unsigned &Slot) const { return false; }
+  virtual bool get_range_test(unsigned &Slot, int &Bound) const {
+    return false;
+  }
+  virtual ExprIfAST *get_if() { return 0; }
+
+#ifdef MEM_PROFILE
+  // nodes are charged to the ast phase, at the site of their parser
+  static void *operator new(size_t size) {
+    MEM_SCOPE(MEM_AST, Mem_Sites[Mem_Cur_Site].Name);
+    return ::operator new(size);
+  }
+  static void operator delete(void *ptr) { ::operator delete(ptr); }
+#endif
 };
 
+// Give F a subprogram starting at Loc and make it the scope of the
+// locations emitted from now on. Every value is an int to the debugger.
+static void dbg_begin_function(Function *F, Source_Loc Loc) {
+  if (DBuilder == 0)
+    return;
+  DIType *Int_Ty = DBuilder->createBasicType("int", 32, 
+                                             dwarf::DW_ATE_signed);
+  SmallVector<Metadata *, 8> Types(F->arg_size() + 1, Int_Ty);
+  DISubroutineType *Fn_Ty = DBuilder->createSubroutineType(
+      DBuilder->getOrCreateTypeArray(Types));
+  DISubprogram *SP = DBuilder->createFunction(
+      Dbg_File, F->getName(), StringRef(), Dbg_File, Loc.Line, Fn_Ty, 
+      Loc.Line, DINode::FlagPrototyped, DISubprogram::SPFlagDefinition);
+  F->setSubprogram(SP);
+  Dbg_Scope = SP;
+  Builder.SetCurrentDebugLocation(DebugLoc());
+}
+
+// Attribute the instructions built from now on to the source of Node.
+static void emit_location(const BaseAST *Node) {
+  if (Dbg_Scope == 0)
+    return;
+  Builder.SetCurrentDebugLocation(DILocation::get(
+      context, Node->Loc.Line, Node->Loc.Col, Dbg_Scope));
+}
+
 static int Numeric_Val;
 static std::string Identifier_string;
+static Symbol Identifier_sym;
+static std::vector<int> Keyword_Tokens;
 static FILE *file;
 static int LastChar = ' ';
+static Source_Loc Cur_Loc = {1, 0};
 static int Current_token;
 static std::map<char, int> OperatorPrece;
 static std::map<int, std::string> dump_str;
@@ -80,28 +507,47 @@ static void Driver();
 
 class VariableAST: public BaseAST
 {
-  std::string Var_Name;
+  Symbol Var_Name;
+  unsigned Slot;
 public:
-  VariableAST(std::string &name): Var_Name(name)
+  VariableAST(Symbol name): Var_Name(name), Slot(0)
   {
   }
   ~VariableAST()
   {
 #ifdef DUMP_AST
-    std::cout << "VariableAST: " << Var_Name << std::endl;
+    std::cout << "VariableAST: " << symbol_name(Var_Name) << std::endl;
 #endif
   }
 
   virtual Value *code_gen();
+  virtual bool resolve();
+  virtual bool is_pure() const { return true; }
+  virtual unsigned select_cost() const { return 0; }
+  virtual bool get_slot(unsigned &S) const {
+    S = Slot;
+    return true;
+  }
 };
 
+bool VariableAST::resolve()
+{
+  const unsigned *S = Scopes.lookup(Var_Name);
+  if (S == 0) {
+    printf("Error: unknown variable %s!\n", symbol_name(Var_Name).c_str());
+    return false;
+  }
+  Slot = *S;
+  return true;
+}
+
 Value *VariableAST::code_gen()
 {
+  MEM_SCOPE(MEM_IR, "VariableAST::code_gen");
 #ifdef DUMP_CG
-  std::cout << "VariableAST CG: " << Var_Name << std::endl;
+  std::cout << "VariableAST CG: " << symbol_name(Var_Name) << std::endl;
 #endif
-  Value *V = Named_Values[Var_Name];
-  return V ? V : 0;
+  return Local_Slots[Slot];
 }
 
 class NumericAST: public BaseAST
@@ -119,10 +565,18 @@ public:
   }
 
   virtual Value *code_gen();
+  virtual bool resolve() { return true; }
+  virtual bool is_pure() const { return true; }
+  virtual unsigned select_cost() const { return 0; }
+  virtual bool get_number(int &Val) const {
+    Val = numeric_val;
+    return true;
+  }
 };
 
 Value *NumericAST::code_gen()
 {
+  MEM_SCOPE(MEM_IR, "NumericAST::code_gen");
 #ifdef DUMP_CG
   std::cout << "NumericAST CG: " << numeric_val << std::endl;
 #endif
@@ -133,10 +587,13 @@ class BinaryAST: public BaseAST
 {
   std::string Bin_Operator;
   BaseAST *LHS, *RHS;
+  // the binary<op> function of a user defined operator
+  Symbol Op_Name;
+  Function *Op_Function;
 
 public:
   BinaryAST(std::string op, BaseAST *lhs, BaseAST *rhs): 
-  Bin_Operator(op), LHS(lhs), RHS(rhs)
+  Bin_Operator(op), LHS(lhs), RHS(rhs), Op_Name(0), Op_Function(0)
   {
   }
 
@@ -151,9 +608,68 @@ public:
 #endif
   }
   virtual Value *code_gen();
+  virtual bool resolve();
+  virtual bool is_pure() const;
+  virtual void collect_calls(std::vector<Symbol> &Callees) const;
+  virtual unsigned select_cost() const;
+  virtual bool get_range_test(unsigned &Slot, int &Bound) const;
 };
 
+static bool is_builtin_op(char Op) {
+  return Op == '<' || Op == '+' || Op == '-' || Op == '*' || Op == '/';
+}
+
+// A user defined operator is a call. A division only by a number that is
+// not 0, the other path may divide by 0.
+unsigned BinaryAST::select_cost() const {
+  char Op = atoi(Bin_Operator.c_str());
+  int Divisor;
+  if (!is_builtin_op(Op) ||
+      (Op == '/' && (!RHS->get_number(Divisor) || Divisor == 0)))
+    return Spec_Never;
+  // a compare is followed by a zext, a division becomes a multiply and
+  // shifts
+  unsigned Cost = Op == '<' ? 2 : Op == '/' ? 3 : 1;
+  return add_cost(Cost, add_cost(LHS->select_cost(), RHS->select_cost()));
+}
+
+bool BinaryAST::get_range_test(unsigned &Slot, int &Bound) const {
+  return atoi(Bin_Operator.c_str()) == '<' && LHS->get_slot(Slot) &&
+         RHS->get_number(Bound);
+}
+
+void BinaryAST::collect_calls(std::vector<Symbol> &Callees) const {
+  LHS->collect_calls(Callees);
+  RHS->collect_calls(Callees);
+  char Op = atoi(Bin_Operator.c_str());
+  if (!is_builtin_op(Op))
+    Callees.push_back(intern(std::string("binary") + Op));
+}
+
+bool BinaryAST::resolve() {
+  if (!LHS->resolve() || !RHS->resolve())
+    return false;
+
+  char Op = atoi(Bin_Operator.c_str());
+  if (is_builtin_op(Op))
+    return true;
+  Op_Name = intern(std::string("binary") + Op);
+  Op_Function = lookup_function(Op_Name);
+  if (Op_Function == 0) {
+    printf("Error: unknown operator %c!\n", Op);
+    return false;
+  }
+  return true;
+}
+
+bool BinaryAST::is_pure() const {
+  if (!LHS->is_pure() || !RHS->is_pure())
+    return false;
+  return Op_Function == 0 || Pure_Functions.count(Op_Name) != 0;
+}
+
 Value *BinaryAST::code_gen() {
+  MEM_SCOPE(MEM_IR, "BinaryAST::code_gen");
 #ifdef DUMP_CG
   std::cout << "BinaryAST CG: " << std::endl;
 #endif
@@ -164,6 +680,7 @@ Value *BinaryAST::code_gen() {
     printf("Error in codegen of binary ast, no lhs or rhs!\n");
     exit(0);
   }
+  emit_location(this);
 
   switch(atoi(Bin_Operator.c_str())) {
     case '<':
@@ -181,20 +698,19 @@ Value *BinaryAST::code_gen() {
       break;
   }
 
-  Function *F = Module_ob->getFunction(std::string("binary") + Bin_Operator);
   Value *Ops[2] = {L, R};
-  return Builder.CreateCall(F, Ops, "binop");
+  return Builder.CreateCall(Op_Function, Ops, "binop");
 }
 
 class FunctionDeclAST: public BaseAST {
-  std::string Func_name;
-  std::vector<std::string> Arguments;
+  Symbol Func_name;
+  std::vector<Symbol> Arguments;
   bool isOperator;
   unsigned Precedence;
 
 public:
-  FunctionDeclAST(const std::string &name, 
-                  const std::vector<std::string> &args,
+  FunctionDeclAST(Symbol name, 
+                  const std::vector<Symbol> &args,
                   bool isoperator = false,
                   unsigned prec = 0)
       : Func_name(name), Arguments(args), 
@@ -202,7 +718,7 @@ public:
 
   ~FunctionDeclAST() {
 #ifdef DUMP_AST
-    std::cout << "FunctionDeclAST: " << Func_name << std::endl;
+    std::cout << "FunctionDeclAST: " << symbol_name(Func_name) << std::endl;
 #endif
   }
 
@@ -216,42 +732,54 @@ public:
 
   char getOperatorName() const {
     assert(isUnaryOp() || isBinaryOp());
-    return Func_name[Func_name.size() - 1];
+    return Symbol_Names[Func_name].back();
   }
 
   unsigned getBinaryPrecedence() const {
     return Precedence;
   }
 
+  Symbol getName() const {
+    return Func_name;
+  }
+
+  const std::vector<Symbol> &getArguments() const {
+    return Arguments;
+  }
+
   virtual Value *code_gen();
+  virtual bool resolve() { return true; }
+  virtual bool is_pure() const { return true; }
 };
 
 Value *FunctionDeclAST::code_gen()
 {
+  MEM_SCOPE(MEM_IR, "FunctionDeclAST::code_gen");
 #ifdef DUMP_CG
   std::cout << "FunctionDeclAST CG: " << std::endl;
 #endif
-  std::vector<Type *> Integers(Arguments.size(), Type::getInt32Ty(context));
-  FunctionType *FT = FunctionType::get(Type::getInt32Ty(context), 
-                                       Integers, false);
-  Function *F = Function::Create(FT, Function::ExternalLinkage, 
-                                 Func_name, Module_ob);
-
-  if(F->getName() != Func_name)
+  // an earlier call may have declared it already
+  Function *F = lookup_function(Func_name);
+  if(F != 0)
   {
-    F->eraseFromParent();
-    F = Module_ob->getFunction(Func_name);
-
-    if(F->empty())  return 0;
+    if(!F->empty())  return 0;
     if(F->arg_size() != Arguments.size()) return 0;
   }
+  else
+  {
+    std::vector<Type *> Integers(Arguments.size(), Type::getInt32Ty(context));
+    FunctionType *FT = FunctionType::get(Type::getInt32Ty(context), 
+                                         Integers, false);
+    F = Function::Create(FT, Function::ExternalLinkage, 
+                         symbol_name(Func_name), Module_ob);
+    bind_function(Func_name, F);
+  }
 
   unsigned idx = 0;
   for(Function::arg_iterator arg_it = F->arg_begin(); idx != Arguments.size(); 
       ++arg_it, ++idx)
   {
-    arg_it->setName(Arguments[idx]);
-    Named_Values[Arguments[idx]] = &(*arg_it);
+    arg_it->setName(symbol_name(Arguments[idx]));
   }
   return F;
 }
@@ -277,14 +805,34 @@ public:
 #endif
   }
   virtual Value *code_gen();
+  virtual bool resolve();
+  virtual bool is_pure() const { return Body->is_pure(); }
+  virtual void collect_calls(std::vector<Symbol> &Callees) const {
+    Body->collect_calls(Callees);
+  }
+  const FunctionDeclAST *get_decl() const { return Func_Decl; }
 };
 
+// Resolve the body with the arguments in the first slots.
+bool FunctionDefnAST::resolve()
+{
+  Scopes.push_scope();
+  Num_Slots = 0;
+  for (Symbol Arg : Func_Decl->getArguments())
+    Scopes.bind(Arg, Num_Slots++);
+  bool Resolved = Body->resolve();
+  Scopes.pop_scope();
+  return Resolved;
+}
+
+static void memoize_function(Function *F);
+
 Value *FunctionDefnAST::code_gen()
 {
+  MEM_SCOPE(MEM_IR, "FunctionDefnAST::code_gen");
 #ifdef DUMP_CG
   std::cout << "FunctionDefnAST CG: " << std::endl;
 #endif
-  Named_Values.clear();
   Function *theFunction = (Function *)(Func_Decl->code_gen());
   if(theFunction == 0)
     return 0;
@@ -293,28 +841,53 @@ Value *FunctionDefnAST::code_gen()
         Func_Decl->getBinaryPrecedence();
   }
 
+  if(!resolve()) {
+    bind_function(Func_Decl->getName(), 0);
+    theFunction->eraseFromParent();
+    return 0;
+  }
+  Local_Slots.assign(Num_Slots, 0);
+  for (Argument &Arg : theFunction->args())
+    Local_Slots[Arg.getArgNo()] = &Arg;
+
   BasicBlock *BB_begin = BasicBlock::Create(context, "entry", theFunction);
   Builder.SetInsertPoint(BB_begin);
+  dbg_begin_function(theFunction, Loc);
 
   if(Value *retVal = Body->code_gen()) {
     Builder.CreateRet(retVal);
-    verifyFunction(*theFunction);
+    if (verifyFunction(*theFunction, &errs())) {
+      errs() << "Error, invalid code generated for "
+             << theFunction->getName() << "!\n";
+      bind_function(Func_Decl->getName(), 0);
+      theFunction->eraseFromParent();
+      return 0;
+    }
 
+    // assume self recursion is pure while checking the body
+    Symbol Name = Func_Decl->getName();
+    Pure_Functions.insert(Name);
+    if (!is_pure())
+      Pure_Functions.erase(Name);
+    else if (Memo_Mode)
+      memoize_function(theFunction);
     return theFunction;
   }
 
+  bind_function(Func_Decl->getName(), 0);
   theFunction->eraseFromParent();
   return 0;
 }
 
 class FunctionCallAST: public BaseAST
 {
-  std::string Function_Callee;
+  Symbol Function_Callee;
+  Function *Callee_F;
   std::vector<BaseAST *> Function_Arguments;
 
 public:
-  FunctionCallAST(const std::string &callee, std::vector<BaseAST *> &args)
-      : Function_Callee(callee), Function_Arguments(args) {
+  FunctionCallAST(Symbol callee, std::vector<BaseAST *> &args)
+      : Function_Callee(callee), Callee_F(0), Function_Arguments(args) {
   }
 
   ~FunctionCallAST() {
@@ -329,13 +902,56 @@ public:
 #endif
   }
   virtual Value *code_gen();
+  virtual bool resolve();
+  virtual bool is_pure() const;
+  virtual void collect_calls(std::vector<Symbol> &Callees) const {
+    Callees.push_back(Function_Callee);
+    for (BaseAST *Arg : Function_Arguments)
+      Arg->collect_calls(Callees);
+  }
 };
 
+bool FunctionCallAST::resolve() {
+  for (BaseAST *Arg : Function_Arguments) {
+    if (!Arg->resolve())
+      return false;
+  }
+
+  Callee_F = lookup_function(Function_Callee);
+  if (Callee_F == 0) {
+    // not defined (yet), declare it as an external function
+    std::vector<Type *> Integers(Function_Arguments.size(), 
+                                 Type::getInt32Ty(context));
+    FunctionType *FT = FunctionType::get(Type::getInt32Ty(context), 
+                                         Integers, false);
+    Callee_F = Function::Create(FT, Function::ExternalLinkage, 
+                                symbol_name(Function_Callee), Module_ob);
+    bind_function(Function_Callee, Callee_F);
+  }
+  if (Callee_F->arg_size() != Function_Arguments.size()) {
+    printf("Error: wrong number of arguments to %s!\n", 
+           symbol_name(Function_Callee).c_str());
+    return false;
+  }
+  return true;
+}
+
+bool FunctionCallAST::is_pure() const {
+  // calls to undefined (extern) functions may have side effects
+  if (Pure_Functions.count(Function_Callee) == 0)
+    return false;
+  for (BaseAST *Arg : Function_Arguments) {
+    if (!Arg->is_pure())
+      return false;
+  }
+  return true;
+}
+
 Value *FunctionCallAST::code_gen() {
+  MEM_SCOPE(MEM_IR, "FunctionCallAST::code_gen");
 #ifdef DUMP_CG
   std::cout << "FunctionCallAST CG: " << std::endl;
 #endif
-  Function *callee_f = Module_ob->getFunction(Function_Callee);
   std::vector<Value *> ArgsV;
 
   for(unsigned i = 0, e = Function_Arguments.size(); i != e; ++i) {
@@ -344,32 +960,129 @@ Value *FunctionCallAST::code_gen() {
       return 0;
   }
 
-  if(callee_f == NULL) {
-    std::vector<Type *> Integers(Function_Arguments.size(), 
-                                 Type::getInt32Ty(context));
-    FunctionType *FT = FunctionType::get(Type::getInt32Ty(context), 
-                                         Integers, false);
-    Constant *func_tmp = Module_ob->getOrInsertFunction("calltmp", FT);
-
-    return Builder.CreateCall(func_tmp, ArgsV);
-  }
-  else
-    return Builder.CreateCall(callee_f, ArgsV, "calltmp");
+  emit_location(this);
+  return Builder.CreateCall(Callee_F, ArgsV, "calltmp");
 }
 
 class ExprIfAST : public BaseAST {
   BaseAST *Cond, *Then, *Else;
 
+  Value *select_code_gen();
+  Value *table_code_gen();
+
 public:
   ExprIfAST(BaseAST *cond, BaseAST *then, BaseAST *else_st)
       : Cond(cond), Then(then), Else(else_st) {}
   virtual Value *code_gen();
+  virtual bool resolve() {
+    return Cond->resolve() && Then->resolve() && Else->resolve();
+  }
+  virtual bool is_pure() const {
+    return Cond->is_pure() && Then->is_pure() && Else->is_pure();
+  }
+  virtual void collect_calls(std::vector<Symbol> &Callees) const {
+    Cond->collect_calls(Callees);
+    Then->collect_calls(Callees);
+    Else->collect_calls(Callees);
+  }
+  // a compare and a select
+  virtual unsigned select_cost() const {
+    return add_cost(2, add_cost(Cond->select_cost(), 
+                                add_cost(Then->select_cost(), 
+                                         Else->select_cost())));
+  }
+  virtual ExprIfAST *get_if() { return this; }
 };
 
+// Both arms are evaluated, the condition picks one.
+Value *ExprIfAST::select_code_gen() {
+  Value *cond_tn = Cond->code_gen();
+  if (cond_tn == 0)
+    return 0;
+  Value *ThenVal = Then->code_gen();
+  Value *ElseVal = Else->code_gen();
+  if (ThenVal == 0 || ElseVal == 0)
+    return 0;
+  emit_location(this);
+  cond_tn = Builder.CreateICmpNE(cond_tn, Builder.getInt32(0), "ifcond");
+  return Builder.CreateSelect(cond_tn, ThenVal, ElseVal, "iftmp");
+}
+
+// The ladder
+//
+//   if x < c1 then k1 else if x < c2 then k2 ... else k
+//
+// as Table[x] for x below the largest c, and k above it; Table[x] is the
+// k of the first test x passes. Null if the node is not such a ladder,
+// before anything is emitted.
+Value *ExprIfAST::table_code_gen() {
+  std::vector<std::pair<int, int>> Arms;
+  unsigned Slot = 0;
+  int Default;
+  BaseAST *Last = this;
+  for (ExprIfAST *If = this; If; If = If->Else->get_if()) {
+    unsigned Test_Slot;
+    int Bound, Val;
+    if (!If->Cond->get_range_test(Test_Slot, Bound) || 
+        !If->Then->get_number(Val) || (!Arms.empty() && Test_Slot != Slot))
+      return 0;
+    // the compare is unsigned, a negative number is a large bound
+    if (Bound < 0 || (unsigned)Bound > Table_Limit)
+      return 0;
+    Slot = Test_Slot;
+    Arms.push_back({Bound, Val});
+    Last = If->Else;
+  }
+  if (Arms.size() < Table_Min_Arms || !Last->get_number(Default))
+    return 0;
+
+  unsigned Size = 0;
+  for (auto &Arm : Arms)
+    Size = std::max(Size, (unsigned)Arm.first);
+  if (Size == 0)
+    return 0;
+  std::vector<Constant *> Entries;
+  for (unsigned X = 0; X < Size; X++) {
+    int Val = Default;
+    for (auto &Arm : Arms) {
+      if (X < (unsigned)Arm.first) {
+        Val = Arm.second;
+        break;
+      }
+    }
+    Entries.push_back(Builder.getInt32(Val));
+  }
+  ArrayType *TableTy = ArrayType::get(Builder.getInt32Ty(), Size);
+  GlobalVariable *Table = new GlobalVariable(
+      *Module_ob, TableTy, true, GlobalValue::PrivateLinkage, 
+      ConstantArray::get(TableTy, Entries), "iftable");
+
+  emit_location(this);
+  Value *X = Local_Slots[Slot];
+  Value *In_Range = Builder.CreateICmpULT(X, Builder.getInt32(Size), 
+                                         "inrange");
+  // the load happens on both sides of the select, so its index is clamped
+  Value *Index = Builder.CreateSelect(In_Range, X, Builder.getInt32(0));
+  Value *Ptr = Builder.CreateInBoundsGEP(TableTy, Table, 
+                                         {Builder.getInt32(0), Index});
+  Value *Val = Builder.CreateLoad(Builder.getInt32Ty(), Ptr, "tableval");
+  return Builder.CreateSelect(In_Range, Val, Builder.getInt32(Default), 
+                              "iftmp");
+}
+
 Value *ExprIfAST::code_gen() {
+  MEM_SCOPE(MEM_IR, "ExprIfAST::code_gen");
+  if (Select_Cost > 0) {
+    if (Value *V = table_code_gen())
+      return V;
+    if (add_cost(Then->select_cost(), Else->select_cost()) <= Select_Cost)
+      return select_code_gen();
+  }
+
   Value *cond_tn = Cond->code_gen();
   if (cond_tn == 0)
     return 0;
+  emit_location(this);
   cond_tn = Builder.CreateICmpNE(cond_tn, Builder.getInt32(0), "ifcond");
 
   Function *TheFunc = Builder.GetInsertBlock()->getParent();
@@ -404,19 +1117,49 @@ Value *ExprIfAST::code_gen() {
 }
 
 class ExprForAST : public BaseAST {
-  std::string Var_Name;
+  Symbol Var_Name;
+  unsigned Slot;
   BaseAST *Start, *End, *Step, *Body;
 
 public:
-  ExprForAST(const std::string &varname, BaseAST *start, BaseAST *end,
+  ExprForAST(Symbol varname, BaseAST *start, BaseAST *end,
              BaseAST *step, BaseAST *body)
-      : Var_Name(varname), Start(start), End(end), Step(step), Body(body) {}
+      : Var_Name(varname), Slot(0), Start(start), End(end), Step(step), 
+        Body(body) {}
   Value *code_gen() override;
+  bool resolve() override;
+  bool is_pure() const override {
+    return Start->is_pure() && End->is_pure() && 
+           (!Step || Step->is_pure()) && Body->is_pure();
+  }
+  void collect_calls(std::vector<Symbol> &Callees) const override {
+    Start->collect_calls(Callees);
+    End->collect_calls(Callees);
+    if (Step)
+      Step->collect_calls(Callees);
+    Body->collect_calls(Callees);
+  }
 };
 
+// The loop variable gets its own slot, visible in End, Step and Body only.
+bool ExprForAST::resolve() {
+  if (!Start->resolve())
+    return false;
+
+  Scopes.push_scope();
+  Slot = Num_Slots++;
+  Scopes.bind(Var_Name, Slot);
+  bool Resolved = Body->resolve() && (!Step || Step->resolve()) && 
+                  End->resolve();
+  Scopes.pop_scope();
+  return Resolved;
+}
+
 Value *ExprForAST::code_gen() {
+  MEM_SCOPE(MEM_IR, "ExprForAST::code_gen");
   Value *StartVal = Start->code_gen();
   check_cond(StartVal != 0, "Error, StartVal should not be null!\n");
+  emit_location(this);
 
   Function *TheFunction = Builder.GetInsertBlock()->getParent();
   BasicBlock *PreheaderBB = Builder.GetInsertBlock();
@@ -425,10 +1168,9 @@ Value *ExprForAST::code_gen() {
   Builder.CreateBr(LoopBB);
   Builder.SetInsertPoint(LoopBB);
   PHINode *Variable = Builder.CreatePHI(Type::getInt32Ty(context), 
-                                        2, Var_Name.c_str());
+                                        2, symbol_name(Var_Name));
   Variable->addIncoming(StartVal, PreheaderBB);
-  Value *OldVal = Named_Values[Var_Name];
-  Named_Values[Var_Name] = Variable;
+  Local_Slots[Slot] = Variable;
 
   check_cond(Body->code_gen() != 0, "Error in code gen for body in for!\n");
 
@@ -440,12 +1182,17 @@ Value *ExprForAST::code_gen() {
     StepVal = ConstantInt::get(Type::getInt32Ty(context), 1);
   }
 
+  emit_location(this);
   Value *NextVar = Builder.CreateAdd(Variable, StepVal, "nextvar");
 
   Value *EndCond = End->code_gen();
+  // the variable does not dominate the code after the loop, so a parallel
+  // for there must not capture it
+  Local_Slots[Slot] = 0;
   if (EndCond == 0) {
     return EndCond;
   }
+  emit_location(this);
 
   EndCond = Builder.CreateICmpNE(EndCond, 
                                  ConstantInt::get(Type::getInt32Ty(context), 0),
@@ -457,50 +1204,485 @@ Value *ExprForAST::code_gen() {
   Builder.SetInsertPoint(AfterBB);
   Variable->addIncoming(NextVar, LoopEndBB);
 
-  if (OldVal) {
-    Named_Values[Var_Name] = OldVal;
-  } else {
-    Named_Values.erase(Var_Name);
+  return Constant::getNullValue(Type::getInt32Ty(context));
+}
+
+// parallel for i = start, end, step [reduce op] in body
+//
+// i takes the values start, start + step, ... below end; start, end and
+// step are evaluated once, and a step that is not positive runs nothing.
+// The value of the loop is the body values combined with op, or 0.
+enum Reduce_Op {
+  REDUCE_NONE = 0,
+  REDUCE_ADD,
+  REDUCE_MUL,
+  REDUCE_MIN,
+  REDUCE_MAX
+};
+
+static int reduce_identity(int Op) {
+  switch (Op) {
+    case REDUCE_MUL: return 1;
+    case REDUCE_MIN: return INT32_MAX;
+    case REDUCE_MAX: return INT32_MIN;
+    default: return 0;
   }
+}
 
-  return Constant::getNullValue(Type::getInt32Ty(context));
+static int reduce_combine(int Op, int A, int B) {
+  switch (Op) {
+    case REDUCE_ADD: return (int)((unsigned)A + (unsigned)B);
+    case REDUCE_MUL: return (int)((unsigned)A * (unsigned)B);
+    case REDUCE_MIN: return std::min(A, B);
+    case REDUCE_MAX: return std::max(A, B);
+    default: return 0;
+  }
 }
 
+// Runtime of parallel for in the JIT. The body of a loop is outlined into
+// a chunk function, which runs Count iterations from Lo and returns their
+// reduction. A loop is cut into chunks that are dealt round robin to one
+// deque per thread; a thread takes chunks from the back of its own deque
+// and then steals from the front of the others. The calling thread takes
+// part as well and only waits for chunks other threads are still running,
+// so a parallel for inside a chunk can not deadlock the pool.
+typedef int (*Pfor_Chunk_Fn)(void *Ctx, int Lo, int Step, int64_t Count);
+
+struct Pfor_Loop {
+  Pfor_Chunk_Fn Chunk;
+  void *Ctx;
+  int Start, Step;
+  int64_t Count, Chunk_Size;
+  std::vector<std::deque<unsigned> > Queues;
+  std::vector<std::mutex> Locks;
+  std::vector<int> Partials;
+  std::atomic<unsigned> Next_Thread;
+  std::atomic<unsigned> Remaining;
+
+  Pfor_Loop(unsigned Num_Threads)
+      : Queues(Num_Threads), Locks(Num_Threads), Next_Thread(1) {}
+};
+
+struct Pfor_Pool {
+  std::mutex Lock;
+  std::condition_variable Wake, Done;
+  // loops that may still have chunks left, guarded by Lock
+  std::vector<std::shared_ptr<Pfor_Loop> > Open;
+  bool Started = false;
+};
+
+// never destroyed: the workers wait on it until the process exits
+static Pfor_Pool &pfor_pool() {
+  static Pfor_Pool *Pool = new Pfor_Pool;
+  return *Pool;
+}
+
+static bool pfor_take(Pfor_Loop &L, unsigned Self, unsigned &Idx) {
+  unsigned N = L.Queues.size();
+  for (unsigned k = 0; k < N; k++) {
+    unsigned Q = (Self + k) % N;
+    std::lock_guard<std::mutex> Guard(L.Locks[Q]);
+    if (L.Queues[Q].empty())
+      continue;
+    if (k == 0) {
+      Idx = L.Queues[Q].back();
+      L.Queues[Q].pop_back();
+    } else {
+      Idx = L.Queues[Q].front();
+      L.Queues[Q].pop_front();
+    }
+    return true;
+  }
+  return false;
+}
+
+// Run chunks of L until none is left to take.
+static void pfor_work(const std::shared_ptr<Pfor_Loop> &L, unsigned Self) {
+  Pfor_Pool &Pool = pfor_pool();
+  unsigned Idx;
+  while (pfor_take(*L, Self, Idx)) {
+    int64_t First = Idx * L->Chunk_Size;
+    int64_t Num = std::min(L->Chunk_Size, L->Count - First);
+    int Lo = (int)(L->Start + First * L->Step);
+    L->Partials[Idx] = L->Chunk(L->Ctx, Lo, L->Step, Num);
+    if (--L->Remaining == 0) {
+      std::lock_guard<std::mutex> Guard(Pool.Lock);
+      Pool.Done.notify_all();
+    }
+  }
+  std::lock_guard<std::mutex> Guard(Pool.Lock);
+  Pool.Open.erase(std::remove(Pool.Open.begin(), Pool.Open.end(), L),
+                  Pool.Open.end());
+}
+
+static void pfor_worker() {
+  Pfor_Pool &Pool = pfor_pool();
+  while (true) {
+    std::shared_ptr<Pfor_Loop> L;
+    {
+      std::unique_lock<std::mutex> Guard(Pool.Lock);
+      Pool.Wake.wait(Guard, [&] { return !Pool.Open.empty(); });
+      L = Pool.Open.back();
+    }
+    pfor_work(L, L->Next_Thread++ % L->Queues.size());
+  }
+}
+
+static int toy_parallel_for(Pfor_Chunk_Fn Chunk, void *Ctx, int Start, 
+                            int Step, int64_t Count, int Op) {
+  if (Num_Jobs == 1 || Count < 2)
+    return Chunk(Ctx, Start, Step, Count);
+
+  std::shared_ptr<Pfor_Loop> L = std::make_shared<Pfor_Loop>(Num_Jobs);
+  L->Chunk = Chunk;
+  L->Ctx = Ctx;
+  L->Start = Start;
+  L->Step = Step;
+  L->Count = Count;
+  // several chunks per thread, to balance bodies of uneven cost
+  int64_t Num_Chunks = std::min<int64_t>(Count, 8 * Num_Jobs);
+  L->Chunk_Size = (Count + Num_Chunks - 1) / Num_Chunks;
+  Num_Chunks = (Count + L->Chunk_Size - 1) / L->Chunk_Size;
+  for (unsigned Idx = 0; Idx < Num_Chunks; Idx++)
+    L->Queues[Idx % Num_Jobs].push_back(Idx);
+  L->Partials.resize(Num_Chunks);
+  L->Remaining = Num_Chunks;
+
+  Pfor_Pool &Pool = pfor_pool();
+  {
+    std::lock_guard<std::mutex> Guard(Pool.Lock);
+    if (!Pool.Started) {
+      for (unsigned idx = 1; idx < Num_Jobs; idx++)
+        std::thread(pfor_worker).detach();
+      Pool.Started = true;
+    }
+    Pool.Open.push_back(L);
+  }
+  Pool.Wake.notify_all();
+  pfor_work(L, 0);
+  {
+    std::unique_lock<std::mutex> Guard(Pool.Lock);
+    Pool.Done.wait(Guard, [&] { return L->Remaining == 0; });
+  }
+
+  // partials are combined in chunk order, so the result is the same for
+  // any number of threads
+  int Result = reduce_identity(Op);
+  for (int Partial : L->Partials)
+    Result = reduce_combine(Op, Result, Partial);
+  return Result;
+}
+
+class ExprParallelForAST : public BaseAST {
+  Symbol Var_Name;
+  unsigned Slot;
+  BaseAST *Start, *End, *Step, *Body;
+  int Op;
+
+  Function *outline_body(ArrayType *CtxTy, 
+                         const std::vector<unsigned> &Captured);
+
+public:
+  ExprParallelForAST(Symbol varname, BaseAST *start, BaseAST *end,
+                     BaseAST *step, BaseAST *body, int op)
+      : Var_Name(varname), Slot(0), Start(start), End(end), Step(step), 
+        Body(body), Op(op) {}
+  Value *code_gen() override;
+  bool resolve() override;
+  bool is_pure() const override {
+    return Start->is_pure() && End->is_pure() && Step->is_pure() && 
+           Body->is_pure();
+  }
+  void collect_calls(std::vector<Symbol> &Callees) const override {
+    Start->collect_calls(Callees);
+    End->collect_calls(Callees);
+    Step->collect_calls(Callees);
+    Body->collect_calls(Callees);
+  }
+};
+
+// Start, End and Step are evaluated once, outside of the loop variable.
+bool ExprParallelForAST::resolve() {
+  if (!Start->resolve() || !End->resolve() || !Step->resolve())
+    return false;
+
+  Scopes.push_scope();
+  Slot = Num_Slots++;
+  Scopes.bind(Var_Name, Slot);
+  bool Resolved = Body->resolve();
+  Scopes.pop_scope();
+  return Resolved;
+}
+
+// Emit "int F.pfor(i8 *Ctx, int Lo, int Step, i64 Count)", which runs
+// Count iterations of the body from Lo and reduces their values. The
+// slots in Captured are passed in the Ctx array.
+Function *ExprParallelForAST::outline_body(ArrayType *CtxTy, 
+    const std::vector<unsigned> &Captured) {
+  Type *Int32Ty = Type::getInt32Ty(context);
+  Type *Int64Ty = Type::getInt64Ty(context);
+  Function *Outer = Builder.GetInsertBlock()->getParent();
+  FunctionType *ChunkTy = FunctionType::get(Int32Ty, 
+      {Type::getInt8PtrTy(context), Int32Ty, Int32Ty, Int64Ty}, false);
+  Function *Chunk = Function::Create(ChunkTy, Function::InternalLinkage, 
+                                     Outer->getName() + ".pfor", Module_ob);
+  Function::arg_iterator arg_it = Chunk->arg_begin();
+  Value *Ctx = &*arg_it++;
+  Value *Lo = &*arg_it++;
+  Value *StepVal = &*arg_it++;
+  Value *Count = &*arg_it;
+
+  BasicBlock *EntryBB = BasicBlock::Create(context, "entry", Chunk);
+  BasicBlock *LoopBB = BasicBlock::Create(context, "loop", Chunk);
+  BasicBlock *AfterBB = BasicBlock::Create(context, "afterloop");
+
+  Builder.SetInsertPoint(EntryBB);
+  DIScope *Outer_Scope = Dbg_Scope;
+  dbg_begin_function(Chunk, Loc);
+  emit_location(this);
+  Value *CtxArr = Builder.CreateBitCast(Ctx, CtxTy->getPointerTo());
+  std::vector<Value *> Outer_Slots(Local_Slots.size(), 0);
+  Outer_Slots.swap(Local_Slots);
+  for (unsigned idx = 0; idx < Captured.size(); idx++) {
+    Value *Ptr = Builder.CreateConstInBoundsGEP2_32(CtxTy, CtxArr, 0, idx);
+    Local_Slots[Captured[idx]] = Builder.CreateLoad(Int32Ty, Ptr, "cap");
+  }
+  Value *Identity = Builder.getInt32(reduce_identity(Op));
+  Builder.CreateCondBr(Builder.CreateICmpSGT(Count, Builder.getInt64(0)), 
+                       LoopBB, AfterBB);
+
+  Builder.SetInsertPoint(LoopBB);
+  PHINode *Iter = Builder.CreatePHI(Int64Ty, 2, "iter");
+  PHINode *Acc = Builder.CreatePHI(Int32Ty, 2, "acc");
+  Iter->addIncoming(Builder.getInt64(0), EntryBB);
+  Acc->addIncoming(Identity, EntryBB);
+  Value *Offset = Builder.CreateMul(Builder.CreateTrunc(Iter, Int32Ty), 
+                                    StepVal);
+  Local_Slots[Slot] = Builder.CreateAdd(Lo, Offset, symbol_name(Var_Name));
+
+  Value *BodyVal = Body->code_gen();
+  Outer_Slots.swap(Local_Slots);
+  if (BodyVal == 0) {
+    Dbg_Scope = Outer_Scope;
+    Chunk->eraseFromParent();
+    delete AfterBB;
+    return 0;
+  }
+  emit_location(this);
+
+  Value *NextAcc;
+  switch (Op) {
+    case REDUCE_ADD: NextAcc = Builder.CreateAdd(Acc, BodyVal, "acc"); break;
+    case REDUCE_MUL: NextAcc = Builder.CreateMul(Acc, BodyVal, "acc"); break;
+    case REDUCE_MIN: 
+      NextAcc = Builder.CreateSelect(Builder.CreateICmpSLT(BodyVal, Acc), 
+                                     BodyVal, Acc, "acc");
+      break;
+    case REDUCE_MAX: 
+      NextAcc = Builder.CreateSelect(Builder.CreateICmpSGT(BodyVal, Acc), 
+                                     BodyVal, Acc, "acc");
+      break;
+    default: NextAcc = Acc; break;
+  }
+  Value *NextIter = Builder.CreateAdd(Iter, Builder.getInt64(1), "nextiter");
+  BasicBlock *LoopEndBB = Builder.GetInsertBlock();
+  Iter->addIncoming(NextIter, LoopEndBB);
+  Acc->addIncoming(NextAcc, LoopEndBB);
+  Builder.CreateCondBr(Builder.CreateICmpSLT(NextIter, Count), 
+                       LoopBB, AfterBB);
+
+  Chunk->getBasicBlockList().push_back(AfterBB);
+  Builder.SetInsertPoint(AfterBB);
+  PHINode *Result = Builder.CreatePHI(Int32Ty, 2, "result");
+  Result->addIncoming(Identity, EntryBB);
+  Result->addIncoming(NextAcc, LoopEndBB);
+  Builder.CreateRet(Result);
+  verifyFunction(*Chunk);
+  Dbg_Scope = Outer_Scope;
+  return Chunk;
+}
+
+// The live slots are stored into an array on the stack of the enclosing
+// function, then the outlined body runs through the runtime in the JIT.
+// An object file has no runtime to link with, so there the body runs
+// over the whole range on one thread.
+Value *ExprParallelForAST::code_gen() {
+  MEM_SCOPE(MEM_IR, "ExprParallelForAST::code_gen");
+  Value *StartVal = Start->code_gen();
+  Value *EndVal = StartVal ? End->code_gen() : 0;
+  Value *StepVal = EndVal ? Step->code_gen() : 0;
+  if (StepVal == 0)
+    return 0;
+  emit_location(this);
+
+  Type *Int32Ty = Type::getInt32Ty(context);
+  Type *Int64Ty = Type::getInt64Ty(context);
+  std::vector<unsigned> Captured;
+  for (unsigned idx = 0; idx < Local_Slots.size(); idx++) {
+    if (Local_Slots[idx] != 0 && idx != Slot)
+      Captured.push_back(idx);
+  }
+  ArrayType *CtxTy = ArrayType::get(Int32Ty, 
+                                    std::max<size_t>(Captured.size(), 1));
+  Function *Outer = Builder.GetInsertBlock()->getParent();
+  IRBuilder<> Entry_Builder(&Outer->getEntryBlock(), 
+                            Outer->getEntryBlock().begin());
+  AllocaInst *Ctx = Entry_Builder.CreateAlloca(CtxTy, 0, "pfor.ctx");
+  for (unsigned idx = 0; idx < Captured.size(); idx++)
+    Builder.CreateStore(Local_Slots[Captured[idx]], 
+        Builder.CreateConstInBoundsGEP2_32(CtxTy, Ctx, 0, idx));
+
+  // iterations, in 64 bits so end - start can not overflow
+  Value *Positive = Builder.CreateICmpSGT(StepVal, Builder.getInt32(0));
+  Value *Step64 = Builder.CreateSExt(
+      Builder.CreateSelect(Positive, StepVal, Builder.getInt32(1)), Int64Ty);
+  Value *Span = Builder.CreateSub(Builder.CreateSExt(EndVal, Int64Ty), 
+                                  Builder.CreateSExt(StartVal, Int64Ty));
+  Value *Count = Builder.CreateSDiv(
+      Builder.CreateAdd(Span, Builder.CreateSub(Step64, Builder.getInt64(1))),
+      Step64);
+  Value *Runs = Builder.CreateAnd(Positive, 
+      Builder.CreateICmpSGT(Span, Builder.getInt64(0)));
+  Count = Builder.CreateSelect(Runs, Count, Builder.getInt64(0), "count");
+
+  BasicBlock *CurBB = Builder.GetInsertBlock();
+  Function *Chunk = outline_body(CtxTy, Captured);
+  Builder.SetInsertPoint(CurBB);
+  emit_location(this);
+  if (Chunk == 0)
+    return 0;
+
+  Value *CtxPtr = Builder.CreateBitCast(Ctx, Type::getInt8PtrTy(context));
+  if (AOT_Mode)
+    return Builder.CreateCall(Chunk, {CtxPtr, StartVal, StepVal, Count}, 
+                              "pfor");
+  FunctionType *RuntimeTy = FunctionType::get(Int32Ty, 
+      {Chunk->getType(), Type::getInt8PtrTy(context), Int32Ty, Int32Ty, 
+       Int64Ty, Int32Ty}, false);
+  FunctionCallee Runtime = Module_ob->getOrInsertFunction(
+      "__toy_parallel_for", RuntimeTy);
+  return Builder.CreateCall(Runtime, {Chunk, CtxPtr, StartVal, StepVal, 
+                                      Count, Builder.getInt32(Op)}, "pfor");
+}
+
+// Move the body of the pure function F into F.impl and turn F into a
+// lookup in a direct-mapped memo table of Memo_Size entries. Each entry
+// keeps its argument keys next to the cached value, so a probe touches a
+// single cache line; a colliding call simply evicts the old entry.
+// Recursive calls in the body still go through F and hit the table.
+static void memoize_function(Function *F) {
+  MEM_SCOPE(MEM_IR, __func__);
+  unsigned NumArgs = F->arg_size();
+  if (NumArgs == 0)
+    return;
+
+  Type *Int8Ty = Type::getInt8Ty(context);
+  Type *Int32Ty = Type::getInt32Ty(context);
+  Function *Impl = Function::Create(F->getFunctionType(), 
+                                    Function::InternalLinkage,
+                                    F->getName() + ".impl", Module_ob);
+  Impl->getBasicBlockList().splice(Impl->begin(), F->getBasicBlockList());
+  Function::arg_iterator impl_arg = Impl->arg_begin();
+  for (Argument &Arg : F->args()) {
+    Arg.replaceAllUsesWith(&*impl_arg);
+    impl_arg->setName(Arg.getName());
+    ++impl_arg;
+  }
+  // the locations of the body belong to Impl now, the lookup has none
+  Impl->setSubprogram(F->getSubprogram());
+  F->setSubprogram(0);
+  Builder.SetCurrentDebugLocation(DebugLoc());
+
+  // entry layout: { keys, value, valid }
+  StructType *EntryTy = StructType::get(context, 
+      {ArrayType::get(Int32Ty, NumArgs), Int32Ty, Int8Ty});
+  ArrayType *TableTy = ArrayType::get(EntryTy, Memo_Size);
+  GlobalVariable *Table = new GlobalVariable(
+      *Module_ob, TableTy, false, GlobalValue::InternalLinkage,
+      ConstantAggregateZero::get(TableTy), F->getName() + ".memo");
+
+  BasicBlock *EntryBB = BasicBlock::Create(context, "entry", F);
+  BasicBlock *HitBB = BasicBlock::Create(context, "hit", F);
+  BasicBlock *MissBB = BasicBlock::Create(context, "miss", F);
+
+  // FNV-1a style hash of the arguments
+  Builder.SetInsertPoint(EntryBB);
+  std::vector<Value *> ArgsV;
+  Value *Hash = Builder.getInt32(2166136261u);
+  for (Argument &Arg : F->args()) {
+    ArgsV.push_back(&Arg);
+    Hash = Builder.CreateXor(Hash, &Arg);
+    Hash = Builder.CreateMul(Hash, Builder.getInt32(16777619u));
+  }
+  Value *Slot = Builder.CreateAnd(Hash, Memo_Size - 1, "slot");
+  Slot = Builder.CreateZExt(Slot, Type::getInt64Ty(context));
+  Value *Entry = Builder.CreateInBoundsGEP(TableTy, Table, 
+                                          {Builder.getInt64(0), Slot},
+                                          "slotptr");
+
+  Value *ValidPtr = Builder.CreateStructGEP(EntryTy, Entry, 2);
+  Value *Valid = Builder.CreateLoad(Int8Ty, ValidPtr);
+  Value *Match = Builder.CreateICmpNE(Valid, Builder.getInt8(0));
+  std::vector<Value *> KeyPtrs;
+  for (unsigned idx = 0; idx < NumArgs; idx++) {
+    Value *KeyPtr = Builder.CreateInBoundsGEP(EntryTy, Entry, 
+        {Builder.getInt64(0), Builder.getInt32(0), Builder.getInt32(idx)});
+    KeyPtrs.push_back(KeyPtr);
+    Value *Key = Builder.CreateLoad(Int32Ty, KeyPtr);
+    Match = Builder.CreateAnd(Match, Builder.CreateICmpEQ(Key, ArgsV[idx]));
+  }
+  Value *ValuePtr = Builder.CreateStructGEP(EntryTy, Entry, 1);
+  Builder.CreateCondBr(Match, HitBB, MissBB);
+
+  Builder.SetInsertPoint(HitBB);
+  Builder.CreateRet(Builder.CreateLoad(Int32Ty, ValuePtr, "memoval"));
+
+  Builder.SetInsertPoint(MissBB);
+  Value *RetVal = Builder.CreateCall(Impl, ArgsV, "calltmp");
+  for (unsigned idx = 0; idx < NumArgs; idx++)
+    Builder.CreateStore(ArgsV[idx], KeyPtrs[idx]);
+  Builder.CreateStore(RetVal, ValuePtr);
+  Builder.CreateStore(Builder.getInt8(1), ValidPtr);
+  Builder.CreateRet(RetVal);
+
+  verifyFunction(*F);
+}
+
+
+// Read the next char, keeping Cur_Loc at the position of LastChar.
+static int read_char() {
+  if (LastChar == '\n') {
+    Cur_Loc.Line++;
+    Cur_Loc.Col = 1;
+  } else {
+    Cur_Loc.Col++;
+  }
+  return fgetc(file);
+}
 
 static int get_token() {
+  MEM_SCOPE(MEM_LEX, __func__);
   while(isspace(LastChar))
-    LastChar = fgetc(file);
+    LastChar = read_char();
+  Token_Loc = Cur_Loc;
 
   if(isalpha(LastChar)) {
     Identifier_string = LastChar;
 
-    while(isalnum((LastChar = fgetc(file))))
+    while(isalnum((LastChar = read_char())))
       Identifier_string += LastChar;
 
-    if(Identifier_string == "def") {
-      return DEF_TOKEN;
-    } else if(Identifier_string == "if") {
-      return IF_TOKEN;
-    } else if(Identifier_string == "then") {
-      return THEN_TOKEN;
-    } else if(Identifier_string == "else") {
-      return ELSE_TOKEN;
-    } else if(Identifier_string == "for") {
-      return FOR_TOKEN;
-    } else if(Identifier_string == "in") {
-      return IN_TOKEN;
-    } else if(Identifier_string == "binary") {
-      return BINARY_TOKEN;
-    } else {
-      return IDENTIFIER_TOKEN;
-    }
+    Identifier_sym = intern(Identifier_string);
+    if(Identifier_sym < Keyword_Tokens.size())
+      return Keyword_Tokens[Identifier_sym];
+    return IDENTIFIER_TOKEN;
   }
 
   if(isdigit(LastChar)) {
     std::string NumStr;
     do {
       NumStr += LastChar;
-      LastChar = fgetc(file);
+      LastChar = read_char();
     } while(isdigit(LastChar));
 
     Numeric_Val = strtod(NumStr.c_str(), 0);
@@ -509,26 +1691,26 @@ static int get_token() {
 
   if(LastChar == '#') {
     do {
-      LastChar = fgetc(file);
+      LastChar = read_char();
     } while(LastChar != EOF && LastChar != '\n' && LastChar != '\r');
    
-    LastChar = fgetc(file);
+    LastChar = read_char();
     // The next char of EOF is still EOF
     return COMMENT_TOKEN;
   }
 
   if(LastChar == '(') {
-    LastChar = fgetc(file);
+    LastChar = read_char();
     return LPARAN_TOKEN;
   }
 
   if(LastChar == ')') {
-    LastChar = fgetc(file);
+    LastChar = read_char();
     return RPARAN_TOKEN;
   }
 
   if(LastChar == ',') {
-    LastChar = fgetc(file);
+    LastChar = read_char();
     return COMM_TOKEN;
   }
 
@@ -536,7 +1718,7 @@ static int get_token() {
     return EOF_TOKEN;
 
   int ThisChar = LastChar;
-  LastChar = fgetc(file);
+  LastChar = read_char();
   return ThisChar;
 }
 
@@ -563,6 +1745,7 @@ static int next_token() {
 
 static BaseAST *numeric_parser()
 {
+  MEM_SCOPE(MEM_PARSE, __func__);
   BaseAST *Result = new NumericAST(Numeric_Val);
   next_token();
   return Result;
@@ -570,7 +1753,9 @@ static BaseAST *numeric_parser()
 
 static BaseAST *identifier_parser()
 {
-  std::string IdName = Identifier_string;
+  MEM_SCOPE(MEM_PARSE, __func__);
+  Source_Loc Loc = Token_Loc;
+  Symbol IdName = Identifier_sym;
   next_token();
 
   if(Current_token != LPARAN_TOKEN)
@@ -593,10 +1778,13 @@ static BaseAST *identifier_parser()
   }
   // equal to RPARAN_TOKEN
   next_token();
-  return new FunctionCallAST(IdName, Args);
+  BaseAST *Call = new FunctionCallAST(IdName, Args);
+  Call->Loc = Loc;
+  return Call;
 }
 
 static FunctionDeclAST *func_decl_parser() {
+  MEM_SCOPE(MEM_PARSE, __func__);
   std::string FnName;
   unsigned Kind = 0;
   unsigned BinaryPrecedence = 30;
@@ -643,11 +1831,11 @@ static FunctionDeclAST *func_decl_parser() {
   check_cond(Current_token == LPARAN_TOKEN, 
              "Error in func_decl_parser: no left paran!\n");
 
-  std::vector<std::string> FunctionArgNames;
+  std::vector<Symbol> FunctionArgNames;
   next_token();
   while(Current_token == IDENTIFIER_TOKEN || Current_token == COMM_TOKEN) {
     if (Current_token == IDENTIFIER_TOKEN) {
-      FunctionArgNames.push_back(Identifier_string);
+      FunctionArgNames.push_back(Identifier_sym);
     }
     next_token();
   }
@@ -660,24 +1848,30 @@ static FunctionDeclAST *func_decl_parser() {
   }
 
   next_token();
-  return new FunctionDeclAST(FnName, FunctionArgNames, 
+  return new FunctionDeclAST(intern(FnName), FunctionArgNames, 
                              Kind != 0, BinaryPrecedence);
 }
 
 static FunctionDefnAST *func_defn_parser() {
+  MEM_SCOPE(MEM_PARSE, __func__);
+  Source_Loc Loc = Token_Loc;
   // skip the 'def' token
   next_token();
   FunctionDeclAST *Decl = func_decl_parser();
   check_cond(Decl != 0, "Error in func_defn_parser: from func_decl_parser!\n");
 
-  if(BaseAST *Body = expression_parser())
-    return new FunctionDefnAST(Decl, Body);
+  if(BaseAST *Body = expression_parser()) {
+    FunctionDefnAST *Defn = new FunctionDefnAST(Decl, Body);
+    Defn->Loc = Loc;
+    return Defn;
+  }
 
   printf("Error in func_defn_parser!\n");
   exit(0);
 }
 
 static BaseAST *expression_parser() {
+  MEM_SCOPE(MEM_PARSE, __func__);
   BaseAST *LHS = Base_Parser();
   check_cond(LHS != 0, "Error in expression_parser: from Base_Parser!\n");
 
@@ -689,6 +1883,7 @@ static BaseAST *expression_parser() {
 }
 
 static BaseAST *paran_parser() {
+  MEM_SCOPE(MEM_PARSE, __func__);
   next_token();
   BaseAST *V = expression_parser();
   check_cond(V != 0, "Error in paran_parser: from expression_parser!\n");
@@ -699,6 +1894,8 @@ static BaseAST *paran_parser() {
 }
 
 static BaseAST *if_parser() {
+  MEM_SCOPE(MEM_PARSE, __func__);
+  Source_Loc Loc = Token_Loc;
   next_token();
 
   BaseAST *cond = expression_parser();
@@ -717,15 +1914,19 @@ static BaseAST *if_parser() {
   BaseAST *Else = expression_parser();
   check_cond(Else != 0, "Error in if_parser : empty Else!\n");
 
-  return new ExprIfAST(cond, Then, Else);
+  BaseAST *If = new ExprIfAST(cond, Then, Else);
+  If->Loc = Loc;
+  return If;
 }
 
 static BaseAST *for_parser() {
+  MEM_SCOPE(MEM_PARSE, __func__);
+  Source_Loc Loc = Token_Loc;
   next_token();
 
   check_cond(Current_token == IDENTIFIER_TOKEN, 
              "Error in for_parser, IDENTIFIER_TOKEN expected!\n");
-  std::string IdName = Identifier_string;
+  Symbol IdName = Identifier_sym;
 
   next_token();
   check_cond(Current_token == '=', "Error in for_parser, '=' expected!\n");
@@ -757,7 +1958,75 @@ static BaseAST *for_parser() {
   check_cond(Body != 0, 
              "Error in for_parser (Body), from expression_parser!\n");
 
-  return new ExprForAST (IdName, Start, End, Step, Body);
+  BaseAST *For = new ExprForAST (IdName, Start, End, Step, Body);
+  For->Loc = Loc;
+  return For;
+}
+
+static BaseAST *parallel_for_parser() {
+  MEM_SCOPE(MEM_PARSE, __func__);
+  Source_Loc Loc = Token_Loc;
+  next_token();
+  check_cond(Current_token == FOR_TOKEN, 
+             "Error in parallel_for_parser, FOR_TOKEN expected!\n");
+
+  next_token();
+  check_cond(Current_token == IDENTIFIER_TOKEN, 
+             "Error in parallel_for_parser, IDENTIFIER_TOKEN expected!\n");
+  Symbol IdName = Identifier_sym;
+
+  next_token();
+  check_cond(Current_token == '=', 
+             "Error in parallel_for_parser, '=' expected!\n");
+
+  next_token();
+  BaseAST *Start = expression_parser();
+  check_cond(Start != 0, 
+             "Error in parallel_for_parser (Start), from expression_parser!\n");
+  check_cond(Current_token == COMM_TOKEN, 
+             "Error in parallel_for_parser, COMM_TOKEN expected!\n");
+
+  next_token();
+  BaseAST *End = expression_parser();
+  check_cond(End != 0, 
+             "Error in parallel_for_parser (End), from expression_parser!\n");
+  check_cond(Current_token == COMM_TOKEN, 
+             "Error in parallel_for_parser, COMM_TOKEN expected!\n");
+
+  next_token();
+  BaseAST *Step = expression_parser();
+  check_cond(Step != 0, 
+             "Error in parallel_for_parser (Step), from expression_parser!\n");
+
+  int Op = REDUCE_NONE;
+  if (Current_token == REDUCE_TOKEN) {
+    next_token();
+    if (Current_token == '+')
+      Op = REDUCE_ADD;
+    else if (Current_token == '*')
+      Op = REDUCE_MUL;
+    else if (Current_token == IDENTIFIER_TOKEN && 
+             symbol_name(Identifier_sym) == "min")
+      Op = REDUCE_MIN;
+    else if (Current_token == IDENTIFIER_TOKEN && 
+             symbol_name(Identifier_sym) == "max")
+      Op = REDUCE_MAX;
+    check_cond(Op != REDUCE_NONE, 
+               "Error in parallel_for_parser, +, *, min or max expected!\n");
+    next_token();
+  }
+
+  check_cond(Current_token == IN_TOKEN, 
+             "Error in parallel_for_parser, IN_TOKEN expected!\n");
+
+  next_token();
+  BaseAST *Body = expression_parser();
+  check_cond(Body != 0, 
+             "Error in parallel_for_parser (Body), from expression_parser!\n");
+
+  BaseAST *For = new ExprParallelForAST(IdName, Start, End, Step, Body, Op);
+  For->Loc = Loc;
+  return For;
 }
 
 static BaseAST *Base_Parser() {
@@ -772,11 +2041,26 @@ static BaseAST *Base_Parser() {
       return if_parser();
     case FOR_TOKEN:
       return for_parser(); 
+    case PARALLEL_TOKEN:
+      return parallel_for_parser();
     default:
       return 0;
   }
 }
 
+// Intern the keywords first, so their symbols index Keyword_Tokens.
+static void init_keywords() {
+  const char *Names[] = {"def", "if", "then", "else", "for", "in", "binary",
+                         "parallel", "reduce"};
+  int Tokens[] = {DEF_TOKEN, IF_TOKEN, THEN_TOKEN, ELSE_TOKEN, FOR_TOKEN, 
+                  IN_TOKEN, BINARY_TOKEN, PARALLEL_TOKEN, REDUCE_TOKEN};
+
+  for (unsigned idx = 0; idx < sizeof(Tokens) / sizeof(Tokens[0]); idx++) {
+    check_cond(intern(Names[idx]) == idx, "Error: keyword interned late!\n");
+    Keyword_Tokens.push_back(Tokens[idx]);
+  }
+}
+
 static void init_precedence() {
   OperatorPrece['<'] = 1;
   OperatorPrece['-'] = 2;
@@ -799,6 +2083,7 @@ static int getBinOpPrecedence() {
 }
 
 static BaseAST *binary_op_parser(int old_prec, BaseAST *LHS) {
+  MEM_SCOPE(MEM_PARSE, __func__);
   while(1) {
     int cur_prec = getBinOpPrecedence();
 
@@ -806,6 +2091,7 @@ static BaseAST *binary_op_parser(int old_prec, BaseAST *LHS) {
       return LHS;
     
     int BinOp = Current_token;
+    Source_Loc Op_Loc = Token_Loc;
     next_token();
 
     BaseAST *RHS = Base_Parser();
@@ -818,12 +2104,23 @@ static BaseAST *binary_op_parser(int old_prec, BaseAST *LHS) {
                  "Error in binary_op_parser: from binary_op_parser!\n");
     }
     LHS = new BinaryAST(std::to_string(BinOp), LHS, RHS);
+    LHS->Loc = Op_Loc;
   }
 }
 
 static void HandleDefn() {
   if(FunctionDefnAST *F = func_defn_parser()) {
-    if(Function *LF = (Function *)(F->code_gen())) {
+    // operators are generated at once, they set their precedence
+    if (Lazy_Mode && !F->get_decl()->isBinaryOp()) {
+      Symbol Name = F->get_decl()->getName();
+      if (Name >= Pending_Defns.size())
+        Pending_Defns.resize(Name + 1, 0);
+      // like a redefinition in code_gen, the first one is kept
+      if (Pending_Defns[Name] == 0) {
+        Pending_Defns[Name] = F;
+        return;
+      }
+    } else if(Function *LF = (Function *)(F->code_gen())) {
       ;
     }
     delete F;
@@ -835,10 +2132,50 @@ static void HandleDefn() {
   return;
 }
 
+// Generate the pending definitions a node calls, transitively. Callees go
+// first so -memo knows whether they are pure; calls not generated yet are
+// declared by FunctionCallAST::resolve and filled in later.
+static void gen_reachable(const BaseAST *E) {
+  std::vector<Symbol> Callees;
+  E->collect_calls(Callees);
+  for (Symbol Callee : Callees) {
+    if (Callee >= Pending_Defns.size() || Pending_Defns[Callee] == 0)
+      continue;
+    FunctionDefnAST *F = Pending_Defns[Callee];
+    // taken before recursing, so recursive calls stop here
+    Pending_Defns[Callee] = 0;
+    gen_reachable(F);
+    F->code_gen();
+    delete F;
+  }
+}
+
 static void HandleTopExpression() {
+  Source_Loc Loc = Token_Loc;
   if(BaseAST *E = expression_parser()) {
-    if(E->code_gen()) {
-      ;
+    if (Lazy_Mode)
+      gen_reachable(E);
+
+    MEM_SCOPE(MEM_IR, __func__);
+    std::string Name = "__toplevel_" + std::to_string(Top_Level_Funcs.size());
+    FunctionType *FT = FunctionType::get(Type::getInt32Ty(context), false);
+    Function *F = Function::Create(FT, Function::ExternalLinkage, 
+                                   Name, Module_ob);
+    BasicBlock *BB = BasicBlock::Create(context, "entry", F);
+    Builder.SetInsertPoint(BB);
+    dbg_begin_function(F, Loc);
+
+    Num_Slots = 0;
+    bool Resolved = E->resolve();
+    Local_Slots.assign(Num_Slots, 0);
+    Value *retVal = Resolved ? E->code_gen() : 0;
+    if(retVal) {
+      Builder.CreateRet(retVal);
+      verifyFunction(*F);
+      Top_Level_Funcs.push_back(F);
+      Top_Level_Pure.push_back(E->is_pure());
+    } else {
+      F->eraseFromParent();
     }
     delete E;
   }
@@ -864,6 +2201,46 @@ static void Driver() {
   }
 }
 
+// Evaluate the top level expressions and print their results in source
+// order. A pure expression does not depend on anything run before it, so
+// with -j all of them go to the pool up front; the others may call
+// external functions and run on this thread in source order, as their
+// results are printed. Nothing runs if the code calls a function that
+// can not be resolved.
+static void run_top_level() {
+  MEM_SCOPE(MEM_JIT, __func__);
+  TheEngine->finalizeObject();
+  if (TheEngine->hasError()) {
+    printf("Error: %s\n", TheEngine->getErrorMessage().c_str());
+    exit(1);
+  }
+  typedef int (*Top_Level_Fn)();
+  std::vector<Top_Level_Fn> Funcs;
+  for (Function *F : Top_Level_Funcs) {
+    std::string Name = F->getName().str();
+    Top_Level_Fn Fn = (Top_Level_Fn)TheEngine->getFunctionAddress(Name);
+    if (!Fn) {
+      printf("Error: unresolved symbol %s\n", Name.c_str());
+      exit(1);
+    }
+    Funcs.push_back(Fn);
+  }
+
+  std::vector<std::shared_future<int>> Results(Funcs.size());
+  std::unique_ptr<ThreadPool> Pool;
+  if (Num_Jobs > 1) {
+    Pool.reset(new ThreadPool(hardware_concurrency(Num_Jobs)));
+    for (size_t idx = 0; idx < Funcs.size(); idx++) {
+      if (Top_Level_Pure[idx])
+        Results[idx] = Pool->async(Funcs[idx]);
+    }
+  }
+  for (size_t idx = 0; idx < Funcs.size(); idx++) {
+    int Val = Results[idx].valid() ? Results[idx].get() : Funcs[idx]();
+    printf("%d\n", Val);
+  }
+}
+
 void assign_dump_str() {
   // dump information
   dump_str[EOF_TOKEN] = "EOF_TOKEN"; 
@@ -880,27 +2257,419 @@ void assign_dump_str() {
   dump_str[FOR_TOKEN] = "FOR_TOKEN";
   dump_str[IN_TOKEN] = "IN_TOKEN";
   dump_str[BINARY_TOKEN] = "BINARY_TOKEN"; 
+  dump_str[PARALLEL_TOKEN] = "PARALLEL_TOKEN"; 
+  dump_str[REDUCE_TOKEN] = "REDUCE_TOKEN"; 
 
   return;
 }
 
+// Emit "int main()" which evaluates the top level expressions in source
+// order and prints each result.
+static void build_runtime_main() {
+  MEM_SCOPE(MEM_IR, __func__);
+  Type *Int32Ty = Type::getInt32Ty(context);
+  Type *Int8PtrTy = Type::getInt8PtrTy(context);
+  FunctionType *PrintfTy = FunctionType::get(Int32Ty, {Int8PtrTy}, true);
+  Function *Printf = Module_ob->getFunction("printf");
+  if (Printf == 0)
+    Printf = Function::Create(PrintfTy, Function::ExternalLinkage, 
+                              "printf", Module_ob);
+
+  FunctionType *MainTy = FunctionType::get(Int32Ty, false);
+  Function *Main = Function::Create(MainTy, Function::ExternalLinkage, 
+                                    "main", Module_ob);
+  check_cond(Main->getName() == "main", 
+             "Error: main is already defined in the program!\n");
+  Builder.SetInsertPoint(BasicBlock::Create(context, "entry", Main));
+  Builder.SetCurrentDebugLocation(DebugLoc());
+
+  Value *Format = Builder.CreateGlobalStringPtr("%d\n", "fmt");
+  for (Function *F : Top_Level_Funcs) {
+    Value *Val = Builder.CreateCall(F, {}, "val");
+    Builder.CreateCall(Printf, {Format, Val});
+  }
+  Builder.CreateRet(Builder.getInt32(0));
+  verifyFunction(*Main);
+}
+
+// Optimize Module_ob at Opt_Level and write it as a native object file,
+// then link it with the system compiler driver unless -c was given.
+static void emit_native() {
+  if (!Emit_Object_Only)
+    build_runtime_main();
+
+  MEM_SCOPE(MEM_CODEGEN, __func__);
+
+  std::string Error;
+  std::string TargetTriple = sys::getDefaultTargetTriple();
+  const Target *TheTarget = TargetRegistry::lookupTarget(TargetTriple, Error);
+  if (TheTarget == 0) {
+    printf("Error: %s\n", Error.c_str());
+    exit(0);
+  }
+
+  std::string CPU = CPU_Name.empty() ? sys::getHostCPUName().str() : CPU_Name;
+  CodeGenOpt::Level CGLevel = CodeGenOpt::Default;
+  switch (Opt_Level) {
+    case 0: CGLevel = CodeGenOpt::None; break;
+    case 1: CGLevel = CodeGenOpt::Less; break;
+    case 2: CGLevel = CodeGenOpt::Default; break;
+    default: CGLevel = CodeGenOpt::Aggressive; break;
+  }
+  TargetOptions Opts;
+  TargetMachine *TM = TheTarget->createTargetMachine(
+      TargetTriple, CPU, "", Opts, Reloc::PIC_, None, CGLevel);
+  check_cond(TM != 0, "Error: unable to create the target machine!\n");
+
+  Module_ob->setDataLayout(TM->createDataLayout());
+  Module_ob->setTargetTriple(TargetTriple);
+
+  PassManagerBuilder PMB;
+  PMB.OptLevel = Opt_Level;
+  if (Opt_Level > 1)
+    PMB.Inliner = createFunctionInliningPass(Opt_Level, 0, false);
+  TM->adjustPassManager(PMB);
+
+  {
+    MEM_SCOPE(MEM_OPT, "function passes");
+    legacy::FunctionPassManager FPM(Module_ob);
+    PMB.populateFunctionPassManager(FPM);
+    FPM.doInitialization();
+    for (Function &F : *Module_ob)
+      FPM.run(F);
+    FPM.doFinalization();
+  }
+  {
+    MEM_SCOPE(MEM_OPT, "module passes");
+    legacy::PassManager MPM;
+    PMB.populateModulePassManager(MPM);
+    MPM.run(*Module_ob);
+  }
+
+  std::string ObjFile = Emit_Object_Only ? Output_File : Output_File + ".o";
+  std::error_code EC;
+  raw_fd_ostream Dest(ObjFile, EC, sys::fs::OF_None);
+  if (EC) {
+    printf("Error: unable to open %s: %s\n", ObjFile.c_str(), 
+           EC.message().c_str());
+    exit(0);
+  }
+
+  legacy::PassManager PM;
+  check_cond(!TM->addPassesToEmitFile(PM, Dest, nullptr, CGFT_ObjectFile),
+             "Error: the target can not emit an object file!\n");
+  PM.run(*Module_ob);
+  Dest.close();
+  delete TM;
+
+  if (Emit_Object_Only)
+    return;
+
+  ErrorOr<std::string> CC = sys::findProgramByName("cc");
+  check_cond((bool)CC, "Error: unable to find cc to link with!\n");
+  StringRef Args[] = {*CC, ObjFile, "-o", Output_File};
+  int RC = sys::ExecuteAndWait(*CC, Args);
+  sys::fs::remove(ObjFile);
+  check_cond(RC == 0, "Error: linking failed!\n");
+}
+
+// Write "start size name" for every function the JIT loads to
+// /tmp/perf-<pid>.map, where perf looks up the symbols of JIT code. The
+// jitdump of LLVM's perf listener carries the code and line tables too,
+// but needs "perf inject --jit" before perf report can use it.
+class Perf_Map_Listener : public JITEventListener {
+  FILE *Map;
+
+public:
+  Perf_Map_Listener() {
+    std::string Name = "/tmp/perf-" + std::to_string(getpid()) + ".map";
+    Map = fopen(Name.c_str(), "w");
+    if (Map == NULL)
+      printf("Warning: unable to open %s.\n", Name.c_str());
+  }
+  ~Perf_Map_Listener() {
+    if (Map)
+      fclose(Map);
+  }
+
+  void notifyObjectLoaded(ObjectKey Key, const object::ObjectFile &Obj, 
+                          const RuntimeDyld::LoadedObjectInfo &L) override {
+    if (Map == NULL)
+      return;
+    // the copy for debuggers has the sections at their load addresses
+    object::OwningBinary<object::ObjectFile> Debug_Obj = 
+        L.getObjectForDebug(Obj);
+    if (Debug_Obj.getBinary() == 0)
+      return;
+    for (const auto &Sym_Size : 
+         object::computeSymbolSizes(*Debug_Obj.getBinary())) {
+      const object::SymbolRef &Sym = Sym_Size.first;
+      Expected<object::SymbolRef::Type> Type = Sym.getType();
+      Expected<StringRef> Name = Sym.getName();
+      Expected<uint64_t> Addr = Sym.getAddress();
+      if (!Type || !Name || !Addr || 
+          *Type != object::SymbolRef::ST_Function) {
+        consumeError(Type.takeError());
+        consumeError(Name.takeError());
+        consumeError(Addr.takeError());
+        continue;
+      }
+      fprintf(Map, "%llx %llx %s\n", (unsigned long long)*Addr, 
+              (unsigned long long)Sym_Size.second, Name->str().c_str());
+    }
+    fflush(Map);
+  }
+};
+
+// Count the missed and analysis remarks for -remarks-summary. The remark
+// file, if any, is written by the streamer of the context before this
+// sees them.
+struct Remark_Collector : public DiagnosticHandler {
+  bool isAnalysisRemarkEnabled(StringRef PassName) const override {
+    return Remarks_Summary;
+  }
+  bool isMissedOptRemarkEnabled(StringRef PassName) const override {
+    return Remarks_Summary;
+  }
+  bool isAnyRemarkEnabled() const override { return Remarks_Summary; }
+
+  bool handleDiagnostics(const DiagnosticInfo &DI) override {
+    auto *Remark = dyn_cast<DiagnosticInfoOptimizationBase>(&DI);
+    if (Remark == 0)
+      return false;
+    Pass_Remarks &Pass = Missed_Remarks[Remark->getFunction().getName().str()]
+                                       [Remark->getPassName().str()];
+    std::string Msg = Remark->getMsg();
+    std::replace(Msg.begin(), Msg.end(), '\n', ' ');
+    switch (DI.getKind()) {
+      case DK_OptimizationRemarkMissed:
+      case DK_MachineOptimizationRemarkMissed:
+        Pass.Missed[Msg]++;
+        break;
+      case DK_OptimizationRemarkAnalysis:
+      case DK_MachineOptimizationRemarkAnalysis:
+        Pass.Analysis[Msg]++;
+        break;
+      default:
+        break;
+    }
+    return true;
+  }
+};
+
+// the messages by count, most frequent first
+static void print_remark_counts(const std::map<std::string, unsigned> &Msgs, 
+                                const char *Suffix) {
+  std::vector<std::pair<unsigned, std::string>> Sorted;
+  for (auto &Msg : Msgs)
+    Sorted.push_back(std::make_pair(Msg.second, Msg.first));
+  std::stable_sort(Sorted.begin(), Sorted.end(), 
+      [](const std::pair<unsigned, std::string> &A, 
+         const std::pair<unsigned, std::string> &B) {
+        return A.first > B.first;
+      });
+  for (auto &Msg : Sorted)
+    printf("    %4u  %s%s\n", Msg.first, Msg.second.c_str(), Suffix);
+}
+
+static void print_remarks_summary() {
+  printf("missed optimizations:\n");
+  for (auto &Fn : Missed_Remarks) {
+    bool Missed = false;
+    for (auto &Pass : Fn.second)
+      Missed |= !Pass.second.Missed.empty();
+    if (!Missed)
+      continue;
+    printf("%s:\n", Fn.first.c_str());
+    for (auto &Pass : Fn.second) {
+      if (Pass.second.Missed.empty())
+        continue;
+      printf("  %s:\n", Pass.first.c_str());
+      print_remark_counts(Pass.second.Missed, "");
+      print_remark_counts(Pass.second.Analysis, " (analysis)");
+    }
+  }
+}
+
+static void usage(const char *prog) {
+  printf("Usage: %s [-memo] [-memo-size=N] [-c] [-o output] [-O0..3] "
+         "[-mcpu=cpu] [-lazy] [-run] [-j=N] [-g] [-perf] [-remarks=file] "
+         "[-remarks-format=yaml|bitstream] [-remarks-summary] "
+         "[-select-cost=N] [-mem-profile] [-mem-json=file] file\n", 
+         prog);
+  exit(0);
+}
+
 int main(int argc, char **argv) {
+  const char *file_name = NULL;
+
+  for (int idx = 1; idx < argc; idx++) {
+    if (strcmp(argv[idx], "-memo") == 0) {
+      Memo_Mode = true;
+    } else if (strncmp(argv[idx], "-memo-size=", 11) == 0) {
+      Memo_Mode = true;
+      Memo_Size = atoi(argv[idx] + 11);
+      check_cond(Memo_Size > 0, "Error: -memo-size must be positive!\n");
+      // the table is indexed by masking the hash
+      Memo_Size = PowerOf2Ceil(Memo_Size);
+    } else if (strcmp(argv[idx], "-c") == 0) {
+      AOT_Mode = true;
+      Emit_Object_Only = true;
+    } else if (strcmp(argv[idx], "-o") == 0 && idx + 1 < argc) {
+      AOT_Mode = true;
+      Output_File = argv[++idx];
+    } else if (argv[idx][0] == '-' && argv[idx][1] == 'O' &&
+               argv[idx][2] >= '0' && argv[idx][2] <= '3' &&
+               argv[idx][3] == 0) {
+      Opt_Level = argv[idx][2] - '0';
+    } else if (strncmp(argv[idx], "-mcpu=", 6) == 0) {
+      CPU_Name = argv[idx] + 6;
+    } else if (strcmp(argv[idx], "-lazy") == 0) {
+      Lazy_Mode = true;
+    } else if (strcmp(argv[idx], "-run") == 0) {
+      Run_Mode = true;
+    } else if (strncmp(argv[idx], "-j=", 3) == 0) {
+      Run_Mode = true;
+      Num_Jobs = atoi(argv[idx] + 3);
+      check_cond(Num_Jobs > 0, "Error: -j must be positive!\n");
+    } else if (strcmp(argv[idx], "-g") == 0) {
+      Debug_Info = true;
+    } else if (strcmp(argv[idx], "-perf") == 0) {
+      Perf_Mode = true;
+      Run_Mode = true;
+    } else if (strncmp(argv[idx], "-remarks=", 9) == 0) {
+      Remarks_File = argv[idx] + 9;
+    } else if (strncmp(argv[idx], "-remarks-format=", 16) == 0) {
+      Remarks_Format = argv[idx] + 16;
+    } else if (strcmp(argv[idx], "-remarks-summary") == 0) {
+      Remarks_Summary = true;
+    } else if (strncmp(argv[idx], "-select-cost=", 13) == 0) {
+      Select_Cost = atoi(argv[idx] + 13);
+    } else if (strcmp(argv[idx], "-mem-profile") == 0) {
+      Mem_Report = true;
+    } else if (strncmp(argv[idx], "-mem-json=", 10) == 0) {
+      Mem_Json_File = argv[idx] + 10;
+    } else if (argv[idx][0] == '-') {
+      usage(argv[0]);
+    } else {
+      file_name = argv[idx];
+    }
+  }
+  if (file_name == NULL)
+    usage(argv[0]);
+
+  check_cond(!Run_Mode || !AOT_Mode, 
+             "Error: -run, -j and -perf can not be combined with -c or -o!\n");
+  // every thread would update the same memo tables and counters
+  check_cond(Num_Jobs == 1 || (!Memo_Mode && !Mem_Report && 
+                                Mem_Json_File.empty()), 
+             "Error: -j can not be combined with -memo or the memory "
+             "report!\n");
+  check_cond(AOT_Mode || (Remarks_File.empty() && !Remarks_Summary), 
+             "Error: the remarks come from the pipeline of -c or -o!\n");
+  if (AOT_Mode && Output_File.empty())
+    Output_File = Emit_Object_Only ? "a.o" : "a.out";
+#ifndef MEM_PROFILE
+  check_cond(!Mem_Report && Mem_Json_File.empty(), 
+             "Error: build toy with -DMEM_PROFILE for the memory report!\n");
+#endif
+
+  init_keywords();
   init_precedence();
   assign_dump_str();
 
-  TheEngine = EngineBuilder(Module_ob).create();
-  file = fopen(argv[1], "r");
+  InitializeNativeTarget();
+  InitializeNativeTargetAsmPrinter();
+  // called by the code of parallel for
+  sys::DynamicLibrary::AddSymbol("__toy_parallel_for", 
+                                 (void *)&toy_parallel_for);
+
+  file = fopen(file_name, "r");
   if(file == NULL) {
-    printf("Error: unable to open %s.\n", argv[1]);
+    printf("Error: unable to open %s.\n", file_name);
     exit(0);
   }
 
+  std::unique_ptr<ToolOutputFile> Remarks_Out;
+  if (!Remarks_File.empty() || Remarks_Summary) {
+    // an ELF object has no section to point at a bitstream remark file,
+    // and llvm 14 crashes looking for it
+    const char *Remark_Args[] = {argv[0], "-remarks-section=false"};
+    cl::ParseCommandLineOptions(2, Remark_Args);
+    context.setDiagnosticHandler(std::make_unique<Remark_Collector>());
+    Expected<std::unique_ptr<ToolOutputFile>> Out = 
+        setupLLVMOptimizationRemarks(context, Remarks_File, "", 
+                                     Remarks_Format, false);
+    if (!Out) {
+      printf("Error: %s\n", toString(Out.takeError()).c_str());
+      exit(0);
+    }
+    Remarks_Out = std::move(*Out);
+  }
+
   Module_ob = new Module("my compiler", context);
+  if (Debug_Info) {
+    Module_ob->addModuleFlag(Module::Warning, "Debug Info Version", 
+                             DEBUG_METADATA_VERSION);
+    SmallString<128> Path(file_name);
+    sys::fs::make_absolute(Path);
+    DBuilder = new DIBuilder(*Module_ob);
+    Dbg_File = DBuilder->createFile(sys::path::filename(Path), 
+                                    sys::path::parent_path(Path));
+    DBuilder->createCompileUnit(dwarf::DW_LANG_C, Dbg_File, "toy", 
+                                Opt_Level > 0, "", 0);
+  }
+  if (!AOT_Mode) {
+    MEM_SCOPE(MEM_JIT, "EngineBuilder");
+    TheEngine = EngineBuilder(std::unique_ptr<Module>(Module_ob)).create();
+    // gdb finds the JIT code and its line tables through this one
+    if (Debug_Info || Perf_Mode)
+      TheEngine->RegisterJITEventListener(
+          JITEventListener::createGDBRegistrationListener());
+    if (Perf_Mode) {
+      TheEngine->RegisterJITEventListener(new Perf_Map_Listener());
+      if (JITEventListener *Jit_Dump = 
+              JITEventListener::createPerfJITEventListener())
+        TheEngine->RegisterJITEventListener(Jit_Dump);
+    }
+  }
   next_token();
   Driver();
+  if (DBuilder)
+    DBuilder->finalize();
+  // definitions nothing reached
+  for (FunctionDefnAST *F : Pending_Defns)
+    delete F;
 
-  printf("================================\n");
-  Module_ob->print(outs(), nullptr);
+  if (AOT_Mode) {
+    emit_native();
+    if (Remarks_Out)
+      Remarks_Out->keep();
+    if (Remarks_Summary)
+      print_remarks_summary();
+  } else {
+    printf("================================\n");
+    Module_ob->print(outs(), nullptr);
+    if (Run_Mode) {
+      outs().flush();
+      printf("================================\n");
+      run_top_level();
+    }
+  }
   fclose(file);
+
+#ifdef MEM_PROFILE
+  if (Mem_Report || !Mem_Json_File.empty()) {
+    // compile the module, so the jit phase includes the machine code
+    if (!AOT_Mode) {
+      MEM_SCOPE(MEM_JIT, "finalizeObject");
+      TheEngine->finalizeObject();
+    }
+    if (Mem_Report)
+      mem_report();
+    if (!Mem_Json_File.empty())
+      mem_report_json(Mem_Json_File.c_str());
+  }
+#endif
 }
 
@@ -0,0 +1,193 @@
+// Run the analyses of FunCount (-fc) and InstCount (-oc) over a module on
+// several threads.
+//
+// Bitcode input is mapped from the file once, and .ll input is parsed
+// and written to a bitcode image in memory. The function bodies are cut
+// into partitions of consecutive functions. Each partition is loaded
+// lazily into its own LLVMContext, so threads share no IR, and only the
+// bodies of its own functions are materialized. Results are merged in
+// module order, so the output does not depend on the number of threads.
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/Threading.h"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+using namespace llvm;
+
+static cl::opt<std::string> InputFile(cl::Positional, cl::Required,
+                                      cl::desc("<input bitcode or .ll>"));
+static cl::opt<unsigned> NumThreads("j", cl::init(0),
+    cl::desc("number of threads (default: all cores)"));
+static cl::opt<unsigned> PartitionsPerThread("partitions-per-thread",
+    cl::init(4), cl::desc("partitions per thread, for load balancing"));
+
+namespace {
+struct FunctionResult {
+  std::string Loops;
+  std::map<std::string, int> Opcodes;
+};
+
+// same output as FunctionCount::countBlocksInloop
+void countBlocksInloop(Loop *L, unsigned nest, raw_ostream &OS) {
+  unsigned numBlocks = L->getNumBlocks();
+  for (unsigned idx = 0; idx < nest * 2; idx++) {
+    OS << " ";
+  }
+  OS << "Loop level " << nest << " has " << numBlocks << " Blocks\n";
+  for (Loop *SubLoop : L->getSubLoops()) {
+    countBlocksInloop(SubLoop, nest + 1, OS);
+  }
+}
+
+void analyzeFunction(Function &F, FunctionResult &R) {
+  DominatorTree DT(F);
+  LoopInfo LI(DT);
+  raw_string_ostream OS(R.Loops);
+  for (Loop *L : LI) {
+    countBlocksInloop(L, 0, OS);
+  }
+  OS.flush();
+
+  for (BasicBlock &BB : F) {
+    for (Instruction &I : BB) {
+      R.Opcodes[I.getOpcodeName()] += 1;
+    }
+  }
+}
+
+// Load the module lazily into a private context and analyze the function
+// bodies [Begin, End).
+Error analyzePartition(MemoryBufferRef Buffer, unsigned Begin, unsigned End,
+                       std::vector<FunctionResult> &Results) {
+  LLVMContext Context;
+  Expected<std::unique_ptr<Module>> M = getLazyBitcodeModule(Buffer, Context);
+  if (!M)
+    return M.takeError();
+
+  unsigned idx = 0;
+  for (Function &F : **M) {
+    // bodies not materialized yet are not declarations
+    if (F.isDeclaration())
+      continue;
+    if (idx >= Begin && idx < End) {
+      if (Error E = F.materialize())
+        return E;
+      analyzeFunction(F, Results[idx]);
+    }
+    if (++idx >= End)
+      break;
+  }
+  return Error::success();
+}
+}
+
+int main(int argc, char **argv) {
+  cl::ParseCommandLineOptions(argc, argv,
+                              "parallel loop and opcode counter\n");
+
+  ErrorOr<std::unique_ptr<MemoryBuffer>> File =
+      MemoryBuffer::getFileOrSTDIN(InputFile);
+  if (!File) {
+    errs() << argv[0] << ": " << InputFile << ": "
+           << File.getError().message() << "\n";
+    return 1;
+  }
+
+  // the bitcode every partition loads from: the file itself, or for .ll
+  // input an image written from the parsed module
+  MemoryBufferRef Buffer = (*File)->getMemBufferRef();
+  SmallVector<char, 0> Bitcode;
+  LLVMContext Context;
+  std::unique_ptr<Module> M;
+  if (isBitcode((const unsigned char *)Buffer.getBufferStart(),
+                (const unsigned char *)Buffer.getBufferEnd())) {
+    // only the names are needed here, so no body is materialized
+    Expected<std::unique_ptr<Module>> Lazy =
+        getLazyBitcodeModule(Buffer, Context);
+    if (!Lazy) {
+      logAllUnhandledErrors(Lazy.takeError(), errs(), "error: ");
+      return 1;
+    }
+    M = std::move(*Lazy);
+  } else {
+    SMDiagnostic Err;
+    M = parseIR(Buffer, Err, Context);
+    if (!M) {
+      Err.print(argv[0], errs());
+      return 1;
+    }
+    raw_svector_ostream BitcodeOS(Bitcode);
+    WriteBitcodeToFile(*M, BitcodeOS);
+    Buffer = MemoryBufferRef(StringRef(Bitcode.data(), Bitcode.size()),
+                             InputFile);
+  }
+
+  // bodies not materialized yet are not declarations
+  std::vector<std::string> Names;
+  for (Function &F : *M) {
+    if (!F.isDeclaration())
+      Names.push_back(F.getName().str());
+  }
+  M.reset();
+
+  ThreadPoolStrategy Strategy = hardware_concurrency(NumThreads);
+  ThreadPool Pool(Strategy);
+  unsigned NumPartitions = std::max(1u, Strategy.compute_thread_count() *
+                                            PartitionsPerThread);
+  unsigned Size = (Names.size() + NumPartitions - 1) / NumPartitions;
+  if (Size == 0)
+    Size = 1;
+
+  std::vector<FunctionResult> Results(Names.size());
+  std::vector<Error> Errors;
+  std::mutex ErrorsLock;
+  for (unsigned Begin = 0; Begin < Names.size(); Begin += Size) {
+    unsigned End = std::min<unsigned>(Begin + Size, Names.size());
+    Pool.async([&, Begin, End] {
+      if (Error E = analyzePartition(Buffer, Begin, End, Results)) {
+        std::lock_guard<std::mutex> Guard(ErrorsLock);
+        Errors.push_back(std::move(E));
+      }
+    });
+  }
+  Pool.wait();
+
+  Error AllErrors = Error::success();
+  for (Error &E : Errors)
+    AllErrors = joinErrors(std::move(AllErrors), std::move(E));
+  if (AllErrors) {
+    logAllUnhandledErrors(std::move(AllErrors), errs(), "error: ");
+    return 1;
+  }
+
+  std::map<std::string, int> Total;
+  for (unsigned idx = 0; idx < Names.size(); idx++) {
+    outs() << "Function: " << Names[idx] << "\n";
+    outs() << Results[idx].Loops;
+    for (auto &Op : Results[idx].Opcodes) {
+      outs() << Op.first << ": " << Op.second << "\n";
+      Total[Op.first] += Op.second;
+    }
+  }
+  outs() << "Module: " << Names.size() << " functions\n";
+  for (auto &Op : Total) {
+    outs() << Op.first << ": " << Op.second << "\n";
+  }
+  return 0;
+}
@@ -0,0 +1,8 @@
+mkdir -p ./build
+cd ./build
+rm -rf *
+cmake ../
+make
+cd ../
+./build/ParallelAnalysis -j 4 ../00_FunCount/exam_00.ll
+./build/ParallelAnalysis -j 4 ../01_InstCount/exam_00.bc
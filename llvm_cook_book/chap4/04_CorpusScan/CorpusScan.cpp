@@ -0,0 +1,278 @@
+// Opcode and loop report over a whole corpus of bitcode files, instead of
+// one "opt -load libInstCount.so -oc" run per file.
+//
+// - every file is memory mapped and loaded lazily; only the bodies of the
+//   functions that pass -name are materialized, and -min-insts/-max-insts
+//   drop the ones outside the size range after that
+// - per file results are cached under -cache-dir, keyed by a hash of the
+//   file content and of the filters, so unchanged files are not reloaded
+// - -j forks worker processes which share the files round robin; the
+//   parent merges their cache entries into one report
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/LineIterator.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Regex.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/xxhash.h"
+#include <algorithm>
+#include <map>
+#include <string>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace llvm;
+
+static cl::list<std::string> Inputs(cl::Positional, cl::OneOrMore,
+    cl::desc("<bitcode files or directories>"));
+static cl::opt<std::string> NameFilter("name", cl::init(""),
+    cl::desc("only scan functions whose name matches this regex"));
+static cl::opt<unsigned> MinInsts("min-insts", cl::init(0),
+    cl::desc("skip functions with fewer instructions"));
+static cl::opt<unsigned> MaxInsts("max-insts", cl::init(~0u),
+    cl::desc("skip functions with more instructions"));
+static cl::opt<std::string> CacheDir("cache-dir", cl::init(".corpus-cache"),
+    cl::desc("directory of the per file result cache"));
+static cl::opt<unsigned> NumJobs("j", cl::init(1),
+    cl::desc("number of worker processes"));
+
+namespace {
+struct ScanResult {
+  unsigned Functions = 0;
+  std::map<std::string, uint64_t> Opcodes;
+  // number of loops at each nesting level
+  std::map<unsigned, uint64_t> Loops;
+
+  void merge(const ScanResult &R) {
+    Functions += R.Functions;
+    for (auto &Op : R.Opcodes)
+      Opcodes[Op.first] += Op.second;
+    for (auto &L : R.Loops)
+      Loops[L.first] += L.second;
+  }
+};
+
+void countLoops(Loop *L, unsigned nest, ScanResult &R) {
+  R.Loops[nest] += 1;
+  for (Loop *SubLoop : L->getSubLoops())
+    countLoops(SubLoop, nest + 1, R);
+}
+
+Error scanFile(MemoryBufferRef Buffer, ScanResult &R) {
+  static Regex Filter(NameFilter);
+  LLVMContext Context;
+  Expected<std::unique_ptr<Module>> M = getLazyBitcodeModule(Buffer, Context);
+  if (!M)
+    return M.takeError();
+
+  for (Function &F : **M) {
+    if (F.isDeclaration())
+      continue;
+    if (!NameFilter.empty() && !Filter.match(F.getName()))
+      continue;
+    if (Error E = F.materialize())
+      return E;
+
+    unsigned Size = F.getInstructionCount();
+    if (Size >= MinInsts && Size <= MaxInsts) {
+      R.Functions++;
+      for (BasicBlock &BB : F) {
+        for (Instruction &I : BB)
+          R.Opcodes[I.getOpcodeName()] += 1;
+      }
+      DominatorTree DT(F);
+      LoopInfo LI(DT);
+      for (Loop *L : LI)
+        countLoops(L, 0, R);
+    }
+    F.deleteBody();
+  }
+  return Error::success();
+}
+
+// The key covers the file content and every option that changes results.
+std::string cacheKey(StringRef Content) {
+  std::string Options = NameFilter + "\n" + utostr(MinInsts) + "\n" +
+                        utostr(MaxInsts);
+  return utohexstr(xxHash64(Content)) + "-" + utohexstr(xxHash64(Options));
+}
+
+std::string cachePath(StringRef Key) {
+  SmallString<128> Path(CacheDir);
+  sys::path::append(Path, Key);
+  return Path.str().str();
+}
+
+bool readCache(StringRef Path, ScanResult &R) {
+  ErrorOr<std::unique_ptr<MemoryBuffer>> Buf = MemoryBuffer::getFile(Path);
+  if (!Buf)
+    return false;
+  for (line_iterator Line(**Buf); !Line.is_at_end(); ++Line) {
+    SmallVector<StringRef, 3> Fields;
+    Line->split(Fields, ' ');
+    unsigned Level = 0;
+    uint64_t Count = 0;
+    if (Fields.size() == 2 && Fields[0] == "functions")
+      Fields[1].getAsInteger(10, R.Functions);
+    else if (Fields.size() == 3 && !Fields[2].getAsInteger(10, Count)) {
+      if (Fields[0] == "op")
+        R.Opcodes[Fields[1].str()] = Count;
+      else if (Fields[0] == "loop" && !Fields[1].getAsInteger(10, Level))
+        R.Loops[Level] = Count;
+    }
+  }
+  return true;
+}
+
+// written to a temporary file and renamed, so a reader never sees a
+// partial entry
+void writeCache(StringRef Path, const ScanResult &R) {
+  std::string Tmp = (Path + ".tmp." + utostr(getpid())).str();
+  std::error_code EC;
+  raw_fd_ostream OS(Tmp, EC, sys::fs::OF_Text);
+  if (EC)
+    return;
+  OS << "functions " << R.Functions << "\n";
+  for (auto &Op : R.Opcodes)
+    OS << "op " << Op.first << " " << Op.second << "\n";
+  for (auto &L : R.Loops)
+    OS << "loop " << L.first << " " << L.second << "\n";
+  OS.close();
+  sys::fs::rename(Tmp, Path);
+}
+
+struct InputFile {
+  std::string Name;
+  std::string Key;
+};
+
+// Scan the files of this worker that are not cached yet. Returns the
+// number of files that failed.
+unsigned runWorker(std::vector<InputFile> &Files, unsigned Worker) {
+  unsigned Failed = 0;
+  for (unsigned idx = Worker; idx < Files.size(); idx += NumJobs) {
+    std::string Path = cachePath(Files[idx].Key);
+    if (sys::fs::exists(Path))
+      continue;
+
+    ErrorOr<std::unique_ptr<MemoryBuffer>> Buf =
+        MemoryBuffer::getFile(Files[idx].Name);
+    ScanResult R;
+    Error E = Buf ? scanFile((*Buf)->getMemBufferRef(), R)
+                  : errorCodeToError(Buf.getError());
+    if (E) {
+      logAllUnhandledErrors(std::move(E), errs(), Files[idx].Name + ": ");
+      Failed++;
+      continue;
+    }
+    writeCache(Path, R);
+  }
+  return Failed;
+}
+
+void collectInputs(StringRef Input, std::vector<InputFile> &Files) {
+  if (!sys::fs::is_directory(Input)) {
+    Files.push_back({Input.str(), ""});
+    return;
+  }
+  std::error_code EC;
+  for (sys::fs::recursive_directory_iterator I(Input, EC), E;
+       I != E && !EC; I.increment(EC)) {
+    if (sys::path::extension(I->path()) == ".bc")
+      Files.push_back({I->path(), ""});
+  }
+}
+}
+
+int main(int argc, char **argv) {
+  cl::ParseCommandLineOptions(argc, argv, "bitcode corpus scanner\n");
+
+  std::string RegexError;
+  if (!NameFilter.empty() && !Regex(NameFilter).isValid(RegexError)) {
+    errs() << argv[0] << ": bad -name regex: " << RegexError << "\n";
+    return 1;
+  }
+  if (std::error_code EC = sys::fs::create_directories(CacheDir)) {
+    errs() << argv[0] << ": " << CacheDir << ": " << EC.message() << "\n";
+    return 1;
+  }
+  if (NumJobs == 0)
+    NumJobs = 1;
+
+  std::vector<InputFile> Files;
+  for (const std::string &Input : Inputs)
+    collectInputs(Input, Files);
+
+  // hashing maps the file, which is cheap next to parsing it. A file that
+  // can not be read has no key and is dropped, but counts as failed.
+  unsigned Cached = 0, Unreadable = 0;
+  for (InputFile &File : Files) {
+    ErrorOr<std::unique_ptr<MemoryBuffer>> Buf =
+        MemoryBuffer::getFile(File.Name);
+    if (!Buf) {
+      errs() << File.Name << ": " << Buf.getError().message() << "\n";
+      Unreadable++;
+      continue;
+    }
+    File.Key = cacheKey((*Buf)->getBuffer());
+    if (sys::fs::exists(cachePath(File.Key)))
+      Cached++;
+  }
+  Files.erase(std::remove_if(Files.begin(), Files.end(),
+                             [](const InputFile &F) { return F.Key.empty(); }),
+              Files.end());
+
+  if (NumJobs == 1) {
+    runWorker(Files, 0);
+  } else {
+    std::vector<pid_t> Workers;
+    for (unsigned Worker = 0; Worker < NumJobs; Worker++) {
+      pid_t Pid = fork();
+      if (Pid == 0)
+        _exit(runWorker(Files, Worker) ? 1 : 0);
+      if (Pid < 0) {
+        errs() << argv[0] << ": fork failed\n";
+        return 1;
+      }
+      Workers.push_back(Pid);
+    }
+    for (pid_t Pid : Workers) {
+      int Status = 0;
+      waitpid(Pid, &Status, 0);
+    }
+  }
+
+  ScanResult Total;
+  unsigned Scanned = 0;
+  for (InputFile &File : Files) {
+    ScanResult R;
+    if (readCache(cachePath(File.Key), R)) {
+      Total.merge(R);
+      Scanned++;
+    }
+  }
+  // a file that failed, in this process or in a worker, has no cache entry
+  unsigned Failed = Unreadable + Files.size() - Scanned;
+
+  outs() << "files: " << Scanned << " (" << Cached << " cached)";
+  if (Failed)
+    outs() << ", " << Failed << " failed";
+  outs() << "\nfunctions: " << Total.Functions << "\n\nopcodes:\n";
+  for (auto &Op : Total.Opcodes)
+    outs() << format("  %-16s %12llu\n", Op.first.c_str(),
+                     (unsigned long long)Op.second);
+  outs() << "\nloops:\n";
+  for (auto &L : Total.Loops)
+    outs() << "  level " << L.first << ": " << L.second << "\n";
+  return Failed ? 1 : 0;
+}
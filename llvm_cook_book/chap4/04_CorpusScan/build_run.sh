@@ -0,0 +1,9 @@
+mkdir -p ./build
+cd ./build
+rm -rf *
+cmake ../
+make
+cd ../
+./build/CorpusScan -j 4 -cache-dir=./build/cache ../01_InstCount/exam_00.bc
+# the second run is served from the cache
+./build/CorpusScan -j 4 -cache-dir=./build/cache ../01_InstCount/exam_00.bc
@@ -0,0 +1,139 @@
+// Count the opcodes a module executes, not only the ones it contains like
+// -oc of InstCount.
+//
+// Each basic block gets a 64 bit counter, incremented at its first
+// insertion point, and the module gets a table with the opcode histogram
+// of every block. The runtime in DynOpCountRT.c multiplies the two at
+// exit. One increment per block keeps the overhead low, at the price of
+// counting a whole block when it is left early, by exit() or an unwinding
+// call. The counters are not atomic, so threads may lose increments.
+#define DEBUG_TYPE "dynOpcodeCounter"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Pass.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+#include <map>
+#include <string>
+#include <vector>
+
+using namespace llvm;
+
+namespace {
+struct DynCountOpcode : public ModulePass {
+  static char ID;
+
+  DynCountOpcode() : ModulePass(ID) {}
+
+  bool runOnModule(Module &M) override {
+    std::vector<BasicBlock *> Blocks;
+    for (Function &F : M) {
+      if (F.isDeclaration())
+        continue;
+      for (BasicBlock &BB : F)
+        Blocks.push_back(&BB);
+    }
+    if (Blocks.empty())
+      return false;
+
+    // histograms first, so they do not see the counter updates
+    std::map<unsigned, unsigned> OpcodeIdx;
+    std::string Names;
+    std::vector<uint32_t> Entries;
+    for (unsigned idx = 0; idx < Blocks.size(); idx++) {
+      std::map<unsigned, unsigned> Hist;
+      for (Instruction &I : *Blocks[idx])
+        Hist[I.getOpcode()] += 1;
+      for (auto &H : Hist) {
+        auto It = OpcodeIdx.insert(std::make_pair(H.first, OpcodeIdx.size()));
+        if (It.second) {
+          Names += Instruction::getOpcodeName(H.first);
+          Names += '\0';
+        }
+        Entries.push_back(idx);
+        Entries.push_back(It.first->second);
+        Entries.push_back(H.second);
+      }
+    }
+
+    LLVMContext &C = M.getContext();
+    Type *Int32Ty = Type::getInt32Ty(C);
+    Type *Int64Ty = Type::getInt64Ty(C);
+    ArrayType *CountersTy = ArrayType::get(Int64Ty, Blocks.size());
+    GlobalVariable *Counters = new GlobalVariable(
+        M, CountersTy, false, GlobalValue::InternalLinkage,
+        ConstantAggregateZero::get(CountersTy), "__dynoc_counters");
+
+    for (unsigned idx = 0; idx < Blocks.size(); idx++) {
+      // a catchswitch block has no place for the increment and stays 0
+      BasicBlock::iterator IP = Blocks[idx]->getFirstInsertionPt();
+      if (IP == Blocks[idx]->end())
+        continue;
+      IRBuilder<> Builder(&*IP);
+      Value *Ptr = Builder.CreateConstInBoundsGEP2_64(CountersTy, Counters,
+                                                      0, idx);
+      Value *Count = Builder.CreateLoad(Int64Ty, Ptr, "dynoc");
+      Builder.CreateStore(Builder.CreateAdd(Count, Builder.getInt64(1)), Ptr);
+    }
+
+    Constant *EntriesInit = ConstantDataArray::get(C, Entries);
+    GlobalVariable *EntriesGV = new GlobalVariable(
+        M, EntriesInit->getType(), true, GlobalValue::InternalLinkage,
+        EntriesInit, "__dynoc_entries");
+    GlobalVariable *NamesGV = makeString(M, Names, "__dynoc_names");
+    GlobalVariable *ModuleGV =
+        makeString(M, M.getModuleIdentifier(), "__dynoc_module");
+
+    // struct dynoc_module of DynOpCount.h
+    Type *Int8PtrTy = Type::getInt8PtrTy(C);
+    StructType *DescTy = StructType::get(
+        C, {Int32Ty, Int32Ty, Int32Ty, Int64Ty->getPointerTo(),
+            Int32Ty->getPointerTo(), Int8PtrTy, Int8PtrTy});
+    Constant *Desc = ConstantStruct::get(
+        DescTy, {ConstantInt::get(Int32Ty, Blocks.size()),
+                 ConstantInt::get(Int32Ty, Entries.size() / 3),
+                 ConstantInt::get(Int32Ty, OpcodeIdx.size()),
+                 firstElement(Counters), firstElement(EntriesGV),
+                 firstElement(NamesGV), firstElement(ModuleGV)});
+    GlobalVariable *DescGV = new GlobalVariable(
+        M, DescTy, false, GlobalValue::InternalLinkage, Desc, "__dynoc_desc");
+
+    FunctionType *RegisterTy =
+        FunctionType::get(Type::getVoidTy(C), {DescTy->getPointerTo()}, false);
+    FunctionCallee Register =
+        M.getOrInsertFunction("__dynoc_register", RegisterTy);
+    Function *Ctor = Function::Create(
+        FunctionType::get(Type::getVoidTy(C), false),
+        GlobalValue::InternalLinkage, "__dynoc_init", &M);
+    IRBuilder<> Builder(BasicBlock::Create(C, "entry", Ctor));
+    Builder.CreateCall(Register, {DescGV});
+    Builder.CreateRetVoid();
+    appendToGlobalCtors(M, Ctor, 0);
+    return true;
+  }
+
+private:
+  static GlobalVariable *makeString(Module &M, StringRef Str,
+                                    const Twine &Name) {
+    Constant *Init = ConstantDataArray::getString(M.getContext(), Str);
+    return new GlobalVariable(M, Init->getType(), true,
+                              GlobalValue::PrivateLinkage, Init, Name);
+  }
+
+  static Constant *firstElement(GlobalVariable *GV) {
+    Constant *Zero = ConstantInt::get(Type::getInt32Ty(GV->getContext()), 0);
+    Constant *Idx[] = {Zero, Zero};
+    return ConstantExpr::getInBoundsGetElementPtr(GV->getValueType(), GV,
+                                                  Idx);
+  }
+};
+}
+
+char DynCountOpcode::ID = 0;
+static RegisterPass<DynCountOpcode> X("dyn-oc",
+                                      "count the executed opcodes",
+                                      false /* Only looks at CFG */,
+                                      false /* Analysis Pass */);
@@ -0,0 +1,29 @@
+// Interface between the -dyn-oc pass and its runtime, DynOpCountRT.c.
+//
+// Every instrumented module registers one dynoc_module from a global
+// constructor. counters has one entry per basic block, bumped each time
+// the block runs; entries holds num_entries (block, opcode, count)
+// triples, the static opcode histogram of each block, where opcode
+// indexes the num_opcodes NUL terminated names in names. At exit the
+// runtime adds counters[block] * count to the total of each opcode.
+#ifndef DYNOPCOUNT_H_
+#define DYNOPCOUNT_H_
+
+#include <stdint.h>
+
+struct dynoc_module {
+  uint32_t num_blocks;
+  uint32_t num_entries;
+  uint32_t num_opcodes;
+  uint64_t *counters;
+  const uint32_t *entries;
+  const char *names;
+  const char *module;
+};
+
+#ifdef __cplusplus
+extern "C"
+#endif
+void __dynoc_register(struct dynoc_module *m);
+
+#endif
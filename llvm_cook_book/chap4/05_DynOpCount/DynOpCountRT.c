@@ -0,0 +1,88 @@
+// Runtime of the -dyn-oc pass: collects the modules registered by their
+// constructors and prints the executed opcodes of all of them at exit,
+// next to how often each opcode occurs in the code. The report goes to
+// stderr, or to the file named by DYNOC_OUTPUT.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "DynOpCount.h"
+
+struct opcode_total {
+  const char *name;
+  unsigned long long static_count;
+  unsigned long long dynamic_count;
+};
+
+static struct dynoc_module **modules;
+static unsigned num_modules;
+
+static int by_dynamic_count(const void *a, const void *b) {
+  const struct opcode_total *x = a, *y = b;
+  if (x->dynamic_count != y->dynamic_count)
+    return x->dynamic_count < y->dynamic_count ? 1 : -1;
+  return strcmp(x->name, y->name);
+}
+
+static void dynoc_report(void) {
+  // every module names its opcodes itself, so they are merged by name
+  struct opcode_total *totals = NULL;
+  unsigned num_totals = 0;
+  unsigned long long all_static = 0, all_dynamic = 0;
+  for (unsigned m = 0; m < num_modules; m++) {
+    const struct dynoc_module *mod = modules[m];
+    unsigned *map = malloc(mod->num_opcodes * sizeof(unsigned));
+    const char *name = mod->names;
+    for (unsigned op = 0; op < mod->num_opcodes; op++) {
+      unsigned idx = 0;
+      while (idx < num_totals && strcmp(totals[idx].name, name) != 0)
+        idx++;
+      if (idx == num_totals) {
+        totals = realloc(totals, (num_totals + 1) * sizeof(*totals));
+        totals[idx].name = name;
+        totals[idx].static_count = 0;
+        totals[idx].dynamic_count = 0;
+        num_totals++;
+      }
+      map[op] = idx;
+      name += strlen(name) + 1;
+    }
+    for (unsigned e = 0; e < mod->num_entries; e++) {
+      const uint32_t *entry = mod->entries + 3 * e;
+      struct opcode_total *t = &totals[map[entry[1]]];
+      t->static_count += entry[2];
+      t->dynamic_count += mod->counters[entry[0]] * entry[2];
+      all_static += entry[2];
+      all_dynamic += mod->counters[entry[0]] * entry[2];
+    }
+    free(map);
+  }
+  qsort(totals, num_totals, sizeof(*totals), by_dynamic_count);
+
+  FILE *out = stderr;
+  const char *path = getenv("DYNOC_OUTPUT");
+  if (path && !(out = fopen(path, "w"))) {
+    perror(path);
+    out = stderr;
+  }
+  fprintf(out, "executed opcodes of");
+  for (unsigned m = 0; m < num_modules; m++)
+    fprintf(out, " %s", modules[m]->module);
+  fprintf(out, "\n%-16s %12s %16s %7s\n", "opcode", "static", "dynamic",
+          "%");
+  for (unsigned idx = 0; idx < num_totals; idx++)
+    fprintf(out, "%-16s %12llu %16llu %6.2f%%\n", totals[idx].name,
+            totals[idx].static_count, totals[idx].dynamic_count,
+            all_dynamic ? 100.0 * totals[idx].dynamic_count / all_dynamic
+                        : 0.0);
+  fprintf(out, "%-16s %12llu %16llu\n", "total", all_static, all_dynamic);
+  if (out != stderr)
+    fclose(out);
+  free(totals);
+}
+
+void __dynoc_register(struct dynoc_module *m) {
+  if (num_modules == 0)
+    atexit(dynoc_report);
+  modules = realloc(modules, (num_modules + 1) * sizeof(*modules));
+  modules[num_modules++] = m;
+}
@@ -0,0 +1,10 @@
+mkdir -p ./build
+cd ./build
+rm -rf *
+cmake ../
+make
+cd ../
+clang -O2 -emit-llvm -c ../01_InstCount/exam_00.c -o ./build/exam_00.bc
+opt -enable-new-pm=0 -load ./build/libDynOpCount.so -dyn-oc ./build/exam_00.bc -o ./build/exam_00.dynoc.bc
+clang ./build/exam_00.dynoc.bc exam_main.c ./build/libDynOpCountRT.a -o ./build/exam_00
+./build/exam_00
@@ -0,0 +1,8 @@
+#include <stdio.h>
+
+int func(int a, int b);
+
+int main() {
+  printf("%d\n", func(1000, 1000));
+  return 0;
+}
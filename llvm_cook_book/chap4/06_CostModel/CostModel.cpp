@@ -0,0 +1,220 @@
+// Static cost report: the estimated cycles of every function and loop,
+// from the reciprocal throughput and the latency TargetTransformInfo gives
+// each instruction, and the functions ranked by their share at the end.
+//
+// Costs are weighted by how often a block runs, either by its block
+// frequency relative to the entry (-cost-weight=freq, the default) or by
+// -cost-trip-count to the power of its loop depth (-cost-weight=depth).
+// Integer divides, vector loads and stores below their natural alignment,
+// gathers and scatters, and anything at or above -cost-expensive are
+// listed with their weighted cost. The costs are those of the target
+// machine of opt, so run it with -mcpu=native for the host CPU.
+#define DEBUG_TYPE "costModel"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/DebugInfoMetadata.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Pass.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <string>
+#include <vector>
+
+using namespace llvm;
+
+enum CostWeight { weight_freq, weight_depth };
+
+static cl::opt<CostWeight> Weight("cost-weight", cl::init(weight_freq),
+    cl::desc("how often a block is assumed to run"),
+    cl::values(clEnumValN(weight_freq, "freq",
+                          "block frequency relative to the entry"),
+               clEnumValN(weight_depth, "depth",
+                          "cost-trip-count ^ loop depth")));
+static cl::opt<unsigned> TripCount("cost-trip-count", cl::init(16),
+    cl::desc("iterations per loop level for -cost-weight=depth"));
+static cl::opt<unsigned> ExpensiveCost("cost-expensive", cl::init(8),
+    cl::desc("list instructions with at least this throughput cost"));
+
+namespace {
+struct Cost {
+  double Throughput = 0;
+  double Latency = 0;
+
+  void add(const Cost &C, double W) {
+    Throughput += C.Throughput * W;
+    Latency += C.Latency * W;
+  }
+};
+
+struct Expensive {
+  const Instruction *I;
+  const char *Why;
+  Cost C;
+  double W;
+};
+
+struct CostReport : public FunctionPass {
+  static char ID;
+  std::vector<std::pair<std::string, Cost>> Functions;
+
+  CostReport() : FunctionPass(ID) {}
+
+  bool runOnFunction(Function &F) override {
+    const TargetTransformInfo &TTI =
+        getAnalysis<TargetTransformInfoWrapperPass>().getTTI(F);
+    LoopInfo &LI = getAnalysis<LoopInfoWrapperPass>().getLoopInfo();
+    BlockFrequencyInfo &BFI =
+        getAnalysis<BlockFrequencyInfoWrapperPass>().getBFI();
+    const DataLayout &DL = F.getParent()->getDataLayout();
+    double EntryFreq = BFI.getEntryFreq();
+
+    // weighted cost of each block
+    Cost Total;
+    std::map<const BasicBlock *, Cost> Blocks;
+    std::vector<Expensive> List;
+    for (BasicBlock &BB : F) {
+      double W = Weight == weight_freq
+                     ? BFI.getBlockFreq(&BB).getFrequency() / EntryFreq
+                     : std::pow((double)TripCount, LI.getLoopDepth(&BB));
+      Cost &BC = Blocks[&BB];
+      for (Instruction &I : BB) {
+        Cost C;
+        C.Throughput =
+            costOf(TTI, I, TargetTransformInfo::TCK_RecipThroughput);
+        C.Latency = costOf(TTI, I, TargetTransformInfo::TCK_Latency);
+        BC.add(C, W);
+        if (const char *Why = whyExpensive(I, C, DL))
+          List.push_back({&I, Why, C, W});
+      }
+      Total.add(BC, 1);
+    }
+    Functions.push_back(std::make_pair(F.getName().str(), Total));
+
+    outs() << "Function: " << F.getName() << printCost(Total) << "\n";
+    for (Loop *L : LI)
+      printLoop(L, 0, Blocks);
+    std::stable_sort(List.begin(), List.end(),
+                     [](const Expensive &A, const Expensive &B) {
+                       return A.C.Throughput * A.W > B.C.Throughput * B.W;
+                     });
+    for (const Expensive &E : List) {
+      outs() << "  " << E.Why << ":" << *E.I;
+      if (const DebugLoc &DLoc = E.I->getDebugLoc())
+        outs() << " (line " << DLoc.getLine() << ")";
+      outs() << "\n    throughput " << format("%.0f", E.C.Throughput)
+             << ", latency " << format("%.0f", E.C.Latency) << ", runs "
+             << format("%.1f", E.W) << " times per call\n";
+    }
+    return false;
+  }
+
+  bool doFinalization(Module &M) override {
+    if (Functions.empty())
+      return false;
+    std::stable_sort(Functions.begin(), Functions.end(),
+                     [](const std::pair<std::string, Cost> &A,
+                        const std::pair<std::string, Cost> &B) {
+                       return A.second.Throughput > B.second.Throughput;
+                     });
+    double Sum = 0;
+    for (auto &F : Functions)
+      Sum += F.second.Throughput;
+    outs() << "\nFunctions by estimated cycles per call:\n";
+    for (auto &F : Functions)
+      outs() << format("  %12.1f %6.2f%%  ", F.second.Throughput,
+                       Sum > 0 ? 100 * F.second.Throughput / Sum : 0.0)
+             << F.first << "\n";
+    Functions.clear();
+    return false;
+  }
+
+  void getAnalysisUsage(AnalysisUsage &AU) const override {
+    AU.addRequired<TargetTransformInfoWrapperPass>();
+    AU.addRequired<LoopInfoWrapperPass>();
+    AU.addRequired<BlockFrequencyInfoWrapperPass>();
+    AU.setPreservesAll();
+  }
+
+private:
+  static double costOf(const TargetTransformInfo &TTI, const Instruction &I,
+                       TargetTransformInfo::TargetCostKind Kind) {
+    InstructionCost C = TTI.getInstructionCost(&I, Kind);
+    if (!C.isValid())
+      return 0;
+    return *C.getValue();
+  }
+
+  static const char *whyExpensive(const Instruction &I, const Cost &C,
+                                  const DataLayout &DL) {
+    switch (I.getOpcode()) {
+    case Instruction::UDiv:
+    case Instruction::SDiv:
+    case Instruction::URem:
+    case Instruction::SRem:
+      // a constant divisor becomes a multiply
+      if (!isa<Constant>(I.getOperand(1)))
+        return "integer divide";
+      break;
+    case Instruction::Load:
+    case Instruction::Store: {
+      Type *Ty = isa<LoadInst>(I) ? I.getType()
+                                  : I.getOperand(0)->getType();
+      Align A = isa<LoadInst>(I) ? cast<LoadInst>(I).getAlign()
+                                 : cast<StoreInst>(I).getAlign();
+      if (Ty->isVectorTy() && A < DL.getABITypeAlign(Ty))
+        return "unaligned vector access";
+      break;
+    }
+    default:
+      break;
+    }
+    if (const IntrinsicInst *II = dyn_cast<IntrinsicInst>(&I)) {
+      if (II->getIntrinsicID() == Intrinsic::masked_gather)
+        return "gather";
+      if (II->getIntrinsicID() == Intrinsic::masked_scatter)
+        return "scatter";
+    }
+    if (C.Throughput >= ExpensiveCost)
+      return "expensive";
+    return nullptr;
+  }
+
+  static std::string printCost(const Cost &C) {
+    std::string S;
+    raw_string_ostream OS(S);
+    OS << ": throughput " << format("%.1f", C.Throughput) << ", latency "
+       << format("%.1f", C.Latency);
+    return OS.str();
+  }
+
+  // the cost of a loop per call of the function, subloops included
+  void printLoop(Loop *L, unsigned nest,
+                 std::map<const BasicBlock *, Cost> &Blocks) {
+    Cost LC;
+    for (BasicBlock *BB : L->blocks())
+      LC.add(Blocks[BB], 1);
+    for (unsigned idx = 0; idx < nest * 2; idx++)
+      outs() << " ";
+    outs() << "  Loop level " << nest << " at ";
+    L->getHeader()->printAsOperand(outs(), false);
+    outs() << printCost(LC) << "\n";
+    for (Loop *SubLoop : L->getSubLoops())
+      printLoop(SubLoop, nest + 1, Blocks);
+  }
+};
+}
+
+char CostReport::ID = 0;
+static RegisterPass<CostReport> X("cost", "estimate the cycles of functions "
+                                  "and loops",
+                                  false /* Only looks at CFG */,
+                                  true /* Analysis Pass */);
@@ -0,0 +1,9 @@
+mkdir -p ./build
+cd ./build
+rm -rf *
+cmake ../
+make
+cd ../
+# the pass is a legacy one; the costs are those of the host CPU
+opt -enable-new-pm=0 -mcpu=native -load ./build/libCostModel.so -cost ../01_InstCount/exam_00.bc -disable-output
+opt -enable-new-pm=0 -mcpu=native -load ./build/libCostModel.so -cost -cost-weight=depth ../00_FunCount/exam_00.ll -disable-output
@@ -0,0 +1,209 @@
+// Classify the loads and stores of every loop by how their address moves
+// from one iteration to the next, using ScalarEvolution:
+//
+// - invariant: the same address every iteration
+// - unit: consecutive elements, forwards or backwards
+// - strided: a constant stride larger than the element
+// - indirect: the address depends on a value loaded in the loop, a gather
+// - unknown: anything else, e.g. a stride only known at run time
+//
+// Each access is reported at its innermost loop. Per iteration a loop
+// reads and writes the bytes of its accesses, and brings in an estimated
+// number of cache lines: a unit access shares a line with its neighbours,
+// a strided one of at least a line, an indirect or an unknown one needs a
+// line of its own. An access to the address of an earlier one, like the
+// load and the store of a[i] += x, adds neither, and one within a line of
+// an earlier one that moves the same way, like a[2*i + 1] next to a[2*i],
+// adds its bytes but no lines. Strided, indirect and unknown accesses are
+// the usual reasons for cache misses and for loops that do not vectorize.
+#define DEBUG_TYPE "memAccess"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/ScalarEvolutionExpressions.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Pass.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
+#include <vector>
+
+using namespace llvm;
+
+static cl::opt<unsigned> LineSize("mem-line-size", cl::init(64),
+    cl::desc("cache line size in bytes"));
+static cl::opt<bool> ListAccesses("mem-list", cl::init(false),
+    cl::desc("print every access with its class"));
+
+namespace {
+enum AccessClass {
+  access_invariant,
+  access_unit,
+  access_strided,
+  access_indirect,
+  access_unknown,
+  num_access_classes
+};
+
+const char *ClassNames[num_access_classes] = {
+    "invariant", "unit", "strided", "indirect", "unknown"};
+
+struct Access {
+  Instruction *I;
+  const SCEV *Ptr;
+  AccessClass Class;
+  uint64_t Size;
+  // in bytes, for unit and strided accesses
+  int64_t Stride;
+};
+
+struct MemAccess : public FunctionPass {
+  static char ID;
+
+  MemAccess() : FunctionPass(ID) {}
+
+  bool runOnFunction(Function &F) override {
+    LoopInfo &LI = getAnalysis<LoopInfoWrapperPass>().getLoopInfo();
+    ScalarEvolution &SE = getAnalysis<ScalarEvolutionWrapperPass>().getSE();
+    if (LI.empty())
+      return false;
+    outs() << "Function: " << F.getName() << "\n";
+    for (Loop *L : LI)
+      reportLoop(L, 0, LI, SE, F.getParent()->getDataLayout());
+    return false;
+  }
+
+  void getAnalysisUsage(AnalysisUsage &AU) const override {
+    AU.addRequired<LoopInfoWrapperPass>();
+    AU.addRequired<ScalarEvolutionWrapperPass>();
+    AU.setPreservesAll();
+  }
+
+private:
+  static Access classify(Instruction &I, Loop *L, ScalarEvolution &SE,
+                         const DataLayout &DL) {
+    Value *Ptr = getLoadStorePointerOperand(&I);
+    Type *Ty = isa<LoadInst>(I) ? I.getType() : I.getOperand(0)->getType();
+    const SCEV *S = SE.getSCEV(Ptr);
+    Access A = {&I, S, access_unknown, DL.getTypeStoreSize(Ty), 0};
+
+    if (SE.isLoopInvariant(S, L)) {
+      A.Class = access_invariant;
+      return A;
+    }
+    // an address computed from a load of this loop is an indirection
+    bool Indirect = SCEVExprContains(S, [L](const SCEV *X) {
+      const SCEVUnknown *U = dyn_cast<SCEVUnknown>(X);
+      Instruction *Def = U ? dyn_cast<Instruction>(U->getValue()) : nullptr;
+      return Def && isa<LoadInst>(Def) && L->contains(Def);
+    });
+    if (Indirect) {
+      A.Class = access_indirect;
+      return A;
+    }
+    const SCEVAddRecExpr *AR = dyn_cast<SCEVAddRecExpr>(S);
+    if (!AR || AR->getLoop() != L || !AR->isAffine())
+      return A;
+    const SCEVConstant *Step =
+        dyn_cast<SCEVConstant>(AR->getStepRecurrence(SE));
+    if (!Step)
+      return A;
+    A.Stride = Step->getAPInt().getSExtValue();
+    uint64_t Abs = A.Stride < 0 ? -(uint64_t)A.Stride : A.Stride;
+    A.Class = Abs <= A.Size ? access_unit : access_strided;
+    return A;
+  }
+
+  // cache lines an access brings in per iteration
+  static double linesPerIteration(const Access &A) {
+    switch (A.Class) {
+    case access_invariant:
+      return 0;
+    case access_unit:
+      return (double)A.Size / LineSize;
+    case access_strided: {
+      uint64_t Abs = A.Stride < 0 ? -(uint64_t)A.Stride : A.Stride;
+      return std::min(1.0, (double)Abs / LineSize);
+    }
+    default:
+      return 1;
+    }
+  }
+
+  void reportLoop(Loop *L, unsigned nest, LoopInfo &LI, ScalarEvolution &SE,
+                  const DataLayout &DL) {
+    std::vector<Access> Accesses;
+    for (BasicBlock *BB : L->blocks()) {
+      if (LI.getLoopFor(BB) != L)
+        continue;
+      for (Instruction &I : *BB) {
+        if (isa<LoadInst>(I) || isa<StoreInst>(I))
+          Accesses.push_back(classify(I, L, SE, DL));
+      }
+    }
+
+    unsigned Counts[num_access_classes] = {};
+    uint64_t Bytes = 0;
+    double Lines = 0;
+    std::vector<const Access *> Counted;
+    for (const Access &A : Accesses) {
+      Counts[A.Class]++;
+      if (A.Class == access_invariant)
+        continue;
+      bool SameAddress = false, SameLines = false;
+      for (const Access *B : Counted) {
+        if (B->Class != A.Class || B->Stride != A.Stride)
+          continue;
+        // pointers with different bases have no constant distance
+        const SCEVConstant *Dist =
+            dyn_cast<SCEVConstant>(SE.getMinusSCEV(A.Ptr, B->Ptr));
+        if (!Dist)
+          continue;
+        int64_t Off = Dist->getAPInt().getSExtValue();
+        uint64_t Abs = Off < 0 ? -(uint64_t)Off : Off;
+        SameAddress |= Off == 0 && A.Size <= B->Size;
+        SameLines |= Abs < LineSize;
+      }
+      if (SameAddress)
+        continue;
+      Bytes += A.Size;
+      if (!SameLines)
+        Lines += linesPerIteration(A);
+      Counted.push_back(&A);
+    }
+
+    std::string Indent(nest * 2 + 2, ' ');
+    outs() << Indent << "Loop level " << nest << " at ";
+    L->getHeader()->printAsOperand(outs(), false);
+    if (unsigned Trips = SE.getSmallConstantTripCount(L))
+      outs() << ", " << Trips << " iterations";
+    outs() << ": " << Accesses.size() << " accesses";
+    for (unsigned idx = 0; idx < num_access_classes; idx++) {
+      if (Counts[idx])
+        outs() << ", " << Counts[idx] << " " << ClassNames[idx];
+    }
+    outs() << "\n" << Indent << "  per iteration: " << Bytes << " bytes, "
+           << format("%.2f", Lines) << " cache lines ("
+           << format("%.0f", Lines * LineSize) << " bytes)\n";
+    if (ListAccesses) {
+      for (const Access &A : Accesses) {
+        outs() << Indent << "  " << ClassNames[A.Class];
+        if (A.Class == access_unit || A.Class == access_strided)
+          outs() << " " << A.Stride;
+        outs() << ":" << *A.I << "\n";
+      }
+    }
+    for (Loop *SubLoop : L->getSubLoops())
+      reportLoop(SubLoop, nest + 1, LI, SE, DL);
+  }
+};
+}
+
+char MemAccess::ID = 0;
+static RegisterPass<MemAccess> X("mem-access", "classify the memory accesses "
+                                 "of loops",
+                                 false /* Only looks at CFG */,
+                                 true /* Analysis Pass */);
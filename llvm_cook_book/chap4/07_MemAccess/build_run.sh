@@ -0,0 +1,11 @@
+mkdir -p ./build
+cd ./build
+rm -rf *
+cmake ../
+make
+cd ../
+# the input is written by hand in SSA form: clang -O0 marks its functions
+# optnone and keeps the indices in allocas, so every access would look
+# invariant
+opt -enable-new-pm=0 -load ./build/libMemAccess.so -mem-access -mem-list exam_mem.ll -disable-output
+opt -enable-new-pm=0 -load ./build/libMemAccess.so -mem-access -mem-line-size=32 exam_mem.ll -disable-output
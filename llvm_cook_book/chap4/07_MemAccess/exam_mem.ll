@@ -0,0 +1,63 @@
+; The loops below in SSA form, as mem2reg leaves them: the induction
+; variables are registers, so only the array accesses remain.
+;
+;   for (i = 0; i < n; i++) a[i] = b[i] + *m;        unit, unit, invariant
+;   for (i = 0; i < n; i++) a[8 * i] += 1.0;         strided
+;   for (i = 0; i < n; i++) a[idx[i]] = b[i];        unit, indirect
+;   for (i = 0; i < n; i++) a[s * i] = 0.0;          unknown
+source_filename = "exam_mem"
+target datalayout = "e-m:e-p270:32:32-p271:32:32-p272:64:64-i64:64-f80:128-n8:16:32:64-S128"
+
+define void @kernels(double* %a, double* %b, i32* %idx, double* %m, i64 %n, i64 %s) {
+entry:
+  %cmp = icmp sgt i64 %n, 0
+  br i1 %cmp, label %copy, label %exit
+
+copy:
+  %i0 = phi i64 [ 0, %entry ], [ %i0.next, %copy ]
+  %b.p = getelementptr inbounds double, double* %b, i64 %i0
+  %b.v = load double, double* %b.p, align 8
+  %m.v = load double, double* %m, align 8
+  %sum = fadd double %b.v, %m.v
+  %a.p = getelementptr inbounds double, double* %a, i64 %i0
+  store double %sum, double* %a.p, align 8
+  %i0.next = add nsw i64 %i0, 1
+  %c0 = icmp slt i64 %i0.next, %n
+  br i1 %c0, label %copy, label %stride
+
+stride:
+  %i1 = phi i64 [ 0, %copy ], [ %i1.next, %stride ]
+  %j1 = mul nsw i64 %i1, 8
+  %s.p = getelementptr inbounds double, double* %a, i64 %j1
+  %s.v = load double, double* %s.p, align 8
+  %inc = fadd double %s.v, 1.000000e+00
+  store double %inc, double* %s.p, align 8
+  %i1.next = add nsw i64 %i1, 1
+  %c1 = icmp slt i64 %i1.next, %n
+  br i1 %c1, label %stride, label %scatter
+
+scatter:
+  %i2 = phi i64 [ 0, %stride ], [ %i2.next, %scatter ]
+  %idx.p = getelementptr inbounds i32, i32* %idx, i64 %i2
+  %idx.v = load i32, i32* %idx.p, align 4
+  %k = sext i32 %idx.v to i64
+  %g.p = getelementptr inbounds double, double* %b, i64 %i2
+  %g.v = load double, double* %g.p, align 8
+  %d.p = getelementptr inbounds double, double* %a, i64 %k
+  store double %g.v, double* %d.p, align 8
+  %i2.next = add nsw i64 %i2, 1
+  %c2 = icmp slt i64 %i2.next, %n
+  br i1 %c2, label %scatter, label %unknown
+
+unknown:
+  %i3 = phi i64 [ 0, %scatter ], [ %i3.next, %unknown ]
+  %j3 = mul nsw i64 %i3, %s
+  %u.p = getelementptr inbounds double, double* %a, i64 %j3
+  store double 0.000000e+00, double* %u.p, align 8
+  %i3.next = add nsw i64 %i3, 1
+  %c3 = icmp slt i64 %i3.next, %n
+  br i1 %c3, label %unknown, label %exit
+
+exit:
+  ret void
+}
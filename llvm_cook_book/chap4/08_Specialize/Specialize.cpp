@@ -0,0 +1,283 @@
+// Specialize functions for the constant arguments of their call sites.
+//
+// For every direct call that passes constants, like foo(a, 4.0), the
+// callee is cloned without those parameters, the constants are folded
+// through the clone and its dead branches removed, and the clone is
+// priced with TargetTransformInfo, weighted by its block frequencies.
+// Candidates run at least -spec-min-freq times per call of their caller;
+// they are taken by saved cycles, call frequency times the difference of
+// the two prices, as long as the clones stay within the growth budget,
+// and the calls are redirected to them. Call sites with the same callee
+// and constants share one clone.
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/BranchProbabilityInfo.h"
+#include "llvm/Analysis/InstructionSimplify.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Pass.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/Local.h"
+#include <algorithm>
+#include <map>
+#include <vector>
+
+#define DEBUG_TYPE "specialize"
+
+using namespace llvm;
+
+static cl::opt<double> MinFreq("spec-min-freq", cl::init(1.0),
+    cl::desc("only specialize calls that run at least this often per call "
+             "of their caller"));
+static cl::opt<double> MinSpeedup("spec-min-speedup", cl::init(1.1),
+    cl::desc("only keep clones at least this much faster"));
+static cl::opt<unsigned> Growth("spec-growth", cl::init(20),
+    cl::desc("code growth budget, in percent of the module instructions"));
+static cl::opt<unsigned> MinGrowth("spec-min-growth", cl::init(100),
+    cl::desc("code growth budget of small modules, in instructions"));
+
+namespace {
+// the callee and the constant of each argument, null if not constant
+typedef std::pair<Function *, std::vector<Constant *>> SpecKey;
+
+struct Candidate {
+  CallInst *Call;
+  double Freq;
+  SpecKey Key;
+};
+
+struct Clone {
+  SpecKey Key;
+  Function *F = nullptr;
+  double Cost = 0;
+  double CalleeCost = 0;
+  unsigned Size = 0;
+  // call frequency of the sites that would use it
+  double Freq = 0;
+  std::vector<CallInst *> Calls;
+};
+
+struct Specialize : public ModulePass {
+  static char ID;
+
+  Specialize() : ModulePass(ID) {}
+
+  bool runOnModule(Module &M) override {
+    std::vector<Candidate> Candidates;
+    unsigned ModuleSize = 0;
+    for (Function &F : M) {
+      if (F.isDeclaration())
+        continue;
+      ModuleSize += F.getInstructionCount();
+      collectCandidates(F, Candidates);
+    }
+
+    std::map<SpecKey, Clone> Clones;
+    for (Candidate &C : Candidates) {
+      Clone &Cl = Clones[C.Key];
+      Cl.Key = C.Key;
+      Cl.Freq += C.Freq;
+      Cl.Calls.push_back(C.Call);
+    }
+
+    std::vector<Clone *> Order;
+    for (auto &Entry : Clones) {
+      Clone &Cl = Entry.second;
+      Function *Callee = Cl.Key.first;
+      ValueToValueMapTy VMap;
+      unsigned idx = 0;
+      for (Argument &Arg : Callee->args()) {
+        if (Constant *C = Cl.Key.second[idx++])
+          VMap[&Arg] = C;
+      }
+      Cl.F = CloneFunction(Callee, VMap);
+      Cl.F->setName(Callee->getName() + ".spec");
+      Cl.F->setLinkage(GlobalValue::InternalLinkage);
+      simplify(*Cl.F);
+      Cl.Cost = cost(*Cl.F);
+      Cl.CalleeCost = cost(*Callee);
+      Cl.Size = Cl.F->getInstructionCount();
+      Order.push_back(&Cl);
+    }
+    std::stable_sort(Order.begin(), Order.end(),
+                     [](const Clone *A, const Clone *B) {
+                       return saved(*A) > saved(*B);
+                     });
+
+    unsigned Budget = std::max<unsigned>(ModuleSize * Growth / 100,
+                                         MinGrowth);
+    bool Changed = false;
+    for (Clone *Cl : Order) {
+      double Speedup = Cl->Cost > 0 ? Cl->CalleeCost / Cl->Cost : 0;
+      bool Fits = Cl->Size <= Budget;
+      bool Taken = Speedup >= MinSpeedup && Fits;
+      if (Taken) {
+        Budget -= Cl->Size;
+        for (CallInst *Call : Cl->Calls)
+          redirect(Call, Cl->F, Cl->Key.second);
+        Changed = true;
+      }
+      outs() << (Taken ? "specialized " : "skipped ");
+      printKey(Cl->Key);
+      outs() << ": " << Cl->Calls.size() << " call(s), "
+             << format("%.1f", Cl->Freq) << " per caller call, cost "
+             << format("%.1f", Cl->CalleeCost) << " -> "
+             << format("%.1f", Cl->Cost) << ", estimated speedup "
+             << format("%.2f", Speedup) << "x, " << Cl->Size
+             << " instructions";
+      if (Speedup >= MinSpeedup && !Fits)
+        outs() << ", over the budget";
+      outs() << "\n";
+      if (!Taken)
+        Cl->F->eraseFromParent();
+    }
+    return Changed;
+  }
+
+  void getAnalysisUsage(AnalysisUsage &AU) const override {
+    AU.addRequired<TargetTransformInfoWrapperPass>();
+  }
+
+private:
+  // the calls of F with at least one constant argument and a frequency of
+  // at least MinFreq
+  void collectCandidates(Function &F, std::vector<Candidate> &Candidates) {
+    std::vector<CallInst *> Calls;
+    for (BasicBlock &BB : F) {
+      for (Instruction &I : BB) {
+        CallInst *Call = dyn_cast<CallInst>(&I);
+        Function *Callee = Call ? Call->getCalledFunction() : nullptr;
+        if (!Callee || Callee->isDeclaration() || Callee->isVarArg() ||
+            Callee->hasFnAttribute(Attribute::NoInline))
+          continue;
+        for (Value *Arg : Call->args()) {
+          if (isa<Constant>(Arg) && !isa<GlobalValue>(Arg) &&
+              !isa<UndefValue>(Arg)) {
+            Calls.push_back(Call);
+            break;
+          }
+        }
+      }
+    }
+    if (Calls.empty())
+      return;
+
+    DominatorTree DT(F);
+    LoopInfo LI(DT);
+    BranchProbabilityInfo BPI(F, LI);
+    BlockFrequencyInfo BFI(F, BPI, LI);
+    double EntryFreq = BFI.getEntryFreq();
+    for (CallInst *Call : Calls) {
+      double Freq =
+          BFI.getBlockFreq(Call->getParent()).getFrequency() / EntryFreq;
+      if (Freq < MinFreq)
+        continue;
+      SpecKey Key;
+      Key.first = Call->getCalledFunction();
+      for (Value *Arg : Call->args()) {
+        Constant *C = dyn_cast<Constant>(Arg);
+        bool Usable = C && !isa<GlobalValue>(C) && !isa<UndefValue>(C);
+        Key.second.push_back(Usable ? C : nullptr);
+      }
+      Candidates.push_back({Call, Freq, Key});
+    }
+  }
+
+  // fold the constant arguments through F and drop what becomes dead
+  static void simplify(Function &F) {
+    const DataLayout &DL = F.getParent()->getDataLayout();
+    bool Changed = true;
+    while (Changed) {
+      Changed = false;
+      for (BasicBlock &BB : F) {
+        for (auto It = BB.begin(); It != BB.end();) {
+          Instruction &I = *It++;
+          Value *V = SimplifyInstruction(&I, DL);
+          if (V && V != &I) {
+            I.replaceAllUsesWith(V);
+            Changed = true;
+          }
+          if (isInstructionTriviallyDead(&I)) {
+            I.eraseFromParent();
+            Changed = true;
+          }
+        }
+        Changed |= ConstantFoldTerminator(&BB, true);
+      }
+      Changed |= removeUnreachableBlocks(F);
+    }
+  }
+
+  // reciprocal throughput of one call of F
+  double cost(Function &F) {
+    const TargetTransformInfo &TTI =
+        getAnalysis<TargetTransformInfoWrapperPass>().getTTI(F);
+    DominatorTree DT(F);
+    LoopInfo LI(DT);
+    BranchProbabilityInfo BPI(F, LI);
+    BlockFrequencyInfo BFI(F, BPI, LI);
+    double EntryFreq = BFI.getEntryFreq();
+    double Total = 0;
+    for (BasicBlock &BB : F) {
+      double BlockCost = 0;
+      for (Instruction &I : BB) {
+        InstructionCost C = TTI.getInstructionCost(
+            &I, TargetTransformInfo::TCK_RecipThroughput);
+        if (C.isValid())
+          BlockCost += *C.getValue();
+      }
+      Total += BlockCost * BFI.getBlockFreq(&BB).getFrequency() / EntryFreq;
+    }
+    return Total;
+  }
+
+  static double saved(const Clone &Cl) {
+    return Cl.Freq * (Cl.CalleeCost - Cl.Cost);
+  }
+
+  // call Spec with the arguments that were not constant
+  static void redirect(CallInst *Call, Function *Spec,
+                       const std::vector<Constant *> &Consts) {
+    std::vector<Value *> Args;
+    for (unsigned idx = 0; idx < Call->arg_size(); idx++) {
+      if (!Consts[idx])
+        Args.push_back(Call->getArgOperand(idx));
+    }
+    CallInst *New = CallInst::Create(Spec, Args, "", Call);
+    New->takeName(Call);
+    New->setDebugLoc(Call->getDebugLoc());
+    New->setCallingConv(Spec->getCallingConv());
+    New->setTailCallKind(Call->getTailCallKind());
+    Call->replaceAllUsesWith(New);
+    Call->eraseFromParent();
+  }
+
+  static void printKey(const SpecKey &Key) {
+    outs() << Key.first->getName() << "(";
+    unsigned idx = 0;
+    for (Argument &Arg : Key.first->args()) {
+      if (idx)
+        outs() << ", ";
+      if (Constant *C = Key.second[idx])
+        C->printAsOperand(outs(), false);
+      else
+        Arg.printAsOperand(outs(), false);
+      idx++;
+    }
+    outs() << ")";
+  }
+};
+}
+
+char Specialize::ID = 0;
+static RegisterPass<Specialize> X("specialize", "specialize functions for "
+                                  "constant arguments",
+                                  false /* Only looks at CFG */,
+                                  false /* Analysis Pass */);
@@ -0,0 +1,7 @@
+mkdir -p ./build
+cd ./build
+rm -rf *
+cmake ../
+make
+cd ../
+opt -enable-new-pm=0 -mcpu=native -load ./build/libSpecialize.so -specialize exam_spec.ll -S -o ./build/exam_spec.ll
@@ -0,0 +1,55 @@
+; foo and bar of llvm_tutorial/data/parser_llvm/exam_whole, where bar calls
+; foo(a, 4), and a toy style loop in sum that calls pow(i, 0)
+source_filename = "exam_spec"
+
+define double @foo(double %a, double %b) {
+entry:
+  %multmp = fmul double %a, %a
+  %multmp1 = fmul double 2.000000e+00, %a
+  %multmp2 = fmul double %multmp1, %b
+  %addtmp = fadd double %multmp, %multmp2
+  %multmp3 = fmul double %b, %b
+  %addtmp4 = fadd double %addtmp, %multmp3
+  ret double %addtmp4
+}
+
+define double @bar(double %a) {
+entry:
+  %calltmp = call double @foo(double %a, double 4.000000e+00)
+  ret double %calltmp
+}
+
+define i32 @pow(i32 %x, i32 %n) {
+entry:
+  %iszero = icmp eq i32 %n, 0
+  br i1 %iszero, label %done, label %loop
+
+loop:
+  %i = phi i32 [ 0, %entry ], [ %next, %loop ]
+  %acc = phi i32 [ 1, %entry ], [ %mul, %loop ]
+  %mul = mul i32 %acc, %x
+  %next = add i32 %i, 1
+  %more = icmp ult i32 %next, %n
+  br i1 %more, label %loop, label %done
+
+done:
+  %result = phi i32 [ 1, %entry ], [ %mul, %loop ]
+  ret i32 %result
+}
+
+define i32 @sum(i32 %n) {
+entry:
+  br label %loop
+
+loop:
+  %i = phi i32 [ 0, %entry ], [ %next, %loop ]
+  %acc = phi i32 [ 0, %entry ], [ %add, %loop ]
+  %p = call i32 @pow(i32 %i, i32 0)
+  %add = add i32 %acc, %p
+  %next = add i32 %i, 1
+  %cmp = icmp slt i32 %next, %n
+  br i1 %cmp, label %loop, label %exit
+
+exit:
+  ret i32 %add
+}
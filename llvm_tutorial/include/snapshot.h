@@ -0,0 +1,156 @@
+#ifndef SNAPSHOT_H_
+#define SNAPSHOT_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "symbol.h"
+
+// A parsed program written in binary form, so it can be loaded instead of
+// being lexed and parsed again. Every section is an array of fixed size
+// records at a file offset, and records refer to each other by index, so
+// the file is used in place after mmap.
+//
+//   SnapshotHeader
+//   string offsets  uint32_t[], into the string data
+//   string data     NUL terminated names
+//   operators       SnapshotOperator[]
+//   numbers         double[], the constants of number nodes
+//   nodes           SnapshotNode[], children before their parents
+//   lists           uint32_t[], call arguments and prototype arguments
+//   items           SnapshotItem[], in source order
+const uint32_t SnapshotMagic = 0x504e534b; // "KSNP"
+const uint32_t SnapshotVersion = 1;
+const uint32_t SnapshotNoNode = ~0u;
+
+struct SnapshotSection {
+  uint32_t offset;
+  uint32_t count;
+};
+
+struct SnapshotHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t size;
+  uint32_t reserved;
+  SnapshotSection strOffsets;
+  SnapshotSection strData;
+  SnapshotSection operators;
+  SnapshotSection numbers;
+  SnapshotSection nodes;
+  SnapshotSection lists;
+  SnapshotSection items;
+};
+
+struct SnapshotOperator {
+  int32_t op;
+  int32_t prec;
+};
+
+enum SnapshotNodeKind : uint8_t {
+  snap_number,
+  snap_variable,
+  snap_binary,
+  snap_call,
+};
+
+// number: a is the index of the constant
+// variable: a is the name
+// binary: op, a and b are the operands
+// call: a is the callee, the c arguments start at list b
+struct SnapshotNode {
+  uint8_t kind;
+  uint8_t op;
+  uint16_t reserved;
+  uint32_t a;
+  uint32_t b;
+  uint32_t c;
+};
+
+enum SnapshotItemKind : uint8_t {
+  snap_def,
+  snap_extern,
+  snap_expr,
+};
+
+// the numArgs arguments of the prototype start at list args; body is
+// SnapshotNoNode for an extern
+struct SnapshotItem {
+  uint8_t kind;
+  uint8_t reserved[3];
+  uint32_t name;
+  uint32_t args;
+  uint32_t numArgs;
+  uint32_t body;
+};
+
+class SnapshotWriter {
+  std::vector<uint32_t> StrOffsets;
+  std::string StrData;
+  // string index of each symbol, ~0u if not written yet
+  std::vector<uint32_t> SymbolStrings;
+  std::vector<SnapshotOperator> Operators;
+  std::vector<double> Numbers;
+  std::vector<SnapshotNode> Nodes;
+  std::vector<uint32_t> Lists;
+  std::vector<SnapshotItem> Items;
+
+  uint32_t addString(Symbol sym);
+  uint32_t addNode(SnapshotNodeKind kind, uint8_t op, uint32_t a, uint32_t b,
+                   uint32_t c);
+
+public:
+  void addOperator(char op, int prec);
+  uint32_t addNumber(double val);
+  uint32_t addVariable(Symbol name);
+  uint32_t addBinary(char op, uint32_t lhs, uint32_t rhs);
+  uint32_t addCall(Symbol callee, const std::vector<uint32_t> &args);
+  void addItem(SnapshotItemKind kind, Symbol name,
+               const std::vector<Symbol> &args, uint32_t body);
+  unsigned numItems() const { return Items.size(); }
+
+  bool write(const std::string &path) const;
+};
+
+// A snapshot mapped into memory. open() checks the header and that every
+// section lies inside the file; the accessors check indices.
+class SnapshotReader {
+  const char *Base = nullptr;
+  size_t Size = 0;
+  const SnapshotHeader *Header = nullptr;
+  // interned symbol of each string
+  std::vector<Symbol> Symbols;
+
+  template <typename T> const T *section(const SnapshotSection &s) const {
+    return reinterpret_cast<const T *>(Base + s.offset);
+  }
+
+public:
+  SnapshotReader() = default;
+  SnapshotReader(const SnapshotReader &) = delete;
+  SnapshotReader &operator=(const SnapshotReader &) = delete;
+  ~SnapshotReader();
+
+  // false with a message in Error if the file is not a valid snapshot
+  bool open(const std::string &path, std::string &Error);
+
+  unsigned numOperators() const { return Header->operators.count; }
+  unsigned numNodes() const { return Header->nodes.count; }
+  unsigned numItems() const { return Header->items.count; }
+
+  const SnapshotOperator &getOperator(unsigned idx) const {
+    return section<SnapshotOperator>(Header->operators)[idx];
+  }
+  const SnapshotNode *getNode(uint32_t idx) const;
+  // false if idx is not a constant of the snapshot
+  bool getNumber(uint32_t idx, double &val) const;
+  const SnapshotItem &getItem(unsigned idx) const {
+    return section<SnapshotItem>(Header->items)[idx];
+  }
+  // the count entries of the list starting at first, null if out of range
+  const uint32_t *getList(uint32_t first, uint32_t count) const;
+  // false if idx is not a string of the snapshot
+  bool getSymbol(uint32_t idx, Symbol &sym) const;
+};
+#endif
@@ -0,0 +1,58 @@
+#ifndef SYMBOL_H_
+#define SYMBOL_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Identifiers are interned by the lexer and carried as 32-bit ids from
+// then on, so later phases compare and index integers instead of strings.
+// The functions may be called from several threads.
+typedef uint32_t Symbol;
+
+Symbol intern(const std::string &name);
+const std::string &symbolName(Symbol sym);
+unsigned numSymbols();
+
+// A lexically scoped table from symbols to values. Symbol ids are dense,
+// so the table is a flat array indexed by the id. Bindings shadowed by an
+// inner scope are kept on an undo log and restored by popScope().
+template <typename T> class ScopedSymbolTable {
+  struct Entry {
+    T Val;
+    bool Bound;
+  };
+  struct Shadowed {
+    Symbol Sym;
+    Entry Old;
+  };
+  std::vector<Entry> Entries;
+  std::vector<Shadowed> UndoLog;
+  std::vector<size_t> Scopes;
+
+public:
+  void pushScope() { Scopes.push_back(UndoLog.size()); }
+
+  void popScope() {
+    size_t Mark = Scopes.back();
+    Scopes.pop_back();
+    while (UndoLog.size() > Mark) {
+      Entries[UndoLog.back().Sym] = UndoLog.back().Old;
+      UndoLog.pop_back();
+    }
+  }
+
+  void bind(Symbol Sym, const T &Val) {
+    if (Sym >= Entries.size())
+      Entries.resize(Sym + 1, Entry{T(), false});
+    UndoLog.push_back({Sym, Entries[Sym]});
+    Entries[Sym] = Entry{Val, true};
+  }
+
+  const T *lookup(Symbol Sym) const {
+    if (Sym >= Entries.size() || !Entries[Sym].Bound)
+      return nullptr;
+    return &Entries[Sym].Val;
+  }
+};
+#endif
@@ -2,6 +2,9 @@
 #ifndef TOKEN_H_
 #define TOKEN_H_
 
+#include <cstdio>
+#include "symbol.h"
+
 // type definition
 enum Token {
   tok_eof = -1,
@@ -17,9 +20,24 @@ enum Token {
 struct TokenInfo {
   int tok;
   std::string identifierStr;
+  Symbol identifierSym;
   double numVal;
 };
 
-TokenInfo gettok();
+// Splits an input into tokens. Every parser owns one, so several inputs
+// can be read at the same time.
+class Lexer {
+  FILE *Input;
+  char LastChar = ' ';
+
+public:
+  explicit Lexer(FILE *in = stdin) : Input(in) {}
+  // read the following tokens from in
+  void setInput(FILE *in) {
+    Input = in;
+    LastChar = ' ';
+  }
+  TokenInfo gettok();
+};
 #endif
 
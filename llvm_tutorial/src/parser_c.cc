@@ -4,35 +4,40 @@
 #include "../include/token.h"
 #include "../include/parser_c.h"
 
-static std::string IdentifierStr;
-static double NumVal;
-static int CurTok;
-static std::map<char, int> BinopPrecedence;
-// char corresponding to unknown token
-static char ThisChar;
-
-static void dump_token(Token tok);
-static int getNextToken();
-static std::unique_ptr<ExprAST> LogError(const char *str);
-static std::unique_ptr<ExprAST> ParseNumberExpr();
-static std::unique_ptr<ExprAST> ParseParenExpr();
-static std::unique_ptr<ExprAST> ParseIndentifierExpr();
-static std::unique_ptr<ExprAST> ParsePrimary();
-static std::unique_ptr<ExprAST> ParseExpression();
-static int GetTokPrecedence();
-static std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec,
-                                              std::unique_ptr<ExprAST> LHS);
-static std::unique_ptr<PrototypeAST> ParsePrototype();
-static std::unique_ptr<FunctionAST> ParseDefinition();
-static std::unique_ptr<PrototypeAST> ParseExtern();
-static std::unique_ptr<FunctionAST> ParseTopLevelExpr();
-static void MainLoop();
-static void HandleDefinition();
-static void HandleExtern();
-static void HandleTopLevelExpression();
+// The state of one parse: the lexer, the current token and the operator
+// table. Nothing is shared between parsers, so several can run at once.
+class Parser {
+  Lexer Lex;
+  std::string IdentifierStr;
+  double NumVal = 0;
+  int CurTok = 0;
+  std::map<char, int> BinopPrecedence;
+
+  void dump_token(Token tok);
+  int getNextToken();
+  std::unique_ptr<ExprAST> ParseNumberExpr();
+  std::unique_ptr<ExprAST> ParseParenExpr();
+  std::unique_ptr<ExprAST> ParseIndentifierExpr();
+  std::unique_ptr<ExprAST> ParsePrimary();
+  std::unique_ptr<ExprAST> ParseExpression();
+  int GetTokPrecedence();
+  std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec,
+                                         std::unique_ptr<ExprAST> LHS);
+  std::unique_ptr<PrototypeAST> ParsePrototype();
+  std::unique_ptr<FunctionAST> ParseDefinition();
+  std::unique_ptr<PrototypeAST> ParseExtern();
+  std::unique_ptr<FunctionAST> ParseTopLevelExpr();
+  void HandleDefinition();
+  void HandleExtern();
+  void HandleTopLevelExpression();
+
+public:
+  explicit Parser(FILE *In);
+  void MainLoop();
+};
 
 // lexer, recoginze tokens
-static void dump_token(Token tok) {
+void Parser::dump_token(Token tok) {
   switch (tok) {
     case tok_eof:
       std::cout << "end of file." << std::endl;
@@ -61,10 +66,10 @@ static void dump_token(Token tok) {
   }
 }
 
-static int getNextToken() {
+int Parser::getNextToken() {
   TokenInfo tokInfo;
 
-  tokInfo = gettok();
+  tokInfo = Lex.gettok();
   CurTok = tokInfo.tok;
   IdentifierStr = tokInfo.identifierStr;
   NumVal = tokInfo.numVal;
@@ -73,24 +78,24 @@ static int getNextToken() {
 }
 
 // log function
-std::unique_ptr<ExprAST> LogError(const char *str) {
+static std::unique_ptr<ExprAST> LogError(const char *str) {
   fprintf(stderr, "LogErr: %s\n", str);
   return nullptr;
 }
 
-std::unique_ptr<PrototypeAST> LogErrorP(const char *str) {
+static std::unique_ptr<PrototypeAST> LogErrorP(const char *str) {
   LogError(str);
   return nullptr;
 }
 
 // parser, get the AST
-static std::unique_ptr<ExprAST> ParseNumberExpr() {
+std::unique_ptr<ExprAST> Parser::ParseNumberExpr() {
   auto Result = std::make_unique<NumberExprAST>(NumVal);
   getNextToken();
   return std::move(Result);
 }
 
-static std::unique_ptr<ExprAST> ParseParenExpr() {
+std::unique_ptr<ExprAST> Parser::ParseParenExpr() {
   getNextToken(); // eat '('
   auto V = ParseExpression();
   if (!V)
@@ -102,7 +107,7 @@ static std::unique_ptr<ExprAST> ParseParenExpr() {
   return V;
 }
 
-static std::unique_ptr<ExprAST> ParseIndentifierExpr() {
+std::unique_ptr<ExprAST> Parser::ParseIndentifierExpr() {
   std::string IdName = IdentifierStr;
 
   getNextToken(); // eat identifier
@@ -135,7 +140,7 @@ static std::unique_ptr<ExprAST> ParseIndentifierExpr() {
 }
 
 // wrap the parser into one entry
-static std::unique_ptr<ExprAST> ParsePrimary() {
+std::unique_ptr<ExprAST> Parser::ParsePrimary() {
   switch (CurTok) {
   case tok_identifier:
     return ParseIndentifierExpr();
@@ -148,7 +153,7 @@ static std::unique_ptr<ExprAST> ParsePrimary() {
   }
 }
 
-static std::unique_ptr<ExprAST> ParseExpression() {
+std::unique_ptr<ExprAST> Parser::ParseExpression() {
   auto LHS = ParsePrimary();
   if (!LHS)
     return nullptr;
@@ -156,8 +161,8 @@ static std::unique_ptr<ExprAST> ParseExpression() {
   return ParseBinOpRHS(0, std::move(LHS));
 }
 
-static std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec,
-                                              std::unique_ptr<ExprAST> LHS) {
+std::unique_ptr<ExprAST> Parser::ParseBinOpRHS(int ExprPrec,
+                                                 std::unique_ptr<ExprAST> LHS) {
   while (1) {
     int TokPrec = GetTokPrecedence();
 
@@ -183,7 +188,7 @@ static std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec,
   }
 }
 
-static std::unique_ptr<PrototypeAST> ParsePrototype() {
+std::unique_ptr<PrototypeAST> Parser::ParsePrototype() {
   if (CurTok != tok_identifier)
     return LogErrorP("Expected function name!");
 
@@ -206,7 +211,7 @@ static std::unique_ptr<PrototypeAST> ParsePrototype() {
   return std::make_unique<PrototypeAST>(FnName, std::move(ArgNames));
 }
 
-static std::unique_ptr<FunctionAST> ParseDefinition() {
+std::unique_ptr<FunctionAST> Parser::ParseDefinition() {
   getNextToken();  // eat def
   // parse the definition
   auto Proto = ParsePrototype();
@@ -218,12 +223,12 @@ static std::unique_ptr<FunctionAST> ParseDefinition() {
   return nullptr;
 }
 
-static std::unique_ptr<PrototypeAST> ParseExtern() {
+std::unique_ptr<PrototypeAST> Parser::ParseExtern() {
   getNextToken(); // eat extern
   return ParsePrototype();
 }
 
-static std::unique_ptr<FunctionAST> ParseTopLevelExpr() {
+std::unique_ptr<FunctionAST> Parser::ParseTopLevelExpr() {
   if (auto E = ParseExpression()) {
     auto Proto = std::make_unique<PrototypeAST>("", std::vector<std::string>());
     return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
@@ -231,7 +236,7 @@ static std::unique_ptr<FunctionAST> ParseTopLevelExpr() {
   return nullptr;
 }
 
-static void MainLoop() {
+void Parser::MainLoop() {
   while (1) {
     switch (CurTok) {
     case tok_eof:
@@ -252,7 +257,7 @@ static void MainLoop() {
   }
 }
 
-static void HandleDefinition() {
+void Parser::HandleDefinition() {
   if (ParseDefinition()) {
     fprintf(stderr, "Parse a function definition.\n");
   } else {
@@ -260,7 +265,7 @@ static void HandleDefinition() {
   }
 }
 
-static void HandleExtern() {
+void Parser::HandleExtern() {
   if (ParseExtern()) {
     fprintf(stderr, "Parse an extern.\n");
   } else {
@@ -268,7 +273,7 @@ static void HandleExtern() {
   }
 }
 
-static void HandleTopLevelExpression() {
+void Parser::HandleTopLevelExpression() {
   if (ParseTopLevelExpr()) {
     fprintf(stderr, "Parse a top-level expr.\n");
   } else {
@@ -276,7 +281,7 @@ static void HandleTopLevelExpression() {
   }
 }
 
-static int GetTokPrecedence() {
+int Parser::GetTokPrecedence() {
   if (!isascii(CurTok))
     return -1;
 
@@ -285,7 +290,7 @@ static int GetTokPrecedence() {
   return TokPrec;
 }
 
-int main() {
+Parser::Parser(FILE *In) : Lex(In) {
   // initialize the precedence
   BinopPrecedence['<'] = 10;
   BinopPrecedence['+'] = 10;
@@ -293,8 +298,10 @@ int main() {
   BinopPrecedence['*'] = 10;
 
   getNextToken();
+}
 
-  MainLoop();
+int main() {
+  Parser P(stdin);
+  P.MainLoop();
   return 0;
 }
-
@@ -0,0 +1,135 @@
+// Client of "parser_llvm -serve=socket".
+//
+//   parser_client [-s socket] [-o file] ir|eval|obj [source file]
+//   parser_client [-s socket] quit
+//
+// Without a source file the program is read from stdin and sent along;
+// a named file is opened by the server. For obj the object file is
+// written to -o (a.o by default), everything else goes to stdout.
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static void usage(const char *prog) {
+  fprintf(stderr, "usage: %s [-s socket] [-o file] ir|eval|obj|quit "
+          "[source file]\n", prog);
+  exit(1);
+}
+
+static bool writeAll(int fd, const char *data, size_t size) {
+  while (size) {
+    ssize_t n = write(fd, data, size);
+    if (n <= 0)
+      return false;
+    data += n;
+    size -= n;
+  }
+  return true;
+}
+
+// Split the response of obj into the log and the object, which follows
+// an "object <size>" line and fills the rest of the response.
+static bool splitObject(const std::string &response, std::string &log,
+                        std::string &object) {
+  for (size_t pos = 0; pos < response.size(); pos++) {
+    if ((pos && response[pos - 1] != '\n') ||
+        response.compare(pos, 7, "object ") != 0)
+      continue;
+    size_t eol = response.find('\n', pos);
+    if (eol == std::string::npos)
+      return false;
+    unsigned long size = strtoul(response.c_str() + pos + 7, nullptr, 10);
+    if (eol + 1 + size != response.size())
+      continue;
+    log = response.substr(0, pos);
+    object = response.substr(eol + 1);
+    return true;
+  }
+  return false;
+}
+
+int main(int argc, char **argv) {
+  const char *socketPath = "/tmp/parser_llvm.sock";
+  const char *output = "a.o";
+  int idx = 1;
+  for (; idx < argc && argv[idx][0] == '-'; idx++) {
+    if (!strcmp(argv[idx], "-s") && idx + 1 < argc)
+      socketPath = argv[++idx];
+    else if (!strcmp(argv[idx], "-o") && idx + 1 < argc)
+      output = argv[++idx];
+    else
+      usage(argv[0]);
+  }
+  if (idx >= argc || idx + 2 < argc)
+    usage(argv[0]);
+  std::string mode = argv[idx];
+
+  std::string request = mode;
+  if (idx + 1 < argc) {
+    // the server has its own working directory
+    char path[PATH_MAX];
+    if (!realpath(argv[idx + 1], path)) {
+      perror(argv[idx + 1]);
+      return 1;
+    }
+    request += ' ';
+    request += path;
+    request += '\n';
+  } else {
+    request += '\n';
+    if (mode != "quit") {
+      char buf[4096];
+      size_t n;
+      while ((n = fread(buf, 1, sizeof(buf), stdin)) > 0)
+        request.append(buf, n);
+    }
+  }
+
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(socketPath) >= sizeof(addr.sun_path))
+    usage(argv[0]);
+  strcpy(addr.sun_path, socketPath);
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock < 0 || connect(sock, (sockaddr *)&addr, sizeof(addr)) != 0) {
+    perror(socketPath);
+    return 1;
+  }
+  if (!writeAll(sock, request.data(), request.size())) {
+    perror("write");
+    return 1;
+  }
+  shutdown(sock, SHUT_WR);
+
+  std::string response;
+  char buf[4096];
+  ssize_t n;
+  while ((n = read(sock, buf, sizeof(buf))) > 0)
+    response.append(buf, n);
+  close(sock);
+
+  if (mode != "obj") {
+    fwrite(response.data(), 1, response.size(), stdout);
+    return 0;
+  }
+
+  std::string log, object;
+  if (!splitObject(response, log, object)) {
+    fwrite(response.data(), 1, response.size(), stdout);
+    return 1;
+  }
+  fwrite(log.data(), 1, log.size(), stdout);
+  FILE *out = fopen(output, "wb");
+  if (!out || fwrite(object.data(), 1, object.size(), out) != object.size()) {
+    perror(output);
+    return 1;
+  }
+  fclose(out);
+  return 0;
+}
@@ -6,59 +6,107 @@
 #include "llvm/IR/Function.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/LLVMRemarkStreamer.h"
+#include "llvm/Remarks/RemarkStreamer.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Type.h"
+#include "llvm/IR/Intrinsics.h"
+#include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/ExecutionEngine/Orc/CompileUtils.h"
+#include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/ToolOutputFile.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Transforms/InstCombine/InstCombine.h"
+#include "llvm/Transforms/Scalar.h"
+#include "llvm/Transforms/Scalar/GVN.h"
 #include <algorithm>
+#include <atomic>
 #include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
 #include <vector>
+#include "../include/snapshot.h"
+#include "../include/symbol.h"
 #include "../include/token.h"
 
 using namespace llvm;
 
-static LLVMContext TheContext;
-static IRBuilder<> Builder(TheContext);
-static std::unique_ptr<Module> TheModule;
-static std::map<std::string, Value *> NamedValues;
-
-static std::string IdentifierStr;
-static double NumVal;
-static int CurTok;
-static std::map<char, int> BinopPrecedence;
-
-// utilitility function
-static int getNextToken() {
-  TokenInfo tokInfo;
-
-  tokInfo = gettok();
-  CurTok = tokInfo.tok;
-  IdentifierStr = tokInfo.identifierStr;
-  NumVal = tokInfo.numVal;
-
-  return CurTok;
-}
+enum MapFormat { map_f64, map_i32, map_csv };
+
+// What a compilation does, set from the command line. Every
+// CompilerInstance has its own copy.
+struct CompilerOptions {
+  // In -repl mode every definition and every top level expression gets a
+  // module and context of its own, which is handed to the JIT. Definitions
+  // stay resident, an expression is removed with its ResourceTracker as
+  // soon as it has run, so its IR and machine code are freed again.
+  bool Repl = false;
+  // no "ready>" prompt, for the requests of -serve and the -stress runs
+  bool Quiet = false;
+  // With -lazy a definition is only kept in PendingFunctions, indexed by
+  // its name, and compiled once a top level expression can reach it.
+  bool Lazy = false;
+  // With -live (a -repl mode) every function is called through a stub of
+  // the JIT, and a redefinition is compiled in the background and swaps
+  // the pointer of the stub, see SwapDefinition.
+  bool Live = false;
+  // With -ffast-math floating point operations get all fast-math flags,
+  // multiplies and adds may be fused, externs of the C math library are
+  // called through their intrinsics, and every function is simplified by
+  // TheFPM, so the flags and intrinsics take effect.
+  bool FastMath = false;
+  // With -emit-snapshot the parsed items are written to a snapshot
+  // instead of being compiled.
+  bool EmitSnapshot = false;
+  // With -map=name the program is compiled as a whole and name is applied
+  // to every record of the input columns, see RunMap.
+  std::string MapFunction;
+  std::vector<std::string> MapInputs;
+  MapFormat MapInputFormat = map_f64;
+  std::string MapOutput;
+  // With -remarks=file the optimization remarks of the -map pipeline are
+  // saved to file, as yaml or bitstream (-remarks-format).
+  std::string RemarksFile;
+  std::string RemarksFormat = "yaml";
+};
 
-static int GetTokPrecedence() {
-  if (!isascii(CurTok))
-    return -1;
-
-  int TokPrec = BinopPrecedence[CurTok];
-  if (TokPrec <= 0)
-    return -1;
-
-  return TokPrec;
-}
+class CompilerInstance;
 
 // class definition
 class ExprAST {
 public:
   virtual ~ExprAST() {}
-  virtual Value *codegen() = 0;
+  // bind the names used in the expression, false on an unknown name
+  virtual bool resolve(CompilerInstance &C) = 0;
+  virtual Value *codegen(CompilerInstance &C) = 0;
+  // write the expression to a snapshot, returns its node index
+  virtual uint32_t snapshot(SnapshotWriter &W) const = 0;
+  // append the functions the expression calls
+  virtual void collectCalls(std::vector<Symbol> &Callees) const {}
 };
 
 class NumberExprAST : public ExprAST {
@@ -66,15 +114,24 @@ class NumberExprAST : public ExprAST {
 
 public:
   NumberExprAST(double Val) : Val(Val) {}
-  Value *codegen() override;
+  bool resolve(CompilerInstance &C) override { return true; }
+  Value *codegen(CompilerInstance &C) override;
+  uint32_t snapshot(SnapshotWriter &W) const override {
+    return W.addNumber(Val);
+  }
 };
 
 class VariableExprAST : public ExprAST {
-  std::string Name;
+  Symbol Name;
+  unsigned Slot = 0;
 
 public:
-  VariableExprAST(std::string &Name) : Name(Name) {}
-  Value *codegen() override;
+  VariableExprAST(Symbol Name) : Name(Name) {}
+  bool resolve(CompilerInstance &C) override;
+  Value *codegen(CompilerInstance &C) override;
+  uint32_t snapshot(SnapshotWriter &W) const override {
+    return W.addVariable(Name);
+  }
 };
 
 class BinaryExprAST : public ExprAST {
@@ -85,29 +142,61 @@ public:
   BinaryExprAST(char Op, std::unique_ptr<ExprAST> LHS, 
                 std::unique_ptr<ExprAST> RHS) 
     : Op(Op), LHS(std::move(LHS)), RHS(std::move(RHS)) {}
-  Value *codegen() override;
+  bool resolve(CompilerInstance &C) override {
+    return LHS->resolve(C) && RHS->resolve(C);
+  }
+  Value *codegen(CompilerInstance &C) override;
+  uint32_t snapshot(SnapshotWriter &W) const override {
+    uint32_t L = LHS->snapshot(W);
+    uint32_t R = RHS->snapshot(W);
+    return W.addBinary(Op, L, R);
+  }
+  void collectCalls(std::vector<Symbol> &Callees) const override {
+    LHS->collectCalls(Callees);
+    RHS->collectCalls(Callees);
+  }
 };
 
 class CallExprAST : public ExprAST {
-  std::string Callee;
+  Symbol Callee;
+  Function *CalleeF = nullptr;
   std::vector <std::unique_ptr<ExprAST>> Args;
 
 public:
-  CallExprAST(const std::string &Callee,
-              std::vector<std::unique_ptr<ExprAST>> Args)
+  CallExprAST(Symbol Callee, std::vector<std::unique_ptr<ExprAST>> Args)
       : Callee(Callee), Args(std::move(Args)) {}
-  Value *codegen() override;
+  bool resolve(CompilerInstance &C) override;
+  Value *codegen(CompilerInstance &C) override;
+  uint32_t snapshot(SnapshotWriter &W) const override {
+    std::vector<uint32_t> ArgNodes;
+    for (auto &Arg : Args)
+      ArgNodes.push_back(Arg->snapshot(W));
+    return W.addCall(Callee, ArgNodes);
+  }
+  void collectCalls(std::vector<Symbol> &Callees) const override {
+    Callees.push_back(Callee);
+    for (auto &Arg : Args)
+      Arg->collectCalls(Callees);
+  }
 };
 
 class PrototypeAST {
-  std::string Name;
-  std::vector<std::string> Args;
+  Symbol Name;
+  std::vector<Symbol> Args;
+  bool IsExtern = false;
 
 public:
-  PrototypeAST(const std::string &Name, std::vector<std::string> Args)
+  PrototypeAST(Symbol Name, std::vector<Symbol> Args)
       : Name(Name), Args(std::move(Args)) {}
-  Function *codegen();
-  const std::string &getName() const { return Name; }
+  Function *codegen(CompilerInstance &C);
+  Symbol getName() const { return Name; }
+  const std::vector<Symbol> &getArgs() const { return Args; }
+  bool isExtern() const { return IsExtern; }
+  void setExtern() { IsExtern = true; }
+  void snapshot(SnapshotWriter &W, SnapshotItemKind Kind,
+                uint32_t Body = SnapshotNoNode) const {
+    W.addItem(Kind, Name, Args, Body);
+  }
 };
 
 class FunctionAST {
@@ -118,128 +207,429 @@ public:
   FunctionAST(std::unique_ptr<PrototypeAST> Proto, 
               std::unique_ptr<ExprAST> Body)
       : Proto(std::move(Proto)), Body(std::move(Body)){}
-  Function *codegen();
+  Function *codegen(CompilerInstance &C);
+  void snapshot(SnapshotWriter &W, SnapshotItemKind Kind) const {
+    Proto->snapshot(W, Kind, Body->snapshot(W));
+  }
+  PrototypeAST &getProto() { return *Proto; }
+  void collectCalls(std::vector<Symbol> &Callees) const {
+    Body->collectCalls(Callees);
+  }
 };
 
+// Records per call of the map kernel. A chunk of a binary column is
+// mapped on its own, so a multiple of the page size keeps the offsets
+// aligned and memory use does not grow with the input.
+const size_t MapChunk = 1 << 18;
+
+// void __map_kernel(double *Out, const T **Cols, int64_t N)
+typedef void (*MapKernel)(double *, const void *const *, int64_t);
+
+// All the state of one compilation: the lexer and the current token, the
+// operator table, the context, builder and module being generated, the
+// name resolution tables and the JIT. Instances share no mutable data
+// besides the interned names, which are synchronized, so several of them
+// can compile on different threads. Messages go to Log.
+class CompilerInstance {
+public:
+  const CompilerOptions Opts;
+  raw_ostream &Log;
+
+  Lexer Lex;
+  Symbol IdentifierSym = 0;
+  double NumVal = 0;
+  int CurTok = 0;
+  std::map<char, int> BinopPrecedence;
+
+  std::unique_ptr<LLVMContext> TheContext;
+  std::unique_ptr<IRBuilder<>> Builder;
+  std::unique_ptr<Module> TheModule;
+  std::unique_ptr<legacy::FunctionPassManager> TheFPM;
+
+  // the JIT of -repl and -map, with the JITDylib the instance defines its
+  // code in, and the target machine of the host for object files and the
+  // cost model of the optimizer. Both are created on first use, unless
+  // the server shares its own; then the instance owns only TheJD.
+  std::unique_ptr<orc::LLJIT> OwnedJIT;
+  orc::LLJIT *TheJIT = nullptr;
+  orc::JITDylib *TheJD = nullptr;
+  std::unique_ptr<TargetMachine> OwnedTM;
+  TargetMachine *HostTM = nullptr;
+
+  std::unique_ptr<SnapshotWriter> SnapshotOut;
+  std::vector<std::unique_ptr<FunctionAST>> PendingFunctions;
+
+  // Name resolution binds variables to slots in LocalSlots and callees to
+  // entries of FunctionTable before codegen, so codegen never looks up a
+  // name.
+  ScopedSymbolTable<unsigned> Scopes;
+  unsigned NumSlots = 0;
+  std::vector<Value *> LocalSlots;
+  std::vector<Function *> FunctionTable;
+
+  // Prototypes of everything defined or declared so far, to redeclare
+  // them in the module of the current item.
+  std::vector<std::unique_ptr<PrototypeAST>> FunctionProtos;
+
+  // -live: a compiled version of a function, waiting to be installed
+  struct LiveSwap {
+    Symbol Name;
+    std::string Impl;
+    orc::ThreadSafeModule TSM;
+    orc::ResourceTrackerSP RT;
+  };
+  // The stubs, the installed version of every function, indexed by its
+  // name, and the versions replaced since the last expression. LiveLock
+  // guards everything below it, which the worker shares with the thread
+  // of the instance.
+  std::unique_ptr<orc::IndirectStubsManager> Stubs;
+  std::vector<unsigned> LiveVersions;
+  std::thread LiveWorker;
+  std::mutex LiveLock;
+  std::condition_variable LiveCV;
+  std::deque<LiveSwap> LiveQueue;
+  bool StopLive = false;
+  std::vector<orc::ResourceTrackerSP> LiveCode;
+  std::vector<orc::ResourceTrackerSP> RetiredCode;
+  std::string LiveErrors;
+
+  CompilerInstance(const CompilerOptions &Opts, raw_ostream &Log);
+  ~CompilerInstance();
+
+  Value *LogErrorV(const char *str);
+  std::unique_ptr<ExprAST> LogErrorP(const char *str);
+
+  // lexer and parser
+  int getNextToken();
+  int GetTokPrecedence();
+  std::unique_ptr<ExprAST> ParseNumberExpr();
+  std::unique_ptr<ExprAST> ParseParenExpr();
+  std::unique_ptr<ExprAST> ParseIdentifierExpr();
+  std::unique_ptr<ExprAST> ParsePrimary();
+  std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec,
+                                         std::unique_ptr<ExprAST> LHS);
+  std::unique_ptr<ExprAST> ParseExpression();
+  std::unique_ptr<PrototypeAST> ParsePrototype();
+  std::unique_ptr<FunctionAST> ParseDefinition();
+  std::unique_ptr<FunctionAST> ParseTopLevelExpr();
+  std::unique_ptr<PrototypeAST> ParseExtern();
+
+  // functions of the module
+  void bindFunction(Symbol Sym, Function *F);
+  void addPrototype(Symbol Sym, std::unique_ptr<PrototypeAST> Proto);
+  Function *lookupFunction(Symbol Sym);
+  Function *lookupMathIntrinsic(Symbol Sym, unsigned NumArgs);
+
+  // the items of the program
+  void InitializeModule();
+  bool AddModuleToJIT(orc::ResourceTrackerSP RT = nullptr);
+  void CodegenDefinition(std::unique_ptr<FunctionAST> FnAST);
+  void HandleDefinition();
+  void CodegenExtern(std::unique_ptr<PrototypeAST> ProtoAST);
+  void HandleExtern();
+  void EvaluateTopLevelExpression();
+  void CodegenReachable(const std::vector<Symbol> &Callees);
+  void CodegenTopLevelExpression(std::unique_ptr<FunctionAST> FnAST);
+  void HandleTopLevelExpression();
+  void MainLoop();
+
+  // -live
+  void SwapDefinition(Symbol Name, Function *F);
+  void InstallDefinition(LiveSwap &Swap);
+  void RunLiveWorker();
+  void ReleaseRetiredCode();
+  void FlushLiveErrors();
+
+  // snapshots
+  std::unique_ptr<ExprAST> LoadExpr(const SnapshotReader &R, uint32_t Idx,
+                                    uint32_t Parent);
+  bool LoadSnapshot(const std::string &Path);
+  bool WriteSnapshot(const std::string &Path);
+
+  // the JIT and the host target
+  bool InitializeJIT();
+  bool UseSharedJIT(orc::LLJIT &J);
+  bool AttachJIT(orc::LLJIT &J, orc::JITDylib &JD);
+  TargetMachine *GetHostTargetMachine();
+  bool EmitObject(SmallVectorImpl<char> &Obj);
+
+  // -map
+  Function *BuildMapKernel(Function *F, Type *ElemTy);
+  bool OptimizeModule(TargetMachine &TM);
+  bool MapBinary(MapKernel Kernel, size_t ElemSize, FILE *Out);
+  bool MapCSV(MapKernel Kernel, unsigned NumCols, FILE *Out);
+  bool RunMap();
+
+  // Parse and compile In up to its end.
+  void Compile(FILE *In);
+};
+
+CompilerInstance::CompilerInstance(const CompilerOptions &Opts,
+                                   raw_ostream &Log)
+    : Opts(Opts), Log(Log) {
+  BinopPrecedence['<'] = 10;
+  BinopPrecedence['+'] = 20;
+  BinopPrecedence['-'] = 20;
+  BinopPrecedence['*'] = 40;
+  if (Opts.EmitSnapshot)
+    SnapshotOut = std::make_unique<SnapshotWriter>();
+  InitializeModule();
+}
+
+CompilerInstance::~CompilerInstance() {
+  // let the worker install what is queued, so its errors are reported
+  {
+    std::lock_guard<std::mutex> Lock(LiveLock);
+    StopLive = true;
+  }
+  LiveCV.notify_one();
+  if (LiveWorker.joinable())
+    LiveWorker.join();
+  FlushLiveErrors();
+  // a shared JIT outlives the instance, so drop what it defined
+  if (TheJD && !OwnedJIT)
+    if (Error Err = TheJIT->getExecutionSession().removeJITDylib(*TheJD))
+      logAllUnhandledErrors(std::move(Err), Log, "Error: ");
+}
+
+// utilitility function
+int CompilerInstance::getNextToken() {
+  TokenInfo tokInfo;
+
+  tokInfo = Lex.gettok();
+  CurTok = tokInfo.tok;
+  IdentifierSym = tokInfo.identifierSym;
+  NumVal = tokInfo.numVal;
+
+  return CurTok;
+}
+
+int CompilerInstance::GetTokPrecedence() {
+  if (!isascii(CurTok))
+    return -1;
+
+  int TokPrec = BinopPrecedence[CurTok];
+  if (TokPrec <= 0)
+    return -1;
+
+  return TokPrec;
+}
+
+void CompilerInstance::bindFunction(Symbol Sym, Function *F) {
+  if (Sym >= FunctionTable.size())
+    FunctionTable.resize(Sym + 1, nullptr);
+  FunctionTable[Sym] = F;
+}
+
 // log function
-Value *LogErrorV(const char *str) {
-  fprintf(stderr, "LogErrV: %s\n", str);
+Value *CompilerInstance::LogErrorV(const char *str) {
+  Log << "LogErrV: " << str << "\n";
   return nullptr;
 }
 
-std::unique_ptr<ExprAST> LogErrorP(const char *str) {
-  fprintf(stderr, "LogErrV: %s\n", str);
+std::unique_ptr<ExprAST> CompilerInstance::LogErrorP(const char *str) {
+  Log << "LogErrV: " << str << "\n";
   return nullptr;
 }
 
-// code generation
-Value *NumberExprAST::codegen() {
-  return ConstantFP::get(TheContext, APFloat(Val));
+Value *NumberExprAST::codegen(CompilerInstance &C) {
+  return ConstantFP::get(*C.TheContext, APFloat(Val));
 }
 
-Value *VariableExprAST::codegen() {
-  Value *V = NamedValues[Name];
-  if (!V)
-    LogErrorV("Unknown variable name!");
-  return V;
+void CompilerInstance::addPrototype(Symbol Sym,
+                                    std::unique_ptr<PrototypeAST> Proto) {
+  if (Sym >= FunctionProtos.size())
+    FunctionProtos.resize(Sym + 1);
+  FunctionProtos[Sym] = std::move(Proto);
+}
+
+Function *CompilerInstance::lookupFunction(Symbol Sym) {
+  if (Sym < FunctionTable.size() && FunctionTable[Sym])
+    return FunctionTable[Sym];
+  if (Sym < FunctionProtos.size() && FunctionProtos[Sym])
+    return FunctionProtos[Sym]->codegen(*this);
+  return nullptr;
+}
+
+// The intrinsic for a call of the extern Sym with NumArgs arguments, if
+// it is a function of the C math library the optimizer knows about.
+Function *CompilerInstance::lookupMathIntrinsic(Symbol Sym,
+                                                unsigned NumArgs) {
+  static const struct {
+    const char *Name;
+    Intrinsic::ID ID;
+    unsigned NumArgs;
+  } MathFunctions[] = {
+      {"sin", Intrinsic::sin, 1},        {"cos", Intrinsic::cos, 1},
+      {"sqrt", Intrinsic::sqrt, 1},      {"exp", Intrinsic::exp, 1},
+      {"exp2", Intrinsic::exp2, 1},      {"log", Intrinsic::log, 1},
+      {"log2", Intrinsic::log2, 1},      {"log10", Intrinsic::log10, 1},
+      {"fabs", Intrinsic::fabs, 1},      {"floor", Intrinsic::floor, 1},
+      {"ceil", Intrinsic::ceil, 1},      {"trunc", Intrinsic::trunc, 1},
+      {"round", Intrinsic::round, 1},    {"pow", Intrinsic::pow, 2},
+      {"fmin", Intrinsic::minnum, 2},    {"fmax", Intrinsic::maxnum, 2},
+      {"copysign", Intrinsic::copysign, 2}, {"fma", Intrinsic::fma, 3},
+  };
+  if (Sym >= FunctionProtos.size() || !FunctionProtos[Sym] ||
+      !FunctionProtos[Sym]->isExtern())
+    return nullptr;
+  for (auto &MF : MathFunctions) {
+    if (symbolName(Sym) == MF.Name && NumArgs == MF.NumArgs)
+      return Intrinsic::getDeclaration(TheModule.get(), MF.ID,
+                                       {Type::getDoubleTy(*TheContext)});
+  }
+  return nullptr;
+}
+
+// name resolution
+bool VariableExprAST::resolve(CompilerInstance &C) {
+  const unsigned *S = C.Scopes.lookup(Name);
+  if (!S) {
+    C.LogErrorV("Unknown variable name!");
+    return false;
+  }
+  Slot = *S;
+  return true;
 }
 
-Value *BinaryExprAST::codegen() {
-  Value *L = LHS->codegen();
-  Value *R = RHS->codegen();
+bool CallExprAST::resolve(CompilerInstance &C) {
+  CalleeF = C.Opts.FastMath ? C.lookupMathIntrinsic(Callee, Args.size())
+                            : nullptr;
+  if (!CalleeF)
+    CalleeF = C.lookupFunction(Callee);
+  if (!CalleeF) {
+    C.LogErrorV("Unkown function referenced!");
+    return false;
+  }
+
+  if (CalleeF->arg_size() != Args.size()) {
+    C.LogErrorV("Incorrect argument size!");
+    return false;
+  }
+
+  for (auto &Arg : Args) {
+    if (!Arg->resolve(C))
+      return false;
+  }
+  return true;
+}
+
+// code generation
+Value *VariableExprAST::codegen(CompilerInstance &C) {
+  return C.LocalSlots[Slot];
+}
+
+Value *BinaryExprAST::codegen(CompilerInstance &C) {
+  Value *L = LHS->codegen(C);
+  Value *R = RHS->codegen(C);
 
   if (!L || !R)
     return nullptr;
 
   switch (Op) {
   case '+':
-    return Builder.CreateFAdd(L, R, "addtmp");
+    return C.Builder->CreateFAdd(L, R, "addtmp");
   case '-':
-    return Builder.CreateFSub(L, R, "subtmp");
+    return C.Builder->CreateFSub(L, R, "subtmp");
   case '*':
-    return Builder.CreateFMul(L, R, "multmp");
+    return C.Builder->CreateFMul(L, R, "multmp");
   case '<':
-    L = Builder.CreateFCmpULT(L, R, "addtmp");
-    return Builder.CreateUIToFP(L, Type::getDoubleTy(TheContext), 
-                                "booltmp");
+    L = C.Builder->CreateFCmpULT(L, R, "addtmp");
+    return C.Builder->CreateUIToFP(L, Type::getDoubleTy(*C.TheContext), 
+                                   "booltmp");
   default:
-    return LogErrorV("invalid binary operator");
+    return C.LogErrorV("invalid binary operator");
   }
 }
 
-Value *CallExprAST::codegen() {
-  Function *CalleeF = TheModule->getFunction(Callee);
-  if (!CalleeF)
-    return LogErrorV("Unkown function referenced!");
-
-  if (CalleeF->arg_size() != Args.size())
-    return LogErrorV("Incorrect argument size!");
-
+Value *CallExprAST::codegen(CompilerInstance &C) {
   std::vector<Value *> ArgsV;
   for (unsigned i = 0, e = Args.size(); i != e; i++) {
-    ArgsV.push_back(Args[i]->codegen());
+    ArgsV.push_back(Args[i]->codegen(C));
     if (!ArgsV.back())
       return nullptr;
   }
 
-  return Builder.CreateCall(CalleeF, ArgsV, "calltmp");
+  return C.Builder->CreateCall(CalleeF, ArgsV, "calltmp");
 }
 
-Function *PrototypeAST::codegen() {
-  std::vector<Type *> Doubles(Args.size(), Type::getDoubleTy(TheContext));
+Function *PrototypeAST::codegen(CompilerInstance &C) {
+  std::vector<Type *> Doubles(Args.size(), 
+                              Type::getDoubleTy(*C.TheContext));
   FunctionType *FT = 
-      FunctionType::get(Type::getDoubleTy(TheContext), Doubles, false);
-  Function *F = 
-      Function::Create(FT, Function::ExternalLinkage, Name, TheModule.get());
+      FunctionType::get(Type::getDoubleTy(*C.TheContext), Doubles, false);
+  Function *F = Function::Create(FT, Function::ExternalLinkage, 
+                                 symbolName(Name), C.TheModule.get());
   unsigned Idx = 0;
   for (auto &Arg : F->args())
-    Arg.setName(Args[Idx++]);
+    Arg.setName(symbolName(Args[Idx++]));
+  C.bindFunction(Name, F);
   return F;
 }
 
-Function *FunctionAST::codegen() {
-  Function *TheFunction = TheModule->getFunction(Proto->getName());
+Function *FunctionAST::codegen(CompilerInstance &C) {
+  Symbol Name = Proto->getName();
+  Function *TheFunction = C.lookupFunction(Name);
 
   if (!TheFunction)
-    TheFunction = Proto->codegen();
+    TheFunction = Proto->codegen(C);
 
   if (!TheFunction)
     return nullptr;
 
   if (!TheFunction->empty())
-    return (Function *)LogErrorV("Function cannot be redefined.");
-
-  // Create a new basic block to start insertion into
-  BasicBlock *BB = BasicBlock::Create(TheContext, "entry", TheFunction);
-  Builder.SetInsertPoint(BB);
-
-  NamedValues.clear();
-  for (auto &Arg : TheFunction->args()) {
-    NamedValues[Arg.getName()] = &Arg;
-  }
-
-  if (Value *RetVal = Body->codegen()) {
-    Builder.CreateRet(RetVal);
-
-    verifyFunction(*TheFunction);
-    return TheFunction;
+    return (Function *)C.LogErrorV("Function cannot be redefined.");
+
+  if (TheFunction->arg_size() != Proto->getArgs().size())
+    return (Function *)C.LogErrorV("Incorrect argument size!");
+
+  // resolve the body, the arguments take the first slots
+  C.Scopes.pushScope();
+  C.NumSlots = 0;
+  for (Symbol Arg : Proto->getArgs())
+    C.Scopes.bind(Arg, C.NumSlots++);
+  bool Resolved = Body->resolve(C);
+  C.Scopes.popScope();
+
+  if (Resolved) {
+    C.LocalSlots.assign(C.NumSlots, nullptr);
+    for (auto &Arg : TheFunction->args())
+      C.LocalSlots[Arg.getArgNo()] = &Arg;
+
+    // Create a new basic block to start insertion into
+    BasicBlock *BB = BasicBlock::Create(*C.TheContext, "entry", 
+                                        TheFunction);
+    C.Builder->SetInsertPoint(BB);
+
+    if (Value *RetVal = Body->codegen(C)) {
+      C.Builder->CreateRet(RetVal);
+
+      verifyFunction(*TheFunction);
+      if (C.TheFPM)
+        C.TheFPM->run(*TheFunction);
+      // keep the prototype, later modules declare the function from it
+      C.addPrototype(Name, std::move(Proto));
+      return TheFunction;
+    }
   }
 
-  // remove funciton
-  TheFunction->eraseFromParent();
+  // remove funciton, a lazily generated caller may refer to it already
+  C.bindFunction(Name, nullptr);
+  if (TheFunction->use_empty())
+    TheFunction->eraseFromParent();
+  else
+    TheFunction->deleteBody();
   return nullptr;
 }
 
 // parse function
-static std::unique_ptr<ExprAST> ParseExpression();
-
-static std::unique_ptr<ExprAST> ParseNumberExpr() {
+std::unique_ptr<ExprAST> CompilerInstance::ParseNumberExpr() {
   auto Result = std::make_unique<NumberExprAST>(NumVal);
   getNextToken();
   return std::move(Result);
 }
 
-static std::unique_ptr<ExprAST> ParseParenExpr() {
+std::unique_ptr<ExprAST> CompilerInstance::ParseParenExpr() {
   getNextToken();  // eat '('
   auto V = ParseExpression();
 
@@ -253,8 +643,8 @@ static std::unique_ptr<ExprAST> ParseParenExpr() {
   return V;
 }
 
-static std::unique_ptr<ExprAST> ParseIdentifierExpr() {
-  std::string IdName = IdentifierStr;
+std::unique_ptr<ExprAST> CompilerInstance::ParseIdentifierExpr() {
+  Symbol IdName = IdentifierSym;
 
   getNextToken();
   if (CurTok != '(')
@@ -284,7 +674,7 @@ static std::unique_ptr<ExprAST> ParseIdentifierExpr() {
   return std::make_unique<CallExprAST>(IdName, std::move(Args));
 }
 
-static std::unique_ptr<ExprAST> ParsePrimary() {
+std::unique_ptr<ExprAST> CompilerInstance::ParsePrimary() {
   switch (CurTok) {
   case tok_identifier:
     return ParseIdentifierExpr();
@@ -297,8 +687,8 @@ static std::unique_ptr<ExprAST> ParsePrimary() {
   }
 }
 
-static std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec,
-                                              std::unique_ptr<ExprAST> LHS) {
+std::unique_ptr<ExprAST> 
+CompilerInstance::ParseBinOpRHS(int ExprPrec, std::unique_ptr<ExprAST> LHS) {
   while (true) {
     int TokPrec = GetTokPrecedence();
 
@@ -322,33 +712,33 @@ static std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec,
   }
 }
 
-static std::unique_ptr<ExprAST> ParseExpression() {
+std::unique_ptr<ExprAST> CompilerInstance::ParseExpression() {
   auto LHS = ParsePrimary();
   if (!LHS)
     return nullptr;
   return ParseBinOpRHS(0, std::move(LHS));
 }
 
-static std::unique_ptr<PrototypeAST> ParsePrototype() {
+std::unique_ptr<PrototypeAST> CompilerInstance::ParsePrototype() {
   if (CurTok != tok_identifier) {
-    fprintf(stderr, "expect function in prototype");
+    Log << "expect function in prototype";
     return nullptr;
   }
 
-  std::string FnName = IdentifierStr;
+  Symbol FnName = IdentifierSym;
   getNextToken();
 
   if (CurTok != '(') {
-    fprintf(stderr, "expect '(' in prototype");
+    Log << "expect '(' in prototype";
     return nullptr;
   }
 
-  std::vector<std::string> ArgNames;
+  std::vector<Symbol> ArgNames;
   while (getNextToken() == tok_identifier)
-    ArgNames.push_back(IdentifierStr);
+    ArgNames.push_back(IdentifierSym);
 
   if (CurTok != ')') {
-    fprintf(stderr, "expect ')' in prototype");
+    Log << "expect ')' in prototype";
     return nullptr;
   }
 
@@ -356,7 +746,7 @@ static std::unique_ptr<PrototypeAST> ParsePrototype() {
   return std::make_unique<PrototypeAST>(FnName, std::move(ArgNames));
 }
 
-static std::unique_ptr<FunctionAST> ParseDefinition() {
+std::unique_ptr<FunctionAST> CompilerInstance::ParseDefinition() {
   getNextToken(); // eat def
   auto Proto = ParsePrototype();
   if (!Proto)
@@ -367,59 +757,975 @@ static std::unique_ptr<FunctionAST> ParseDefinition() {
   return nullptr;
 }
 
-static std::unique_ptr<FunctionAST> ParseTopLevelExpr() {
+std::unique_ptr<FunctionAST> CompilerInstance::ParseTopLevelExpr() {
   if (auto E = ParseExpression()) {
     // build an anon function to hold the expression
-    auto Proto = std::make_unique<PrototypeAST>("__anon_expr",
-                                                std::vector<std::string>());
+    static const Symbol AnonExpr = intern("__anon_expr");
+    auto Proto = std::make_unique<PrototypeAST>(AnonExpr,
+                                                std::vector<Symbol>());
     return std::make_unique<FunctionAST>(std::move(Proto), std::move(E));
   }
   return nullptr;
 }
 
-static std::unique_ptr<PrototypeAST> ParseExtern() {
+std::unique_ptr<PrototypeAST> CompilerInstance::ParseExtern() {
   getNextToken(); // eat extern
   return ParsePrototype();
 }
 
-static void HandleDefinition() {
-  if (auto FnAST = ParseDefinition()) {
-    if (auto *FnIR = FnAST->codegen()) {
-      fprintf(stderr, "Read function definition:");
-      FnIR->print(errs());
+void CompilerInstance::InitializeModule() {
+  // a module that was not handed to the JIT has to go before its context
+  TheFPM.reset();
+  Builder.reset();
+  TheModule.reset();
+  TheContext = std::make_unique<LLVMContext>();
+  TheModule = std::make_unique<Module>("my cool jit", *TheContext);
+  Builder = std::make_unique<IRBuilder<>>(*TheContext);
+  // the functions of the old module are gone with it
+  FunctionTable.clear();
+  if (TheJIT)
+    TheModule->setDataLayout(TheJIT->getDataLayout());
+
+  if (Opts.FastMath) {
+    Builder->setFastMathFlags(FastMathFlags::getFast());
+    TheFPM = std::make_unique<legacy::FunctionPassManager>(TheModule.get());
+    TheFPM->add(createInstructionCombiningPass());
+    TheFPM->add(createReassociatePass());
+    TheFPM->add(createGVNPass());
+    TheFPM->add(createInstructionCombiningPass());
+    TheFPM->add(createCFGSimplificationPass());
+    TheFPM->doInitialization();
+  }
+}
+
+// Hand the current module to the JIT, tracked by RT, and start a new one.
+bool CompilerInstance::AddModuleToJIT(orc::ResourceTrackerSP RT) {
+  orc::ThreadSafeModule TSM(std::move(TheModule), std::move(TheContext));
+  InitializeModule();
+  if (!RT)
+    RT = TheJD->getDefaultResourceTracker();
+  if (Error Err = TheJIT->addIRModule(RT, std::move(TSM))) {
+    logAllUnhandledErrors(std::move(Err), Log, "Error: ");
+    return false;
+  }
+  return true;
+}
+
+void CompilerInstance::CodegenDefinition(std::unique_ptr<FunctionAST> FnAST) {
+  if (Opts.Lazy) {
+    Symbol Name = FnAST->getProto().getName();
+    if (Name >= PendingFunctions.size())
+      PendingFunctions.resize(Name + 1);
+    if (PendingFunctions[Name]) {
+      LogErrorV("Function cannot be redefined.");
+      return;
     }
+    PendingFunctions[Name] = std::move(FnAST);
+    return;
+  }
+
+  Symbol Name = FnAST->getProto().getName();
+  if (auto *FnIR = FnAST->codegen(*this)) {
+    Log << "Read function definition:";
+    FnIR->print(Log);
+    if (Opts.Live)
+      SwapDefinition(Name, FnIR);
+    // definitions stay in the JIT for the whole session
+    else if (Opts.Repl)
+      AddModuleToJIT();
+  }
+}
+
+void CompilerInstance::HandleDefinition() {
+  if (auto FnAST = ParseDefinition()) {
+    if (SnapshotOut)
+      FnAST->snapshot(*SnapshotOut, snap_def);
+    else
+      CodegenDefinition(std::move(FnAST));
   } else {
-    fprintf(stderr, "No definition to handle.\n");
+    Log << "No definition to handle.\n";
     getNextToken();
   }
 }
 
-static void HandleExtern() {
+void CompilerInstance::CodegenExtern(std::unique_ptr<PrototypeAST> ProtoAST) {
+  ProtoAST->setExtern();
+  if (auto *FnIR = ProtoAST->codegen(*this)) {
+    Log << "Read extern: ";
+    FnIR->print(Log);
+    Symbol Name = ProtoAST->getName();
+    addPrototype(Name, std::move(ProtoAST));
+  }
+}
+
+void CompilerInstance::HandleExtern() {
   if (auto ProtoAST = ParseExtern()) {
-    if (auto *FnIR = ProtoAST->codegen()) {
-      fprintf(stderr, "Read extern: ");
-      FnIR->print(errs());
-    }
+    if (SnapshotOut)
+      ProtoAST->snapshot(*SnapshotOut, snap_extern);
+    else
+      CodegenExtern(std::move(ProtoAST));
   } else {
-    fprintf(stderr, "No extern to handle.\n");
+    Log << "No extern to handle.\n";
     getNextToken();
   }
 }
 
-static void HandleTopLevelExpression() {
-  if (auto FnAST = ParseTopLevelExpr()) {
-    if (auto *FnIR = FnAST->codegen()) {
-      fprintf(stderr, "Read top level expr: ");
-      FnIR->print(errs());
+// Run the expression in a module of its own and drop it again, so a long
+// session only keeps the definitions.
+void CompilerInstance::EvaluateTopLevelExpression() {
+  orc::ResourceTrackerSP RT = TheJD->createResourceTracker();
+  if (!AddModuleToJIT(RT))
+    return;
+
+  auto Sym = TheJIT->lookup(*TheJD, "__anon_expr");
+  if (Sym) {
+    auto *FP = (double (*)())(intptr_t)Sym->getAddress();
+    Log << format("Evaluated to %f\n", FP());
+  } else {
+    logAllUnhandledErrors(Sym.takeError(), Log, "Error: ");
+  }
+
+  if (Error Err = RT->remove())
+    logAllUnhandledErrors(std::move(Err), Log, "Error: ");
+  if (Opts.Live)
+    ReleaseRetiredCode();
+}
+
+// In -live mode version N of foo is compiled as foo.vN, and foo is a stub
+// that jumps through a pointer to the installed version. Callers only
+// ever refer to the stub, so a redefinition needs no recompilation of
+// them; a recursive call goes straight to its own version. The first
+// version is installed right away, so the next expression can call it.
+// Later versions are handed to LiveWorker, which compiles them while the
+// session goes on, and an expression calls whichever version is
+// installed when it reaches the stub.
+void CompilerInstance::SwapDefinition(Symbol Name, Function *F) {
+  if (Name >= LiveVersions.size()) {
+    LiveVersions.resize(Name + 1, 0);
+    std::lock_guard<std::mutex> Lock(LiveLock);
+    LiveCode.resize(Name + 1);
+  }
+  unsigned Version = ++LiveVersions[Name];
+  F->setName(symbolName(Name) + ".v" + std::to_string(Version));
+  LiveSwap Swap{Name, F->getName().str(),
+                orc::ThreadSafeModule(std::move(TheModule),
+                                      std::move(TheContext)),
+                TheJD->createResourceTracker()};
+  InitializeModule();
+
+  std::unique_lock<std::mutex> Lock(LiveLock);
+  if (!LiveCode[Name]) {
+    Lock.unlock();
+    InstallDefinition(Swap);
+    FlushLiveErrors();
+    return;
+  }
+  LiveQueue.push_back(std::move(Swap));
+  Lock.unlock();
+  if (!LiveWorker.joinable())
+    LiveWorker = std::thread([this] { RunLiveWorker(); });
+  LiveCV.notify_one();
+}
+
+// Compile a version and point the stub of its function at it. The
+// version it replaces is only retired, a call may still be running it.
+void CompilerInstance::InstallDefinition(LiveSwap &Swap) {
+  const std::string &StubName = symbolName(Swap.Name);
+  Error Err = TheJIT->addIRModule(Swap.RT, std::move(Swap.TSM));
+  if (!Err) {
+    auto Sym = TheJIT->lookup(*TheJD, Swap.Impl);
+    if (Sym) {
+      std::lock_guard<std::mutex> Lock(LiveLock);
+      if (LiveCode[Swap.Name]) {
+        // an atomic store, a call that has passed the stub is not affected
+        Err = Stubs->updatePointer(StubName, Sym->getAddress());
+      } else {
+        Err = Stubs->createStub(StubName, Sym->getAddress(),
+                                JITSymbolFlags::Exported);
+        if (!Err)
+          Err = TheJD->define(orc::absoluteSymbols(
+              {{TheJIT->mangleAndIntern(StubName),
+                Stubs->findStub(StubName, true)}}));
+      }
+      if (!Err) {
+        if (LiveCode[Swap.Name])
+          RetiredCode.push_back(std::move(LiveCode[Swap.Name]));
+        LiveCode[Swap.Name] = Swap.RT;
+        return;
+      }
+    } else {
+      Err = Sym.takeError();
+    }
+  }
+
+  std::string Errors;
+  raw_string_ostream OS(Errors);
+  logAllUnhandledErrors(std::move(Err), OS,
+                        "Error: " + Swap.Impl + " not installed: ");
+  if (Error RemoveErr = Swap.RT->remove())
+    logAllUnhandledErrors(std::move(RemoveErr), OS, "Error: ");
+  OS.flush();
+  std::lock_guard<std::mutex> Lock(LiveLock);
+  LiveErrors += Errors;
+}
+
+void CompilerInstance::RunLiveWorker() {
+  std::unique_lock<std::mutex> Lock(LiveLock);
+  while (true) {
+    LiveCV.wait(Lock, [this] { return StopLive || !LiveQueue.empty(); });
+    if (LiveQueue.empty())
+      return;
+    LiveSwap Swap = std::move(LiveQueue.front());
+    LiveQueue.pop_front();
+    Lock.unlock();
+    InstallDefinition(Swap);
+    Lock.lock();
+  }
+}
+
+// Free the versions replaced so far. Only expressions call JIT code, and
+// they run on the thread of the instance, so once one has returned no
+// call can be inside a retired version.
+void CompilerInstance::ReleaseRetiredCode() {
+  std::vector<orc::ResourceTrackerSP> Retired;
+  {
+    std::lock_guard<std::mutex> Lock(LiveLock);
+    Retired.swap(RetiredCode);
+  }
+  for (auto &RT : Retired) {
+    if (Error Err = RT->remove())
+      logAllUnhandledErrors(std::move(Err), Log, "Error: ");
+  }
+}
+
+// Report what went wrong in the worker on the thread of the instance.
+void CompilerInstance::FlushLiveErrors() {
+  std::string Errors;
+  {
+    std::lock_guard<std::mutex> Lock(LiveLock);
+    Errors.swap(LiveErrors);
+  }
+  Log << Errors;
+}
+
+// Compile the pending definitions reachable from Callees. Each one is
+// declared before its callees are visited, so recursive calls resolve,
+// and compiled after them.
+void CompilerInstance::CodegenReachable(const std::vector<Symbol> &Callees) {
+  for (Symbol Callee : Callees) {
+    if (Callee >= PendingFunctions.size() || !PendingFunctions[Callee])
+      continue;
+    std::unique_ptr<FunctionAST> FnAST = std::move(PendingFunctions[Callee]);
+    if (!lookupFunction(Callee))
+      FnAST->getProto().codegen(*this);
+
+    std::vector<Symbol> Next;
+    FnAST->collectCalls(Next);
+    CodegenReachable(Next);
+
+    if (auto *FnIR = FnAST->codegen(*this)) {
+      Log << "Read function definition:";
+      FnIR->print(Log);
+    }
+  }
+}
+
+void CompilerInstance::CodegenTopLevelExpression(
+    std::unique_ptr<FunctionAST> FnAST) {
+  if (Opts.Lazy) {
+    std::vector<Symbol> Callees;
+    FnAST->collectCalls(Callees);
+    CodegenReachable(Callees);
+    // the functions stay, only the expression module is dropped
+    if (Opts.Repl && !TheModule->empty())
+      AddModuleToJIT();
+  }
+
+  if (auto *FnIR = FnAST->codegen(*this)) {
+    if (Opts.Repl) {
+      EvaluateTopLevelExpression();
+      return;
     }
+    Log << "Read top level expr: ";
+    FnIR->print(Log);
+  }
+}
+
+void CompilerInstance::HandleTopLevelExpression() {
+  if (auto FnAST = ParseTopLevelExpr()) {
+    if (SnapshotOut)
+      FnAST->snapshot(*SnapshotOut, snap_expr);
+    else
+      CodegenTopLevelExpression(std::move(FnAST));
   } else {
-    fprintf(stderr, "No top level expr to handle.");
+    Log << "No top level expr to handle.";
     getNextToken();
   }
 }
 
-static void MainLoop() {
+// Rebuild an expression from its snapshot node. Children are written
+// before their parents, so asking for smaller indices also rules out
+// cycles in a damaged file.
+std::unique_ptr<ExprAST> CompilerInstance::LoadExpr(const SnapshotReader &R,
+                                                    uint32_t Idx,
+                                                    uint32_t Parent) {
+  const SnapshotNode *N = R.getNode(Idx);
+  if (!N || Idx >= Parent)
+    return LogErrorP("bad node in snapshot");
+
+  Symbol Sym;
+  double Val;
+  switch (N->kind) {
+  case snap_number:
+    if (!R.getNumber(N->a, Val))
+      return LogErrorP("bad number in snapshot");
+    return std::make_unique<NumberExprAST>(Val);
+  case snap_variable:
+    if (!R.getSymbol(N->a, Sym))
+      return LogErrorP("bad variable in snapshot");
+    return std::make_unique<VariableExprAST>(Sym);
+  case snap_binary: {
+    auto LHS = LoadExpr(R, N->a, Idx);
+    auto RHS = LoadExpr(R, N->b, Idx);
+    if (!LHS || !RHS)
+      return nullptr;
+    return std::make_unique<BinaryExprAST>(N->op, std::move(LHS),
+                                           std::move(RHS));
+  }
+  case snap_call: {
+    const uint32_t *ArgNodes = R.getList(N->b, N->c);
+    if (!ArgNodes || !R.getSymbol(N->a, Sym))
+      return LogErrorP("bad call in snapshot");
+    std::vector<std::unique_ptr<ExprAST>> Args;
+    for (uint32_t i = 0; i < N->c; i++) {
+      auto Arg = LoadExpr(R, ArgNodes[i], Idx);
+      if (!Arg)
+        return nullptr;
+      Args.push_back(std::move(Arg));
+    }
+    return std::make_unique<CallExprAST>(Sym, std::move(Args));
+  }
+  default:
+    return LogErrorP("unknown node in snapshot");
+  }
+}
+
+// Compile the items of a snapshot in order, as if they had been parsed.
+bool CompilerInstance::LoadSnapshot(const std::string &Path) {
+  SnapshotReader R;
+  std::string Error;
+  if (!R.open(Path, Error)) {
+    Log << Error << "\n";
+    return false;
+  }
+
+  BinopPrecedence.clear();
+  for (unsigned i = 0; i < R.numOperators(); i++)
+    BinopPrecedence[R.getOperator(i).op] = R.getOperator(i).prec;
+
+  for (unsigned i = 0; i < R.numItems(); i++) {
+    const SnapshotItem &Item = R.getItem(i);
+    const uint32_t *ArgNames = R.getList(Item.args, Item.numArgs);
+    Symbol Name;
+    if (!ArgNames || !R.getSymbol(Item.name, Name)) {
+      LogErrorP("bad prototype in snapshot");
+      return false;
+    }
+    std::vector<Symbol> Args(Item.numArgs);
+    for (uint32_t j = 0; j < Item.numArgs; j++) {
+      if (!R.getSymbol(ArgNames[j], Args[j])) {
+        LogErrorP("bad prototype in snapshot");
+        return false;
+      }
+    }
+    auto Proto = std::make_unique<PrototypeAST>(Name, std::move(Args));
+
+    if (Item.kind == snap_extern) {
+      CodegenExtern(std::move(Proto));
+      continue;
+    }
+    auto Body = LoadExpr(R, Item.body, R.numNodes());
+    if (!Body)
+      return false;
+    auto FnAST = std::make_unique<FunctionAST>(std::move(Proto),
+                                               std::move(Body));
+    if (Item.kind == snap_def) {
+      CodegenDefinition(std::move(FnAST));
+    } else if (Item.kind == snap_expr) {
+      CodegenTopLevelExpression(std::move(FnAST));
+    } else {
+      LogErrorP("unknown item in snapshot");
+      return false;
+    }
+  }
+  return true;
+}
+
+// Write the items collected by -emit-snapshot, with the operator table.
+bool CompilerInstance::WriteSnapshot(const std::string &Path) {
+  for (auto &Op : BinopPrecedence) {
+    if (Op.second > 0)
+      SnapshotOut->addOperator(Op.first, Op.second);
+  }
+  if (!SnapshotOut->write(Path)) {
+    Log << "unable to write " << Path << "\n";
+    return false;
+  }
+  Log << "Wrote " << SnapshotOut->numItems() << " items to " << Path << "\n";
+  return true;
+}
+
+// The host, with fused multiply-adds allowed in -ffast-math mode.
+static Expected<orc::JITTargetMachineBuilder>
+DetectHost(const CompilerOptions &Opts) {
+  auto JTMB = orc::JITTargetMachineBuilder::detectHost();
+  if (JTMB && Opts.FastMath) {
+    JTMB->getOptions().AllowFPOpFusion = FPOpFusion::Fast;
+    JTMB->getOptions().UnsafeFPMath = true;
+  }
+  return JTMB;
+}
+
+// The targets have to be initialized by the caller, once per process.
+static std::unique_ptr<orc::LLJIT> CreateJIT(const CompilerOptions &Opts,
+                                             raw_ostream &Log) {
+  auto JTMB = DetectHost(Opts);
+  if (!JTMB) {
+    logAllUnhandledErrors(JTMB.takeError(), Log, "Error: ");
+    return nullptr;
+  }
+  orc::LLJITBuilder JB;
+  JB.setJITTargetMachineBuilder(std::move(*JTMB));
+  // LiveWorker compiles while the instance compiles its expressions
+  if (Opts.Live)
+    JB.setCompileFunctionCreator([](orc::JITTargetMachineBuilder JTMB)
+        -> Expected<std::unique_ptr<orc::IRCompileLayer::IRCompiler>> {
+      return std::make_unique<orc::ConcurrentIRCompiler>(std::move(JTMB));
+    });
+  auto JIT = JB.create();
+  if (!JIT) {
+    logAllUnhandledErrors(JIT.takeError(), Log, "Error: ");
+    return nullptr;
+  }
+  // let externs such as sin and cos resolve to the C library
+  auto Gen = orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(
+      (*JIT)->getDataLayout().getGlobalPrefix());
+  if (!Gen) {
+    logAllUnhandledErrors(Gen.takeError(), Log, "Error: ");
+    return nullptr;
+  }
+  (*JIT)->getMainJITDylib().addGenerator(std::move(*Gen));
+  return std::move(*JIT);
+}
+
+// A JIT of the instance's own, which defines its code in the main
+// JITDylib.
+bool CompilerInstance::InitializeJIT() {
+  OwnedJIT = CreateJIT(Opts, Log);
+  return OwnedJIT && AttachJIT(*OwnedJIT, OwnedJIT->getMainJITDylib());
+}
+
+// A JIT shared with other instances, one after the other. The instance
+// defines its code in a JITDylib of its own, which falls back to main for
+// the C library and is removed with the instance.
+bool CompilerInstance::UseSharedJIT(orc::LLJIT &J) {
+  static std::atomic<unsigned> NextDylib(0);
+  auto JD = J.createJITDylib("request." + std::to_string(NextDylib++));
+  if (!JD) {
+    logAllUnhandledErrors(JD.takeError(), Log, "Error: ");
+    return false;
+  }
+  JD->addToLinkOrder(J.getMainJITDylib());
+  return AttachJIT(J, *JD);
+}
+
+bool CompilerInstance::AttachJIT(orc::LLJIT &J, orc::JITDylib &JD) {
+  TheJIT = &J;
+  TheJD = &JD;
+  TheModule->setDataLayout(TheJIT->getDataLayout());
+
+  if (Opts.Live) {
+    Stubs = orc::createLocalIndirectStubsManagerBuilder(
+        TheJIT->getTargetTriple())();
+    if (!Stubs) {
+      Log << "Error: no stubs for " << TheJIT->getTargetTriple().str()
+          << "\n";
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool WriteAll(int FD, const char *Data, size_t Size) {
+  while (Size) {
+    ssize_t N = write(FD, Data, Size);
+    if (N < 0 && errno == EINTR)
+      continue;
+    if (N <= 0)
+      return false;
+    Data += N;
+    Size -= N;
+  }
+  return true;
+}
+
+// The target machine of the host, for object files and for the cost
+// model of the optimizer.
+static std::unique_ptr<TargetMachine>
+CreateHostTargetMachine(const CompilerOptions &Opts, raw_ostream &Log) {
+  auto JTMB = DetectHost(Opts);
+  if (!JTMB) {
+    logAllUnhandledErrors(JTMB.takeError(), Log, "Error: ");
+    return nullptr;
+  }
+  JTMB->setRelocationModel(Reloc::PIC_);
+  auto TM = JTMB->createTargetMachine();
+  if (!TM) {
+    logAllUnhandledErrors(TM.takeError(), Log, "Error: ");
+    return nullptr;
+  }
+  return std::move(*TM);
+}
+
+// The target machine the server shares, or one created on first use.
+TargetMachine *CompilerInstance::GetHostTargetMachine() {
+  if (!HostTM) {
+    OwnedTM = CreateHostTargetMachine(Opts, Log);
+    HostTM = OwnedTM.get();
+  }
+  return HostTM;
+}
+
+// Compile the module of the request to an object file in memory.
+bool CompilerInstance::EmitObject(SmallVectorImpl<char> &Obj) {
+  TargetMachine *TM = GetHostTargetMachine();
+  if (!TM)
+    return false;
+
+  TheModule->setDataLayout(TM->createDataLayout());
+  TheModule->setTargetTriple(TM->getTargetTriple().str());
+  raw_svector_ostream OS(Obj);
+  legacy::PassManager PM;
+  if (TM->addPassesToEmitFile(PM, OS, nullptr, CGFT_ObjectFile)) {
+    Log << "Error: the target can not emit an object file\n";
+    return false;
+  }
+  PM.run(*TheModule);
+  return true;
+}
+
+// A request is a line with the mode (ir, eval, obj or quit) and an
+// optional file name, followed by the source unless a file was named.
+// The response is what the front-end prints; for obj it ends with a line
+// "object <size>" and the object file. Returns false on quit.
+//
+// Every request is compiled by a CompilerInstance of its own, which
+// evaluates in a JITDylib of its own, so nothing it defines outlives it.
+// The JIT and the target machine are the server's, created once; they
+// are not thread-safe, so requests are handled one at a time.
+static bool HandleRequest(int Client, const CompilerOptions &ServeOpts,
+                          orc::LLJIT &JIT, TargetMachine &TM) {
+  std::string Request;
+  char Buf[4096];
+  ssize_t N;
+  while ((N = read(Client, Buf, sizeof(Buf))) != 0) {
+    if (N < 0 && errno == EINTR)
+      continue;
+    if (N < 0)
+      return true;
+    Request.append(Buf, N);
+  }
+
+  size_t EOL = Request.find('\n');
+  std::string Header = Request.substr(0, EOL);
+  std::string Source = EOL == std::string::npos ? "" : Request.substr(EOL + 1);
+  size_t Space = Header.find(' ');
+  std::string Mode = Header.substr(0, Space);
+  std::string Path = Space == std::string::npos ? "" : Header.substr(Space + 1);
+
+  if (Mode == "quit")
+    return false;
+  if (Mode != "ir" && Mode != "eval" && Mode != "obj") {
+    std::string Error = "Error: unknown mode '" + Mode + "'\n";
+    WriteAll(Client, Error.data(), Error.size());
+    return true;
+  }
+
+  // fmemopen does not take an empty buffer
+  Source += '\n';
+  FILE *In = Path.empty() ? fmemopen(&Source[0], Source.size(), "r")
+                          : fopen(Path.c_str(), "r");
+  if (!In) {
+    std::string Error = "Error: unable to open " + Path + "\n";
+    WriteAll(Client, Error.data(), Error.size());
+    return true;
+  }
+
+  CompilerOptions Opts = ServeOpts;
+  Opts.Repl = Mode == "eval";
+  Opts.Live = Opts.Live && Opts.Repl;
+  Opts.Quiet = true;
+  std::string Response;
+  raw_string_ostream Log(Response);
+  SmallVector<char, 0> Obj;
+  bool HaveObj = false;
+  {
+    CompilerInstance C(Opts, Log);
+    C.HostTM = &TM;
+    if (!Opts.Repl || C.UseSharedJIT(JIT)) {
+      C.Compile(In);
+      HaveObj = Mode == "obj" && C.EmitObject(Obj);
+    }
+  }
+  fclose(In);
+
+  if (HaveObj)
+    Log << "object " << Obj.size() << "\n";
+  Log.flush();
+  WriteAll(Client, Response.data(), Response.size());
+  if (HaveObj)
+    WriteAll(Client, Obj.data(), Obj.size());
+  return true;
+}
+
+static int Serve(const std::string &Path, const CompilerOptions &Opts) {
+  sockaddr_un Addr;
+  memset(&Addr, 0, sizeof(Addr));
+  Addr.sun_family = AF_UNIX;
+  if (Path.size() >= sizeof(Addr.sun_path)) {
+    fprintf(stderr, "socket path too long: %s\n", Path.c_str());
+    return 1;
+  }
+  strcpy(Addr.sun_path, Path.c_str());
+
+  int Sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  unlink(Path.c_str());
+  if (Sock < 0 || bind(Sock, (sockaddr *)&Addr, sizeof(Addr)) != 0 ||
+      listen(Sock, 16) != 0) {
+    perror(Path.c_str());
+    return 1;
+  }
+  // a client that goes away must not kill the server
+  signal(SIGPIPE, SIG_IGN);
+  // kept warm for all requests
+  std::unique_ptr<orc::LLJIT> JIT = CreateJIT(Opts, errs());
+  std::unique_ptr<TargetMachine> TM = CreateHostTargetMachine(Opts, errs());
+  if (!JIT || !TM) {
+    close(Sock);
+    unlink(Path.c_str());
+    return 1;
+  }
+  fprintf(stderr, "Serving on %s\n", Path.c_str());
+
+  while (true) {
+    int Client = accept(Sock, nullptr, nullptr);
+    if (Client < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("accept");
+      break;
+    }
+    bool Continue = HandleRequest(Client, Opts, *JIT, *TM);
+    close(Client);
+    if (!Continue)
+      break;
+  }
+  close(Sock);
+  unlink(Path.c_str());
+  return 0;
+}
+
+// Build __map_kernel, which sets Out[i] = F(Cols[0][i], Cols[1][i], ...)
+// for i < N, converting int32 columns to double. Out does not alias the
+// columns, and F is inlined, so the loop vectorizes as a whole.
+Function *CompilerInstance::BuildMapKernel(Function *F, Type *ElemTy) {
+  Type *DoubleTy = Type::getDoubleTy(*TheContext);
+  Type *Int64Ty = Type::getInt64Ty(*TheContext);
+  PointerType *ColTy = PointerType::getUnqual(ElemTy);
+  FunctionType *FT = FunctionType::get(
+      Type::getVoidTy(*TheContext),
+      {PointerType::getUnqual(DoubleTy), PointerType::getUnqual(ColTy),
+       Int64Ty},
+      false);
+  Function *Kernel = Function::Create(FT, Function::ExternalLinkage,
+                                      "__map_kernel", TheModule.get());
+  Kernel->addParamAttr(0, Attribute::NoAlias);
+  Argument *Out = Kernel->getArg(0);
+  Argument *Cols = Kernel->getArg(1);
+  Argument *N = Kernel->getArg(2);
+
+  BasicBlock *Entry = BasicBlock::Create(*TheContext, "entry", Kernel);
+  BasicBlock *Loop = BasicBlock::Create(*TheContext, "loop", Kernel);
+  BasicBlock *Exit = BasicBlock::Create(*TheContext, "exit", Kernel);
+
+  Builder->SetInsertPoint(Entry);
+  std::vector<Value *> ColPtrs;
+  for (unsigned i = 0; i < F->arg_size(); i++)
+    ColPtrs.push_back(Builder->CreateLoad(
+        ColTy, Builder->CreateConstGEP1_64(ColTy, Cols, i), "col"));
+  Value *Zero = ConstantInt::get(Int64Ty, 0);
+  Builder->CreateCondBr(Builder->CreateICmpSGT(N, Zero), Loop, Exit);
+
+  Builder->SetInsertPoint(Loop);
+  PHINode *I = Builder->CreatePHI(Int64Ty, 2, "i");
+  I->addIncoming(Zero, Entry);
+  std::vector<Value *> Args;
+  for (Value *Col : ColPtrs) {
+    Value *V = Builder->CreateLoad(ElemTy, Builder->CreateGEP(ElemTy, Col, I));
+    if (ElemTy->isIntegerTy())
+      V = Builder->CreateSIToFP(V, DoubleTy);
+    Args.push_back(V);
+  }
+  Value *Result = Builder->CreateCall(F, Args, "calltmp");
+  Builder->CreateStore(Result, Builder->CreateGEP(DoubleTy, Out, I));
+  Value *Next = Builder->CreateAdd(I, ConstantInt::get(Int64Ty, 1), "next",
+                                   true, true);
+  I->addIncoming(Next, Loop);
+  Builder->CreateCondBr(Builder->CreateICmpSLT(Next, N), Loop, Exit);
+
+  Builder->SetInsertPoint(Exit);
+  Builder->CreateRetVoid();
+  verifyFunction(*Kernel);
+  return Kernel;
+}
+
+// Run the O3 pipeline over the module with the cost model of the host,
+// which the vectorizers need to pick a vector width.
+bool CompilerInstance::OptimizeModule(TargetMachine &TM) {
+  TheModule->setDataLayout(TM.createDataLayout());
+  TheModule->setTargetTriple(TM.getTargetTriple().str());
+
+  LoopAnalysisManager LAM;
+  FunctionAnalysisManager FAM;
+  CGSCCAnalysisManager CGAM;
+  ModuleAnalysisManager MAM;
+  PassBuilder PB(&TM);
+  PB.registerModuleAnalyses(MAM);
+  PB.registerCGSCCAnalyses(CGAM);
+  PB.registerFunctionAnalyses(FAM);
+  PB.registerLoopAnalyses(LAM);
+  PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+  ModulePassManager MPM =
+      PB.buildPerModuleDefaultPipeline(OptimizationLevel::O3);
+
+  std::unique_ptr<ToolOutputFile> RemarksOut;
+  if (!Opts.RemarksFile.empty()) {
+    auto Out = setupLLVMOptimizationRemarks(*TheContext, Opts.RemarksFile,
+                                            "", Opts.RemarksFormat, false);
+    if (!Out) {
+      logAllUnhandledErrors(Out.takeError(), Log, "Error: ");
+      return false;
+    }
+    RemarksOut = std::move(*Out);
+  }
+  MPM.run(*TheModule, MAM);
+  if (RemarksOut) {
+    // the JIT generates code for the module after the file is closed
+    TheContext->setLLVMRemarkStreamer(nullptr);
+    TheContext->setMainRemarkStreamer(nullptr);
+    RemarksOut->keep();
+  }
+  return true;
+}
+
+// Apply the kernel to binary columns, one file per argument, a chunk
+// of every column mapped at a time.
+bool CompilerInstance::MapBinary(MapKernel Kernel, size_t ElemSize,
+                                 FILE *Out) {
+  std::vector<int> FDs;
+  uint64_t Count = 0;
+  bool OK = true;
+  for (const std::string &Input : Opts.MapInputs) {
+    int FD = open(Input.c_str(), O_RDONLY);
+    struct stat St;
+    if (FD < 0 || fstat(FD, &St) != 0) {
+      Log << "map: unable to open " << Input << "\n";
+      if (FD >= 0)
+        close(FD);
+      OK = false;
+      break;
+    }
+    FDs.push_back(FD);
+    if (St.st_size % ElemSize != 0 ||
+        (FDs.size() > 1 && (uint64_t)St.st_size / ElemSize != Count)) {
+      Log << "map: " << Input << " does not match the other columns\n";
+      OK = false;
+      break;
+    }
+    Count = St.st_size / ElemSize;
+  }
+
+  std::vector<double> Result(MapChunk);
+  std::vector<const void *> Cols(FDs.size());
+  for (uint64_t First = 0; OK && First < Count; First += MapChunk) {
+    size_t Len = std::min<uint64_t>(MapChunk, Count - First);
+    for (unsigned i = 0; i < FDs.size(); i++) {
+      void *P = mmap(nullptr, Len * ElemSize, PROT_READ, MAP_PRIVATE, FDs[i],
+                     First * ElemSize);
+      if (P == MAP_FAILED) {
+        Log << "map: unable to map " << Opts.MapInputs[i] << "\n";
+        Cols.resize(i);
+        OK = false;
+        break;
+      }
+      madvise(P, Len * ElemSize, MADV_SEQUENTIAL);
+      Cols[i] = P;
+    }
+    if (OK) {
+      Kernel(Result.data(), Cols.data(), Len);
+      OK = fwrite(Result.data(), sizeof(double), Len, Out) == Len;
+      if (!OK)
+        Log << "map: write failed\n";
+    }
+    for (unsigned i = 0; i < Cols.size(); i++)
+      munmap((void *)Cols[i], Len * ElemSize);
+  }
+
+  for (int FD : FDs)
+    close(FD);
+  return OK;
+}
+
+// Parse a line of NumCols comma separated numbers into Cols at Row.
+static bool ParseCSVLine(const char *P, std::vector<std::vector<double>> &Cols,
+                         size_t Row) {
+  for (unsigned i = 0; i < Cols.size(); i++) {
+    char *End;
+    Cols[i][Row] = strtod(P, &End);
+    if (End == P)
+      return false;
+    P = End;
+    while (*P == ' ' || *P == '\t')
+      P++;
+    if (i + 1 < Cols.size() && *P++ != ',')
+      return false;
+  }
+  while (isspace(*P))
+    P++;
+  return *P == '\0';
+}
+
+// Apply the kernel to the records of a CSV file, a chunk of rows at a
+// time. The results are written one per line. A first line that is not
+// numbers is taken for a header and skipped.
+bool CompilerInstance::MapCSV(MapKernel Kernel, unsigned NumCols, FILE *Out) {
+  const std::string &Input = Opts.MapInputs[0];
+  FILE *In = fopen(Input.c_str(), "r");
+  if (!In) {
+    Log << "map: unable to open " << Input << "\n";
+    return false;
+  }
+
+  std::vector<std::vector<double>> Cols(NumCols,
+                                        std::vector<double>(MapChunk));
+  std::vector<const void *> ColPtrs;
+  for (auto &Col : Cols)
+    ColPtrs.push_back(Col.data());
+  std::vector<double> Result(MapChunk);
+  size_t Rows = 0;
+  auto Flush = [&] {
+    Kernel(Result.data(), ColPtrs.data(), Rows);
+    for (size_t i = 0; i < Rows; i++)
+      fprintf(Out, "%.17g\n", Result[i]);
+    Rows = 0;
+  };
+
+  char *Line = nullptr;
+  size_t Cap = 0;
+  unsigned long LineNo = 0;
+  bool OK = true;
+  while (getline(&Line, &Cap, In) >= 0) {
+    LineNo++;
+    const char *P = Line;
+    while (isspace(*P))
+      P++;
+    if (*P == '\0')
+      continue;
+    if (!ParseCSVLine(P, Cols, Rows)) {
+      if (LineNo == 1)
+        continue;
+      Log << "map: " << Input << ":" << LineNo << ": expected " << NumCols
+          << " numbers\n";
+      OK = false;
+      break;
+    }
+    if (++Rows == MapChunk)
+      Flush();
+  }
+  if (OK && Rows)
+    Flush();
+  free(Line);
+  fclose(In);
+  return OK;
+}
+
+// Compile a kernel that applies MapFunction to whole columns and run it
+// over MapInputs, streaming the results to MapOutput (stdout if empty).
+bool CompilerInstance::RunMap() {
+  const std::string &MapFunction = Opts.MapFunction;
+  Symbol Name = intern(MapFunction);
+  CodegenReachable({Name});
+  Function *F = lookupFunction(Name);
+  if (!F || F->empty()) {
+    Log << "map: no definition of " << MapFunction << "\n";
+    return false;
+  }
+  unsigned NumCols = F->arg_size();
+  if (NumCols == 0) {
+    Log << "map: " << MapFunction << " takes no arguments\n";
+    return false;
+  }
+  unsigned NumInputs = Opts.MapInputFormat == map_csv ? 1 : NumCols;
+  if (Opts.MapInputs.size() != NumInputs) {
+    Log << "map: " << MapFunction << " takes " << NumCols
+        << " arguments, expected " << NumInputs << " input files but got "
+        << Opts.MapInputs.size() << "\n";
+    return false;
+  }
+
+  TargetMachine *TM = GetHostTargetMachine();
+  if (!TM)
+    return false;
+  Type *ElemTy = Opts.MapInputFormat == map_i32
+                     ? Type::getInt32Ty(*TheContext)
+                     : Type::getDoubleTy(*TheContext);
+  Function *Kernel = BuildMapKernel(F, ElemTy);
+  if (!OptimizeModule(*TM))
+    return false;
+  Log << "Map kernel:";
+  Kernel->print(Log);
+  if (!AddModuleToJIT())
+    return false;
+  auto Sym = TheJIT->lookup(*TheJD, "__map_kernel");
+  if (!Sym) {
+    logAllUnhandledErrors(Sym.takeError(), Log, "Error: ");
+    return false;
+  }
+  auto KernelFP = (MapKernel)(intptr_t)Sym->getAddress();
+
+  const std::string &MapOutput = Opts.MapOutput;
+  FILE *Out = MapOutput.empty() ? stdout : fopen(MapOutput.c_str(), "wb");
+  if (!Out) {
+    Log << "map: unable to open " << MapOutput << "\n";
+    return false;
+  }
+  bool OK = Opts.MapInputFormat == map_csv
+                ? MapCSV(KernelFP, NumCols, Out)
+                : MapBinary(KernelFP,
+                            Opts.MapInputFormat == map_i32 ? 4 : 8, Out);
+  if (fflush(Out) != 0 || (Out != stdout && fclose(Out) != 0)) {
+    Log << "map: unable to write " << MapOutput << "\n";
+    OK = false;
+  }
+  return OK;
+}
+
+void CompilerInstance::MainLoop() {
   while (1) {
+    if (Opts.Live)
+      FlushLiveErrors();
+    if (Opts.Repl && !Opts.Quiet)
+      Log << "ready> ";
     switch (CurTok) {
       case tok_eof:
         return;
@@ -439,19 +1745,180 @@ static void MainLoop() {
   }
 }
 
-int main() {
-  BinopPrecedence['<'] = 10;
-  BinopPrecedence['+'] = 20;
-  BinopPrecedence['-'] = 20;
-  BinopPrecedence['*'] = 40;
+void CompilerInstance::Compile(FILE *In) {
+  Lex.setInput(In);
+  getNextToken();
+  MainLoop();
+}
 
-  getNextToken();  
-  TheModule = std::make_unique<Module>("my cool jit", TheContext);
+// -stress=N: compile the program on N threads at once, Rounds times on
+// each, every compilation with an instance of its own, and compare what
+// they print with a single compilation beforehand.
+static int Stress(const CompilerOptions &Opts, unsigned Threads,
+                  unsigned Rounds) {
+  std::string Source;
+  char Buf[4096];
+  size_t N;
+  while ((N = fread(Buf, 1, sizeof(Buf), stdin)) > 0)
+    Source.append(Buf, N);
+  // fmemopen does not take an empty buffer
+  Source += '\n';
+
+  auto Run = [&](std::string &Out) {
+    raw_string_ostream Log(Out);
+    std::string Copy = Source;
+    FILE *In = fmemopen(&Copy[0], Copy.size(), "r");
+    if (!In) {
+      Log << "unable to open the source\n";
+      return;
+    }
+    {
+      CompilerInstance C(Opts, Log);
+      if (!Opts.Repl || C.InitializeJIT())
+        C.Compile(In);
+    }
+    fclose(In);
+    Log.flush();
+  };
+
+  std::string Reference;
+  Run(Reference);
+  errs() << Reference;
+
+  std::atomic<unsigned> Differed(0);
+  auto Start = std::chrono::steady_clock::now();
+  std::vector<std::thread> Workers;
+  for (unsigned t = 0; t < Threads; t++) {
+    Workers.emplace_back([&] {
+      for (unsigned r = 0; r < Rounds; r++) {
+        std::string Out;
+        Run(Out);
+        if (Out != Reference)
+          Differed++;
+      }
+    });
+  }
+  for (auto &W : Workers)
+    W.join();
+  std::chrono::duration<double> Elapsed =
+      std::chrono::steady_clock::now() - Start;
+
+  errs() << format("stress: %u threads x %u rounds, %u compilations in "
+                   "%.2f s, %u differed\n",
+                   Threads, Rounds, Threads * Rounds, Elapsed.count(),
+                   Differed.load());
+  return Differed ? 1 : 0;
+}
 
-  MainLoop();
+int main(int argc, char **argv) {
+  CompilerOptions Opts;
+  std::string EmitSnapshot, LoadSnapshotFile, ServePath;
+  unsigned StressThreads = 0, StressRounds = 10;
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-repl")) {
+      Opts.Repl = true;
+    } else if (!strcmp(argv[i], "-live")) {
+      Opts.Repl = Opts.Live = true;
+    } else if (!strcmp(argv[i], "-lazy")) {
+      Opts.Lazy = true;
+    } else if (!strncmp(argv[i], "-emit-snapshot=", 15)) {
+      EmitSnapshot = argv[i] + 15;
+    } else if (!strncmp(argv[i], "-load-snapshot=", 15)) {
+      LoadSnapshotFile = argv[i] + 15;
+    } else if (!strncmp(argv[i], "-serve=", 7)) {
+      ServePath = argv[i] + 7;
+    } else if (!strcmp(argv[i], "-ffast-math")) {
+      Opts.FastMath = true;
+    } else if (!strncmp(argv[i], "-map=", 5)) {
+      Opts.MapFunction = argv[i] + 5;
+    } else if (!strncmp(argv[i], "-map-input=", 11)) {
+      Opts.MapInputs.push_back(argv[i] + 11);
+    } else if (!strcmp(argv[i], "-map-format=f64")) {
+      Opts.MapInputFormat = map_f64;
+    } else if (!strcmp(argv[i], "-map-format=i32")) {
+      Opts.MapInputFormat = map_i32;
+    } else if (!strcmp(argv[i], "-map-format=csv")) {
+      Opts.MapInputFormat = map_csv;
+    } else if (!strncmp(argv[i], "-map-output=", 12)) {
+      Opts.MapOutput = argv[i] + 12;
+    } else if (!strncmp(argv[i], "-remarks=", 9)) {
+      Opts.RemarksFile = argv[i] + 9;
+    } else if (!strcmp(argv[i], "-remarks-format=yaml") ||
+               !strcmp(argv[i], "-remarks-format=bitstream")) {
+      Opts.RemarksFormat = argv[i] + 16;
+    } else if (!strncmp(argv[i], "-stress=", 8) && atoi(argv[i] + 8) > 0) {
+      StressThreads = atoi(argv[i] + 8);
+    } else if (!strncmp(argv[i], "-stress-rounds=", 15) &&
+               atoi(argv[i] + 15) > 0) {
+      StressRounds = atoi(argv[i] + 15);
+    } else {
+      fprintf(stderr, "usage: %s [-repl | -live] [-lazy] [-ffast-math] "
+              "[-emit-snapshot=file | -load-snapshot=file | -serve=socket]\n"
+              "       %s [-lazy] [-ffast-math] [-load-snapshot=file] "
+              "-map=function -map-input=file... [-map-format=f64|i32|csv] "
+              "[-map-output=file] [-remarks=file] "
+              "[-remarks-format=yaml|bitstream]\n"
+              "       %s [-repl] [-lazy] [-ffast-math] -stress=threads "
+              "[-stress-rounds=n]\n", argv[0], argv[0], argv[0]);
+      return 1;
+    }
+  }
+  // the kernel is built in the module of the whole program
+  if (!Opts.MapFunction.empty() &&
+      (Opts.Repl || !ServePath.empty() || !EmitSnapshot.empty())) {
+    fprintf(stderr, "-map can not be combined with -repl, -live, -serve or "
+            "-emit-snapshot\n");
+    return 1;
+  }
+  // the -map kernel is the only code that goes through the optimizer
+  if (!Opts.RemarksFile.empty() && Opts.MapFunction.empty()) {
+    fprintf(stderr, "-remarks needs -map\n");
+    return 1;
+  }
+  // a lazily compiled definition lands in the module of an expression
+  if (Opts.Live && (Opts.Lazy || !EmitSnapshot.empty())) {
+    fprintf(stderr, "-live can not be combined with -lazy or "
+            "-emit-snapshot\n");
+    return 1;
+  }
+  // the output of a -live compilation depends on when its worker installs
+  if (StressThreads &&
+      (Opts.Live || !Opts.MapFunction.empty() || !ServePath.empty() ||
+       !EmitSnapshot.empty() || !LoadSnapshotFile.empty())) {
+    fprintf(stderr, "-stress can not be combined with -live, -map, -serve "
+            "or snapshots\n");
+    return 1;
+  }
+  Opts.EmitSnapshot = !EmitSnapshot.empty();
+
+  InitializeNativeTarget();
+  InitializeNativeTargetAsmPrinter();
+  if (!ServePath.empty())
+    return Serve(ServePath, Opts);
+  if (StressThreads) {
+    Opts.Quiet = true;
+    return Stress(Opts, StressThreads, StressRounds);
+  }
+
+  CompilerInstance C(Opts, errs());
+  if ((Opts.Repl || !Opts.MapFunction.empty()) && !C.InitializeJIT())
+    return 1;
+
+  if (!LoadSnapshotFile.empty()) {
+    if (!C.LoadSnapshot(LoadSnapshotFile))
+      return 1;
+    return Opts.MapFunction.empty() || C.RunMap() ? 0 : 1;
+  }
 
-  // TheModule->print(errs(), nullptr);
+  C.Compile(stdin);
+
+  if (!Opts.MapFunction.empty())
+    return C.RunMap() ? 0 : 1;
+
+  if (C.SnapshotOut && !C.WriteSnapshot(EmitSnapshot))
+    return 1;
+
+  // C.TheModule->print(errs(), nullptr);
 
   return 0;
 }
-
@@ -0,0 +1,207 @@
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "../include/snapshot.h"
+
+// writer
+uint32_t SnapshotWriter::addString(Symbol sym) {
+  if (sym >= SymbolStrings.size())
+    SymbolStrings.resize(sym + 1, ~0u);
+  if (SymbolStrings[sym] == ~0u) {
+    SymbolStrings[sym] = StrOffsets.size();
+    StrOffsets.push_back(StrData.size());
+    StrData += symbolName(sym);
+    StrData += '\0';
+  }
+  return SymbolStrings[sym];
+}
+
+uint32_t SnapshotWriter::addNode(SnapshotNodeKind kind, uint8_t op,
+                                 uint32_t a, uint32_t b, uint32_t c) {
+  SnapshotNode node = {};
+  node.kind = kind;
+  node.op = op;
+  node.a = a;
+  node.b = b;
+  node.c = c;
+  Nodes.push_back(node);
+  return Nodes.size() - 1;
+}
+
+void SnapshotWriter::addOperator(char op, int prec) {
+  Operators.push_back({op, prec});
+}
+
+uint32_t SnapshotWriter::addNumber(double val) {
+  Numbers.push_back(val);
+  return addNode(snap_number, 0, Numbers.size() - 1, 0, 0);
+}
+
+uint32_t SnapshotWriter::addVariable(Symbol name) {
+  return addNode(snap_variable, 0, addString(name), 0, 0);
+}
+
+uint32_t SnapshotWriter::addBinary(char op, uint32_t lhs, uint32_t rhs) {
+  return addNode(snap_binary, op, lhs, rhs, 0);
+}
+
+uint32_t SnapshotWriter::addCall(Symbol callee,
+                                 const std::vector<uint32_t> &args) {
+  uint32_t first = Lists.size();
+  Lists.insert(Lists.end(), args.begin(), args.end());
+  return addNode(snap_call, 0, addString(callee), first, args.size());
+}
+
+void SnapshotWriter::addItem(SnapshotItemKind kind, Symbol name,
+                             const std::vector<Symbol> &args, uint32_t body) {
+  SnapshotItem item = {};
+  item.kind = kind;
+  item.name = addString(name);
+  item.args = Lists.size();
+  item.numArgs = args.size();
+  item.body = body;
+  for (Symbol arg : args)
+    Lists.push_back(addString(arg));
+  Items.push_back(item);
+}
+
+// every section starts 8 byte aligned, for the doubles of the constants
+static void appendSection(std::string &out, SnapshotSection &s,
+                          const void *data, size_t bytes, size_t count) {
+  out.resize((out.size() + 7) & ~(size_t)7, '\0');
+  s.offset = out.size();
+  s.count = count;
+  out.append((const char *)data, bytes);
+}
+
+template <typename T>
+static void appendSection(std::string &out, SnapshotSection &s,
+                          const std::vector<T> &v) {
+  appendSection(out, s, v.data(), v.size() * sizeof(T), v.size());
+}
+
+bool SnapshotWriter::write(const std::string &path) const {
+  SnapshotHeader header = {};
+  header.magic = SnapshotMagic;
+  header.version = SnapshotVersion;
+
+  std::string out(sizeof(header), '\0');
+  appendSection(out, header.strOffsets, StrOffsets);
+  appendSection(out, header.strData, StrData.data(), StrData.size(),
+                StrData.size());
+  appendSection(out, header.operators, Operators);
+  appendSection(out, header.numbers, Numbers);
+  appendSection(out, header.nodes, Nodes);
+  appendSection(out, header.lists, Lists);
+  appendSection(out, header.items, Items);
+  header.size = out.size();
+  memcpy(&out[0], &header, sizeof(header));
+
+  FILE *f = fopen(path.c_str(), "wb");
+  if (!f)
+    return false;
+  bool ok = fwrite(out.data(), 1, out.size(), f) == out.size();
+  return fclose(f) == 0 && ok;
+}
+
+// reader
+SnapshotReader::~SnapshotReader() {
+  if (Base)
+    munmap((void *)Base, Size);
+}
+
+static bool inside(const SnapshotSection &s, size_t elemSize, size_t size) {
+  return s.offset % 8 == 0 && s.offset <= size &&
+         s.count <= (size - s.offset) / elemSize;
+}
+
+bool SnapshotReader::open(const std::string &path, std::string &Error) {
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    Error = "unable to open " + path;
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(SnapshotHeader)) {
+    close(fd);
+    Error = path + " is not a snapshot";
+    return false;
+  }
+  Size = st.st_size;
+  void *p = mmap(nullptr, Size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) {
+    Error = "unable to map " + path;
+    return false;
+  }
+  Base = (const char *)p;
+  Header = (const SnapshotHeader *)Base;
+
+  if (Header->magic != SnapshotMagic || Header->size != Size) {
+    Error = path + " is not a snapshot";
+    return false;
+  }
+  if (Header->version != SnapshotVersion) {
+    Error = path + ": unsupported snapshot version " +
+            std::to_string(Header->version);
+    return false;
+  }
+  if (!inside(Header->strOffsets, sizeof(uint32_t), Size) ||
+      !inside(Header->strData, 1, Size) ||
+      !inside(Header->operators, sizeof(SnapshotOperator), Size) ||
+      !inside(Header->numbers, sizeof(double), Size) ||
+      !inside(Header->nodes, sizeof(SnapshotNode), Size) ||
+      !inside(Header->lists, sizeof(uint32_t), Size) ||
+      !inside(Header->items, sizeof(SnapshotItem), Size)) {
+    Error = path + ": section out of range";
+    return false;
+  }
+
+  // the string data has to end with a NUL, so every name is terminated
+  const char *Data = section<char>(Header->strData);
+  uint32_t DataSize = Header->strData.count;
+  if (DataSize && Data[DataSize - 1] != '\0') {
+    Error = path + ": bad string table";
+    return false;
+  }
+  const uint32_t *Offsets = section<uint32_t>(Header->strOffsets);
+  Symbols.reserve(Header->strOffsets.count);
+  for (uint32_t idx = 0; idx < Header->strOffsets.count; idx++) {
+    if (Offsets[idx] >= DataSize) {
+      Error = path + ": bad string table";
+      return false;
+    }
+    Symbols.push_back(intern(Data + Offsets[idx]));
+  }
+  return true;
+}
+
+const SnapshotNode *SnapshotReader::getNode(uint32_t idx) const {
+  if (idx >= Header->nodes.count)
+    return nullptr;
+  return &section<SnapshotNode>(Header->nodes)[idx];
+}
+
+bool SnapshotReader::getNumber(uint32_t idx, double &val) const {
+  if (idx >= Header->numbers.count)
+    return false;
+  val = section<double>(Header->numbers)[idx];
+  return true;
+}
+
+const uint32_t *SnapshotReader::getList(uint32_t first,
+                                        uint32_t count) const {
+  if (first > Header->lists.count || count > Header->lists.count - first)
+    return nullptr;
+  return section<uint32_t>(Header->lists) + first;
+}
+
+bool SnapshotReader::getSymbol(uint32_t idx, Symbol &sym) const {
+  if (idx >= Symbols.size())
+    return false;
+  sym = Symbols[idx];
+  return true;
+}
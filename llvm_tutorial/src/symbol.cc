@@ -0,0 +1,69 @@
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "../include/symbol.h"
+
+// open addressing table of symbol ids, hashed by name. It is the one table
+// all compilations of the process share, so ids compare across them; Lock
+// guards it, and the names live in a deque, so the reference symbolName()
+// returns stays valid while other threads intern.
+static const Symbol EmptyBucket = ~0u;
+static std::mutex Lock;
+static std::deque<std::string> Names;
+static std::vector<uint32_t> Hashes;
+static std::vector<Symbol> Buckets(64, EmptyBucket);
+
+static uint32_t hashName(const std::string &name) {
+  // FNV-1a
+  uint32_t hash = 2166136261u;
+  for (unsigned char c : name) {
+    hash ^= c;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static void grow() {
+  std::vector<Symbol> NewBuckets(Buckets.size() * 2, EmptyBucket);
+  size_t mask = NewBuckets.size() - 1;
+  for (Symbol sym = 0; sym < Names.size(); sym++) {
+    size_t idx = Hashes[sym] & mask;
+    while (NewBuckets[idx] != EmptyBucket)
+      idx = (idx + 1) & mask;
+    NewBuckets[idx] = sym;
+  }
+  Buckets.swap(NewBuckets);
+}
+
+Symbol intern(const std::string &name) {
+  uint32_t hash = hashName(name);
+  std::lock_guard<std::mutex> Guard(Lock);
+  size_t mask = Buckets.size() - 1;
+  size_t idx = hash & mask;
+  while (Buckets[idx] != EmptyBucket) {
+    Symbol sym = Buckets[idx];
+    if (Hashes[sym] == hash && Names[sym] == name)
+      return sym;
+    idx = (idx + 1) & mask;
+  }
+
+  Symbol sym = Names.size();
+  Names.push_back(name);
+  Hashes.push_back(hash);
+  Buckets[idx] = sym;
+  // keep the load factor under 3/4
+  if (Names.size() * 4 > Buckets.size() * 3)
+    grow();
+  return sym;
+}
+
+const std::string &symbolName(Symbol sym) {
+  std::lock_guard<std::mutex> Guard(Lock);
+  return Names[sym];
+}
+
+unsigned numSymbols() {
+  std::lock_guard<std::mutex> Guard(Lock);
+  return Names.size();
+}
@@ -1,33 +1,39 @@
+#include <cstdio>
 #include <iostream>
 #include <map>
 #include <string>
 #include "../include/token.h"
 
-static char LastChar = ' ', ThisChar;
-TokenInfo gettok() {
+TokenInfo Lexer::gettok() {
   TokenInfo retValue;
   std::string IdentifierStr;
   double NumVal;
 
   while (isspace(LastChar))
-    LastChar = getchar();
+    LastChar = getc(Input);
 
   // identifier or keywords (def, extern)
   if (isalpha(LastChar)) {
+    // keywords are recognized by their interned id
+    static const Symbol SymDef = intern("def");
+    static const Symbol SymExtern = intern("extern");
+
     IdentifierStr = LastChar;
-    while (isalnum((LastChar = getchar())))
+    while (isalnum((LastChar = getc(Input))))
       IdentifierStr += LastChar;
 
-    if (IdentifierStr == "def") {
+    Symbol sym = intern(IdentifierStr);
+    if (sym == SymDef) {
       retValue.tok = tok_def;
       return retValue;
     }
-    if (IdentifierStr == "extern") {
+    if (sym == SymExtern) {
       retValue.tok = tok_extern;
       return retValue;
     }
     retValue.tok = tok_identifier;
     retValue.identifierStr = IdentifierStr;
+    retValue.identifierSym = sym;
     return retValue;
   }
 
@@ -36,7 +42,7 @@ TokenInfo gettok() {
     std::string NumStr;
     do {
       NumStr += LastChar;
-      LastChar = getchar();
+      LastChar = getc(Input);
     } while (isdigit(LastChar) || LastChar == '.');
     NumVal = strtod(NumStr.c_str(), 0);
 
@@ -60,14 +66,14 @@ TokenInfo gettok() {
   // comments
   if (LastChar == '#') {
     do {
-      LastChar = getchar();
+      LastChar = getc(Input);
     } while (LastChar != EOF && LastChar != '\n' && LastChar != '\r');
     retValue.tok = tok_comm;
     return retValue;
   }
 
-  ThisChar = LastChar;
-  LastChar = getchar();
+  char ThisChar = LastChar;
+  LastChar = getc(Input);
   // std::cout << "WARNNING: unknown char : " << ThisChar << std::endl;
   retValue.tok = ThisChar;
   return retValue;